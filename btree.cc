@@ -1,6 +1,13 @@
 #include <assert.h>
 #include <math.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
+#include <map>
 #include "btree.h"
+#include "btree_fixed.h"
 
 KeyValuePair::KeyValuePair()
 {}
@@ -25,20 +32,123 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
     return *( new (this) KeyValuePair(rhs));
 }
 
+static SIZE_T RuntimeFindKey(const BTreeNode &node, const KEY_T &key)
+{
+    return node.FindKey(key);
+}
+
+static ERROR_T RuntimeGetPtr(const BTreeNode &node, const SIZE_T offset, SIZE_T &ptr)
+{
+    return node.GetPtr(offset,ptr);
+}
+
+static bool RuntimeMatchKey(const BTreeNode &leaf, const SIZE_T offset, const KEY_T &key)
+{
+    return memcmp(leaf.ResolveKey(offset),key.data,leaf.info.keysize)==0;
+}
+
+static ERROR_T RuntimeGetVal(const BTreeNode &leaf, const SIZE_T offset, VALUE_T &value)
+{
+    return leaf.GetVal(offset,value);
+}
+
+static ERROR_T RuntimeSetVal(BTreeNode &leaf, const SIZE_T offset, const VALUE_T &value)
+{
+    return leaf.SetVal(offset,value);
+}
+
+static ERROR_T RuntimeInsertLeaf(BTreeNode &leaf, const SIZE_T offset,
+                                 const KEY_T &key, const VALUE_T &value)
+{
+    return leaf.InsertSlot(offset,key,value);
+}
+
+// The split thresholds stay zero until Attach reads the superblock
+// and SetupSplits works them out; until then, there is nothing to
+// specialize on
+static const BTreeNodeOps unattached_nodeops = {
+    RuntimeFindKey, RuntimeGetPtr, RuntimeMatchKey, RuntimeGetVal, RuntimeSetVal,
+    RuntimeInsertLeaf, 0, 0, false
+};
+
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
         SIZE_T valuesize,
         BufferCache *cache,
-        bool unique) 
+        bool unique,
+        int nodeformat,
+        int keytype) 
 {
     superblock.info.keysize=keysize;
     superblock.info.valuesize=valuesize;
+    superblock.info.nodeformat=nodeformat;
+    superblock.info.keytype=keytype;
+    superblock.info.splitfill=BTREE_DEFAULT_SPLITFILL;
+    superblock.info.splitratio=BTREE_DEFAULT_SPLITRATIO;
+    superblock.info.appendratio=BTREE_DEFAULT_APPENDRATIO;
+    superblock.info.bufferratio=0;
+    superblock.info.tombstones=0;
     buffercache=cache;
+    nodeops=unattached_nodeops;
+    deletemode=BTREE_DELETE_MERGE;
+    splitmode=BTREE_SPLIT_MIDDLE;
+    insertmode=BTREE_INSERT_BOTTOMUP;
+    latchmode=BTREE_LATCH_NONE;
+    writemode=BTREE_WRITE_INPLACE;
+    commits=0;
+    pthread_mutex_init(&supermutex,0);
+    numframes=0;
+    frames=0;
+    versions=0;
+    compactevery=0;
+    compactbudget=0;
+    compactops=0;
+    compacting=false;
+    appendrun=0;
+    rightleaf=0;
+    appendhits=0;
+    appendmisses=0;
+    superdirty=false;
+    bufferedmessages=0;
+    appliedmessages=0;
+    leafbatches=0;
+    nodewrites=0;
+    decodedclock=0;
+    decodedhits=0;
+    decodedmisses=0;
+    writeops=0;
     // note: ignoring unique now
 }
 
 BTreeIndex::BTreeIndex()
 {
-    // shouldn't have to do anything
+    nodeops=unattached_nodeops;
+    deletemode=BTREE_DELETE_MERGE;
+    splitmode=BTREE_SPLIT_MIDDLE;
+    insertmode=BTREE_INSERT_BOTTOMUP;
+    latchmode=BTREE_LATCH_NONE;
+    writemode=BTREE_WRITE_INPLACE;
+    commits=0;
+    pthread_mutex_init(&supermutex,0);
+    numframes=0;
+    frames=0;
+    versions=0;
+    compactevery=0;
+    compactbudget=0;
+    compactops=0;
+    compacting=false;
+    appendrun=0;
+    rightleaf=0;
+    appendhits=0;
+    appendmisses=0;
+    superdirty=false;
+    bufferedmessages=0;
+    appliedmessages=0;
+    leafbatches=0;
+    nodewrites=0;
+    decodedclock=0;
+    decodedhits=0;
+    decodedmisses=0;
+    writeops=0;
 }
 
 
@@ -50,11 +160,41 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
     buffercache=rhs.buffercache;
     superblock_index=rhs.superblock_index;
     superblock=rhs.superblock;
+    nodeops=rhs.nodeops;
+    deletemode=rhs.deletemode;
+    splitmode=rhs.splitmode;
+    insertmode=rhs.insertmode;
+    // the copy is not attached, so it starts with no latching
+    latchmode=BTREE_LATCH_NONE;
+    writemode=BTREE_WRITE_INPLACE;
+    commits=0;
+    pthread_mutex_init(&supermutex,0);
+    numframes=0;
+    frames=0;
+    versions=0;
+    compactevery=rhs.compactevery;
+    compactbudget=rhs.compactbudget;
+    compactops=0;
+    compacting=false;
+    appendrun=0;
+    rightleaf=0;
+    appendhits=0;
+    appendmisses=0;
+    superdirty=false;
+    bufferedmessages=0;
+    appliedmessages=0;
+    leafbatches=0;
+    nodewrites=0;
+    decodedclock=0;
+    decodedhits=0;
+    decodedmisses=0;
+    writeops=0;
 }
 
 BTreeIndex::~BTreeIndex()
 {
-    // shouldn't have to do anything
+    FreeFrames();
+    pthread_mutex_destroy(&supermutex);
 }
 
 
@@ -64,25 +204,243 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
+thread_local map<SIZE_T, Block> BTreeIndex::writeset;
+thread_local vector<SIZE_T> BTreeIndex::freed;
+thread_local bool BTreeIndex::superdirty;
+thread_local int BTreeIndex::counted;
+thread_local vector<SIZE_T> BTreeIndex::latched;
+thread_local bool BTreeIndex::rootchanged;
+thread_local SIZE_T BTreeIndex::restarts;
+thread_local set<SIZE_T> BTreeIndex::visited;
+thread_local set<SIZE_T> BTreeIndex::allocated;
+
+
+ERROR_T BTreeIndex::ReadNode(const SIZE_T block, BTreeNode &node) const
+{
+    map<SIZE_T, Block>::const_iterator i=writeset.find(block);
+    ERROR_T rc;
+
+    if (i!=writeset.end()) { 
+        rc=node.Unserialize(i->second);
+    } else {
+        rc=node.Unserialize(buffercache,block);
+    }
+    if (!rc && writemode==BTREE_WRITE_COPY &&
+        (node.info.nodetype==BTREE_ROOT_NODE || node.info.nodetype==BTREE_INTERIOR_NODE)) { 
+        // the parent of anything changed below it
+        visited.insert(block);
+    }
+    return rc;
+}
+
+
+ERROR_T BTreeIndex::WriteNode(const SIZE_T block, const BTreeNode &node)
+{
+    assert((unsigned)node.info.blocksize==buffercache->GetBlockSize());
+
+    if (latchmode==BTREE_LATCH_NONE) { 
+        decoded.erase(block);
+    }
+    return node.Serialize(writeset[block]);
+}
+
+
+ERROR_T BTreeIndex::ReadDecoded(const SIZE_T block,
+        BTreeNode &scratch,
+        const BTreeNode *&node)
+{
+    map<SIZE_T, DecodedNode>::iterator i=decoded.find(block);
+    map<SIZE_T, DecodedNode>::iterator oldest;
+    ERROR_T rc;
+
+    if (latchmode!=BTREE_LATCH_NONE) { 
+        // the copies are shared, so each thread decodes its own
+        node=&scratch;
+        return ReadNode(block,scratch);
+    }
+
+    if (i!=decoded.end()) { 
+        i->second.lastused=++decodedclock;
+        decodedhits++;
+        if (writemode==BTREE_WRITE_COPY) { 
+            visited.insert(block);
+        }
+        node=&i->second.node;
+        return ERROR_NOERROR;
+    }
+
+    rc=ReadNode(block,scratch);
+    if (rc) { return rc; }
+    node=&scratch;
+    if (scratch.info.nodetype!=BTREE_ROOT_NODE &&
+        scratch.info.nodetype!=BTREE_INTERIOR_NODE) { 
+        return ERROR_NOERROR;
+    }
+    decodedmisses++;
+
+    if (decoded.size()>=BTREE_DECODED_NODES) { 
+        // drop the least recently used; the tree's upper levels are
+        // used on every descent, so they stay
+        oldest=decoded.begin();
+        for (i=decoded.begin();i!=decoded.end();++i) { 
+            if (i->second.lastused<oldest->second.lastused) { 
+                oldest=i;
+            }
+        }
+        decoded.erase(oldest);
+    }
+    i=decoded.insert(make_pair(block,DecodedNode(scratch,++decodedclock))).first;
+    node=&i->second.node;
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FlushNodes(const ERROR_T oprc)
+{
+    map<SIZE_T, Block>::const_iterator i;
+    vector<SIZE_T> retiring;
+    SIZE_T n=0;
+    LSN_T lsn;
+    ERROR_T rc=ERROR_NOERROR;
+    ERROR_T commitrc;
+
+    if (writemode==BTREE_WRITE_COPY) { 
+        rc=oprc ? oprc : CopyOnWrite(retiring);
+        if (rc) { 
+            return AbandonWrites(rc);
+        }
+    }
+    if (latchmode==BTREE_LATCH_OPTIMISTIC) { 
+        // lookups see all of the operation's nodes, or none of them
+        for (i=writeset.begin();i!=writeset.end();i++) { 
+            LockVersion(i->first);
+        }
+        if (rootchanged) { 
+            LockVersion(superblock_index);
+        }
+    }
+    // in block order
+    for (i=writeset.begin();i!=writeset.end() && !rc;i++) { 
+        rc=buffercache->WriteBlock(i->first,i->second);
+        n++;
+    }
+    if (latchmode==BTREE_LATCH_OPTIMISTIC) { 
+        for (i=writeset.begin();i!=writeset.end();i++) { 
+            PublishNode(i->first,i->second);
+            UnlockVersion(i->first);
+        }
+        if (rootchanged) { 
+            pthread_mutex_lock(&supermutex);
+            publishedroot=superblock.info.rootnode;
+            pthread_mutex_unlock(&supermutex);
+            UnlockVersion(superblock_index);
+        }
+    }
+    if (latchmode!=BTREE_LATCH_NONE || writemode==BTREE_WRITE_COPY) { 
+        for (SIZE_T f=0;f<freed.size() && !rc;f++) { 
+            rc=FreeBlock(freed[f]);
+            n++;
+        }
+        freed.clear();
+    }
+    if (writemode==BTREE_WRITE_COPY && !rc) { 
+        if (n || !retiring.empty()) { 
+            // the new version is all in the cache
+            pthread_mutex_lock(&supermutex);
+            commits++;
+            publishedroot=superblock.info.rootnode;
+            for (SIZE_T r=0;r<retiring.size();r++) { 
+                retired.push_back(make_pair(commits,retiring[r]));
+            }
+            pthread_mutex_unlock(&supermutex);
+        }
+        rc=ReclaimBlocks(n);
+        visited.clear();
+        allocated.clear();
+    }
+    pthread_mutex_lock(&supermutex);
+    superblock.info.numkeys+=counted;
+    counted=0;
+    if (superdirty && !rc) { 
+        rc=superblock.Serialize(buffercache,superblock_index);
+        n++;
+    }
+    if (n) { 
+        nodewrites+=n;
+        writeops++;
+    }
+    // with a redo log, the operation's writes are one record, logged
+    // in the order that the operations changed the superblock in
+    commitrc=buffercache->Commit(lsn);
+    pthread_mutex_unlock(&supermutex);
+    // the free blocks are written before the disk hears they are free
+    for (SIZE_T f=0;f<freed.size();f++) { 
+        buffercache->NotifyDeallocateBlock(freed[f]);
+    }
+    writeset.clear();
+    freed.clear();
+    superdirty=false;
+    rootchanged=false;
+    if (!commitrc) { 
+        // along with any other commits that share the log flush
+        commitrc=buffercache->WaitForCommit(lsn);
+    }
+    if (!rc) { 
+        rc=commitrc;
+    }
+
+    return oprc ? oprc : rc;
+}
+
+
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
+    pthread_mutex_lock(&supermutex);
+
     n=superblock.info.freelist;
 
+    if (n==0 && writemode==BTREE_WRITE_COPY && !retired.empty()) { 
+        // the snapshots holding on to some may have ended since
+        pthread_mutex_unlock(&supermutex);
+        ReclaimBlocks(n);
+        pthread_mutex_lock(&supermutex);
+        n=superblock.info.freelist;
+    }
     if (n==0) { 
+        pthread_mutex_unlock(&supermutex);
         return ERROR_NOSPACE;
     }
 
-    BTreeNode node;
+    if (n==superblock.info.freerun) { 
+        // a block that has never been used points at the next one, so
+        // there is no need to read it
+        superblock.info.freerun = n+1<buffercache->GetNumBlocks() ? n+1 : 0;
+        superblock.info.freelist=superblock.info.freerun;
+    } else {
+        BTreeNode node;
+
+        ReadNode(n,node);
+
+        assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
 
-    node.Unserialize(buffercache,n);
+        superblock.info.freelist=node.info.freelist;
+    }
 
-    assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+    pthread_mutex_unlock(&supermutex);
 
-    superblock.info.freelist=node.info.freelist;
+    superdirty=true;
 
-    superblock.Serialize(buffercache,superblock_index);
+    if (writemode==BTREE_WRITE_COPY) { 
+        allocated.insert(n);
+    }
 
-    buffercache->NotifyAllocateBlock(n);
+    // a block freed by this operation is still allocated on the disk
+    vector<SIZE_T>::iterator f=find(freed.begin(),freed.end(),n);
+    if (f!=freed.end()) { 
+        freed.erase(f);
+    } else {
+        buffercache->NotifyAllocateBlock(n);
+    }
 
     return ERROR_NOERROR;
 }
@@ -92,32 +450,49 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
     BTreeNode node;
 
-    node.Unserialize(buffercache,n);
+    ReadNode(n,node);
 
     assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
 
     node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
 
+    if (latchmode!=BTREE_LATCH_NONE || writemode==BTREE_WRITE_COPY) { 
+        // other threads share the free list, so the block goes on it
+        // in FlushNodes, once nothing this operation wrote points at it;
+        // copy on write may keep it for a snapshot
+        writeset.erase(n);
+        freed.push_back(n);
+        superdirty=true;
+        return ERROR_NOERROR;
+    }
+
     node.info.freelist=superblock.info.freelist;
 
-    node.Serialize(buffercache,n);
+    WriteNode(n,node);
+    freed.push_back(n);
 
     superblock.info.freelist=n;
 
-    superblock.Serialize(buffercache,superblock_index);
-
-    buffercache->NotifyDeallocateBlock(n);
+    superdirty=true;
 
     return ERROR_NOERROR;
-
 }
 
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
     ERROR_T rc;
 
+    if (create && superblock.info.keytype==BTREE_KEY_INT &&
+        superblock.info.keysize!=4 && superblock.info.keysize!=8) { 
+        // integer keys are 32 or 64 bits; the index is left unattached
+        return ERROR_SIZE;
+    }
+
     superblock_index=initblock;
     assert(superblock_index==0);
+    rightleaf=0;
+    decoded.clear();
 
     if (create) {
         // build a super block, root node, and a free space list
@@ -128,10 +503,18 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
         BTreeNode newsuperblock(BTREE_SUPERBLOCK,
                 superblock.info.keysize,
                 superblock.info.valuesize,
-                buffercache->GetBlockSize());
+                buffercache->GetBlockSize(),
+                superblock.info.nodeformat,
+                superblock.info.keytype);
         newsuperblock.info.rootnode=superblock_index+1;
         newsuperblock.info.freelist=superblock_index+2;
+        newsuperblock.info.freerun=superblock_index+2;
         newsuperblock.info.numkeys=0;
+        newsuperblock.info.splitfill=superblock.info.splitfill;
+        newsuperblock.info.splitratio=superblock.info.splitratio;
+        newsuperblock.info.appendratio=superblock.info.appendratio;
+        newsuperblock.info.bufferratio=superblock.info.bufferratio;
+        newsuperblock.info.tombstones=superblock.info.tombstones;
 
         buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -144,10 +527,15 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
         BTreeNode newrootnode(BTREE_ROOT_NODE,
                 superblock.info.keysize,
                 superblock.info.valuesize,
-                buffercache->GetBlockSize());
+                buffercache->GetBlockSize(),
+                superblock.info.nodeformat,
+                superblock.info.keytype);
         newrootnode.info.rootnode=superblock_index+1;
         newrootnode.info.freelist=superblock_index+2;
         newrootnode.info.numkeys=0;
+        newrootnode.info.bufferratio=superblock.info.bufferratio;
+        // the first leaves are copies of the root
+        newrootnode.info.tombstones=superblock.info.tombstones;
 
         buffercache->NotifyAllocateBlock(superblock_index+1);
 
@@ -161,7 +549,9 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
             BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
                     superblock.info.keysize,
                     superblock.info.valuesize,
-                    buffercache->GetBlockSize());
+                    buffercache->GetBlockSize(),
+                    superblock.info.nodeformat,
+                    superblock.info.keytype);
             newfreenode.info.rootnode=superblock_index+1;
             newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
 
@@ -176,88 +566,241 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 
     // OK, now, mounting the btree is simply a matter of reading the superblock 
 
-    return superblock.Unserialize(buffercache,initblock);
+    rc=superblock.Unserialize(buffercache,initblock);
+    if (rc) { return rc; }
+
+    // and deciding how to search, split and delete from its nodes
+    deletemode = superblock.info.tombstones ? BTREE_DELETE_TOMBSTONE : BTREE_DELETE_MERGE;
+    SetupNodeOps();
+
+    return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::SetupNodeOps()
+{
+    const BTreeNodeOps *fixed=LookupFixedNodeOps(superblock.info);
+
+    nodeops = fixed ? *fixed : unattached_nodeops;
+    SetupSplits();
+}
+
+
+// The thresholds are worked out only once, here, rather than on every
+// split check, from the slot counts and the policy in the superblock
+void BTreeIndex::SetupSplits()
+{
+    SIZE_T leafslots=superblock.info.GetNumSlotsAsLeaf();
+    SIZE_T interiorslots=superblock.info.GetNumSlotsAsInterior();
+    SIZE_T fill=superblock.info.splitfill;
+
+    if (fill) { 
+        nodeops.leafsplit=leafslots*fill/100;
+        nodeops.interiorsplit=interiorslots*fill/100;
+    } else {
+        nodeops.leafsplit=(SIZE_T)(int)(leafslots*(2./3.));
+        nodeops.interiorsplit=(SIZE_T)(int)(interiorslots*(2./3.));
+    }
+    // Redistribution lets leaves fill up
+    if (splitmode==BTREE_SPLIT_REDISTRIBUTE) { 
+        nodeops.leafsplit=leafslots;
+    }
+    // Both halves of a split must keep a key, and an interior split
+    // also promotes one, so tiny blocks need a higher threshold
+    if (nodeops.leafsplit<2) { 
+        nodeops.leafsplit=2;
+    }
+    if (nodeops.interiorsplit<3) { 
+        nodeops.interiorsplit=3;
+    }
+    // A B-link node is split before it fills its last slot, which
+    // holds its high key
+    if (latchmode==BTREE_LATCH_BLINK) { 
+        if (nodeops.leafsplit>=leafslots) { 
+            nodeops.leafsplit=leafslots-1;
+        }
+        if (nodeops.interiorsplit>=interiorslots) { 
+            nodeops.interiorsplit=interiorslots-1;
+        }
+    }
+}
+
+
+void BTreeIndex::SetSplitMode(const int mode)
+{
+    splitmode=mode;
+    if (nodeops.leafsplit) { 
+        // else not attached yet; Attach does this
+        SetupSplits();
+    }
+}
+
+
+ERROR_T BTreeIndex::SetSplitPolicy(const SIZE_T fill,
+        const SIZE_T ratio,
+        const SIZE_T appendratio)
+{
+    if (fill>100 || ratio<1 || ratio>99 || appendratio>100) { 
+        return ERROR_SIZE;
+    }
+    superblock.info.splitfill=fill;
+    superblock.info.splitratio=ratio;
+    superblock.info.appendratio=appendratio;
+    if (nodeops.leafsplit) { 
+        // written out with the superblock at Detach
+        SetupSplits();
+    }
+    return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::GetSplitPolicy(SIZE_T &fill, SIZE_T &ratio, SIZE_T &appendratio) const
+{
+    fill=superblock.info.splitfill;
+    ratio=superblock.info.splitratio;
+    appendratio=superblock.info.appendratio;
+}
+
+
+ERROR_T BTreeIndex::SetMessageBuffers(const SIZE_T percent)
+{
+    NodeMetadata info=superblock.info;
+
+    if (nodeops.leafsplit) { 
+        // the nodes already have their layout
+        return ERROR_CONFLICT;
+    }
+    if (latchmode!=BTREE_LATCH_NONE || writemode==BTREE_WRITE_COPY) { 
+        return ERROR_BADCONFIG;
+    }
+    if (percent>=100) { 
+        return ERROR_SIZE;
+    }
+    info.blocksize=buffercache->GetBlockSize();
+    info.bufferratio=percent;
+    if (percent && (info.GetNumSlotsAsInterior()<3 || info.GetNumMessageSlots()<2)) { 
+        return ERROR_SIZE;
+    }
+    superblock.info.bufferratio=percent;
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetDeleteMode(const int mode)
+{
+    if (mode!=BTREE_DELETE_MERGE && mode!=BTREE_DELETE_TOMBSTONE) { 
+        return ERROR_BADCONFIG;
+    }
+    if (!nodeops.leafsplit) { 
+        // the leaves get their layout at Attach
+        superblock.info.tombstones = mode==BTREE_DELETE_TOMBSTONE;
+    } else if (mode==BTREE_DELETE_TOMBSTONE && !superblock.info.tombstones) { 
+        // the leaves have no room to mark a key deleted
+        return ERROR_CONFLICT;
+    }
+    deletemode=mode;
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetNodeOps(const SIZE_T keysize,
+        const SIZE_T valuesize,
+        const SIZE_T blocksize,
+        const int nodeformat,
+        const BTreeNodeOps &ops)
+{
+    // the specialized layouts have no message buffers or tombstones
+    if (superblock.info.keysize!=keysize ||
+        superblock.info.valuesize!=valuesize ||
+        superblock.info.blocksize!=blocksize ||
+        superblock.info.nodeformat!=nodeformat ||
+        superblock.info.bufferratio || superblock.info.tombstones) { 
+        return ERROR_SIZE;
+    }
+    nodeops=ops;
+    SetupSplits();
+    return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::UseRuntimeNodeOps()
+{
+    nodeops=unattached_nodeops;
+    SetupSplits();
 }
 
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
+    SIZE_T n=0;
+    ERROR_T rc;
+
+    if (!nodeops.leafsplit) { 
+        // never attached, so there is no superblock to write
+        return ERROR_NONEXISTENT;
+    }
+    initblock=superblock_index;
+
+    // whatever no open snapshot can see
+    rc=ReclaimBlocks(n);
+    if (rc) { return rc; }
     return superblock.Serialize(buffercache,superblock_index);
 }
 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-        const BTreeOp op,
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
         const KEY_T &key,
         VALUE_T &value)
 {
-    BTreeNode b;
+    BTreePath path;
+    BTreeNode leaf;
     ERROR_T rc;
     SIZE_T offset;
-    KEY_T testkey;
-    SIZE_T ptr;
 
-    rc= b.Unserialize(buffercache,node);
+    // ERROR_NONEXISTENT if there are no keys at all
+    if (latchmode==BTREE_LATCH_NONE) { 
+        rc=FindLeaf(&key,path,leaf);
+    } else if (latchmode==BTREE_LATCH_OPTIMISTIC && op==BTREE_OP_LOOKUP) { 
+        rc=FindLeafOptimistic(key,path,leaf);
+    } else if (latchmode==BTREE_LATCH_BLINK) { 
+        rc=FindLeafLinked(key,op,path,leaf);
+    } else {
+        rc=FindLeafLatched(key,op,path,leaf);
+    }
+    if (rc) { return rc; }
 
-    if (rc!=ERROR_NOERROR) { 
-        return rc;
+    // the first key that's larger or equal is the matching key, if
+    // there is one
+    offset=path.slot[path.depth-1];
+    if (offset==leaf.info.numkeys) { 
+        return ERROR_NONEXISTENT;
+    }
+    if (nodeops.matchkey(leaf,offset,key) && !leaf.IsTombstone(offset)) { 
+        if (op==BTREE_OP_LOOKUP) { 
+            return nodeops.getval(leaf,offset,value);
+        } else { 
+            // BTREE_OP_UPDATE
+            rc=nodeops.setval(leaf,offset,value);
+            if (rc) { return rc; }
+            return WriteNode(path.Leaf(),leaf);
+        }
     }
+    return ERROR_NONEXISTENT;
+}
 
-    switch (b.info.nodetype) { 
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            // Scan through key/ptr pairs
-            //and recurse if possible
-            for (offset=0;offset<b.info.numkeys;offset++) { 
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (key<testkey || key==testkey) {
-                    // OK, so we now have the first key that's larger
-                    // so we ned to recurse on the ptr immediately previous to 
-                    // this one, if it exists
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    return LookupOrUpdateInternal(ptr,op,key,value);
-                }
-            }
-            // if we got here, we need to go to the next pointer, if it exists
-            if (b.info.numkeys>0) { 
-                rc=b.GetPtr(b.info.numkeys,ptr);
-                if (rc) { return rc; }
-                return LookupOrUpdateInternal(ptr,op,key,value);
-            } else {
-                // There are no keys at all on this node, so nowhere to go
-                return ERROR_NONEXISTENT;
-            }
-            break;
-        case BTREE_LEAF_NODE:
-            // Scan through keys looking for matching value
-            for (offset=0;offset<b.info.numkeys;offset++) { 
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (testkey==key) { 
-                    if (op==BTREE_OP_LOOKUP) { 
-                        return b.GetVal(offset,value);
-                    } else { 
-                        // BTREE_OP_UPDATE
-                        rc=b.SetVal(offset,value);
-                        if (rc) { return rc; }
-                        return b.Serialize(buffercache,node);
-                    }
-                }
-            }
-            return ERROR_NONEXISTENT;
-            break;
-        default:
-            // We can't be looking at anything other than a root, internal, or leaf
-            return ERROR_INSANE;
-            break;
-    }  
 
-    return ERROR_INSANE;
+static ostream & PrintKey(ostream &os, const BTreeNode &b, const KEY_T &key)
+{
+    if (b.info.keytype==BTREE_KEY_INT) { 
+        os << DecodeIntKey(key.data,b.info.keysize);
+    } else {
+        for (unsigned i=0;i<b.info.keysize;i++) { 
+            os << key.data[i];
+        }
+    }
+    return os;
 }
 
-
 static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
 {
     KEY_T key;
@@ -291,8 +834,22 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                     if (offset==b.info.numkeys) break;
                     rc=b.GetKey(offset,key);
                     if (rc) {  return rc; }
-                    for (i=0;i<b.info.keysize;i++) { 
-                        os << key.data[i];
+                    PrintKey(os,b,key);
+                    os << " ";
+                }
+                // then the buffered messages: +key value for an insert,
+                // =key value for an update, and -key for a delete
+                for (offset=0;dt==BTREE_DEPTH && offset<b.GetNumMessages();offset++) { 
+                    int type;
+                    rc=b.GetMessage(offset,type,key,value);
+                    if (rc) { return rc; }
+                    os << (type==BTREE_MESSAGE_INSERT ? "+" : type==BTREE_MESSAGE_UPDATE ? "=" : "-");
+                    PrintKey(os,b,key);
+                    if (type!=BTREE_MESSAGE_DELETE) { 
+                        os << " ";
+                        for (i=0;i<b.info.valuesize;i++) { 
+                            os << value.data[i];
+                        }
                     }
                     os << " ";
                 }
@@ -312,14 +869,19 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                         os << "*" << ptr << " ";
                     }
                 }
+                if (b.IsTombstone(offset)) { 
+                    // deleted keys are only shown in the tree
+                    if (dt==BTREE_SORTED_KEYVAL) { 
+                        continue;
+                    }
+                    os << "~";
+                }
                 if (dt==BTREE_SORTED_KEYVAL) { 
                     os << "(";
                 }
                 rc=b.GetKey(offset,key);
                 if (rc) {  return rc; }
-                for (i=0;i<b.info.keysize;i++) { 
-                    os << key.data[i];
-                }
+                PrintKey(os,b,key);
                 if (dt==BTREE_SORTED_KEYVAL) { 
                     os << ",";
                 } else {
@@ -350,463 +912,3556 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
     return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+ERROR_T BTreeIndex::MakeKey(const char *text, KEY_T &key) const
 {
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    if (superblock.info.keytype==BTREE_KEY_INT) { 
+        char *end;
+        errno=0;
+        long long v=strtoll(text,&end,10);
+        if (errno || end==text || *end) { 
+            return ERROR_SIZE;
+        }
+        return EncodeIntKey(v,superblock.info.keysize,key);
+    } else {
+        key=KEY_T(text);
+        return ERROR_NOERROR;
+    }
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
 {
-    SIZE_T newnode=(SIZE_T)0;
-    KEY_T newkey;
     ERROR_T rc;
 
-    rc=InsertRecursion(superblock.info.rootnode, key, value, newkey, newnode);
-    if (rc) { return rc; }
-
-    // case where we need to add a new root node
-    if (newnode) {
-        BTreeNode oldRoot;
-        rc=oldRoot.Unserialize(buffercache,superblock.info.rootnode);
-        if (rc) { return rc; }
-        BTreeNode newRoot=oldRoot;
-
-        newRoot.info.numkeys=1;
-        rc=newRoot.SetKey(0,newkey);
-        if (rc) { return rc; }
-        rc=newRoot.SetPtr(0,superblock.info.rootnode);
-        if (rc) { return rc; }
-        rc=newRoot.SetPtr(1,newnode);
-        if (rc) { return rc; }
-
-        // allocate space for newRoot on the disk
-        SIZE_T newRootBlock;
-        rc=AllocateNode(newRootBlock);
-        if (rc) { return rc; }
-
-        // update superblock to point to new root
-        superblock.info.rootnode=newRootBlock;
-
-        // serialize newRoot to the disk
-        rc=newRoot.Serialize(buffercache,newRootBlock);
-        if (rc) { return rc; }
+    CountOp();
+    if (superblock.info.bufferratio) { 
+        return LookupBuffered(key,value);
     }
-    superblock.info.numkeys++;
-    return ERROR_NOERROR;
+    rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value);
+    ReleaseLatches();
+    return rc;
 }
 
-ERROR_T BTreeIndex::InsertRecursion(const SIZE_T &node, const KEY_T &key, const VALUE_T &value, KEY_T &newkey, SIZE_T &newnode)
+ERROR_T BTreeIndex::LookupBatch(const vector<KEY_T> &keys,
+        vector<VALUE_T> &values,
+        vector<ERROR_T> &statuses)
 {
-    // first do lookup to find the leaf node we need to insert into
-    // insert and split if necessary, return pointer to newnode if splitting
-    // after recursive call returns, fix up pointers if there was a new node
-
-    BTreeNode b;
-    ERROR_T rc;
+    // the keys waiting at each node of the current level, in block order
+    map<SIZE_T, vector<SIZE_T> > level;
+    map<SIZE_T, vector<SIZE_T> >::iterator n, group;
+    // prefetch no more than half the cache ahead, or the later blocks of
+    // a group would push out the earlier ones before they are used
+    SIZE_T window=buffercache->GetCacheSize()/2;
     SIZE_T offset;
-    KEY_T testkey;
     SIZE_T ptr;
+    SIZE_T i, j;
+    ERROR_T rc;
 
-    rc= b.Unserialize(buffercache,node);
+    if (window==0) { 
+        window=1;
+    }
 
-    if (rc!=ERROR_NOERROR) { 
-        return rc;
+    values.assign(keys.size(),VALUE_T());
+    statuses.assign(keys.size(),ERROR_NONEXISTENT);
+    if (superblock.info.bufferratio) { 
+        // each key's messages are on its own way down
+        for (i=0;i<keys.size();i++) { 
+            statuses[i]=LookupBuffered(keys[i],values[i]);
+            if (statuses[i]!=ERROR_NOERROR && statuses[i]!=ERROR_NONEXISTENT &&
+                statuses[i]!=ERROR_SIZE) { 
+                return statuses[i];
+            }
+        }
+        return ERROR_NOERROR;
+    }
+    for (i=0;i<keys.size();i++) { 
+        if (keys[i].length!=superblock.info.keysize) { 
+            statuses[i]=ERROR_SIZE;
+        } else {
+            level[superblock.info.rootnode].push_back(i);
+        }
     }
 
-    switch (b.info.nodetype) { 
-        case BTREE_ROOT_NODE:
-            if (b.info.numkeys==0) {
-                BTreeNode leaf1=b;
-                BTreeNode leaf2=b;
-                leaf1.info.numkeys=1;
-                leaf2.info.numkeys=0;
-                leaf1.info.nodetype=BTREE_LEAF_NODE;
-                leaf2.info.nodetype=BTREE_LEAF_NODE;
+    while (!level.empty()) { 
+        map<SIZE_T, vector<SIZE_T> > next;
 
-                b.info.numkeys++;
-                rc=leaf1.SetKey(0,key);
-                if (rc) { return rc; }
-                rc=leaf1.SetVal(0,value);
-                if (rc) { return rc; }
-                rc=b.SetKey(0,key);
-                if (rc) { return rc; }
-                
-                // allocate space for leaves
-                SIZE_T leafBlock1;
-                SIZE_T leafBlock2;
-                rc=AllocateNode(leafBlock1);
-                if (rc) { return rc; }
-                rc=AllocateNode(leafBlock2);
+        for (group=level.begin();group!=level.end();) { 
+            // start reading the whole group, then visit it
+            for (n=group, j=0;n!=level.end() && j<window;++n, j++) { 
+                buffercache->PrefetchBlock(n->first);
+            }
+            for (;group!=n;++group) { 
+                const vector<SIZE_T> &waiting=group->second;
+                BTreeNode scratch;
+                const BTreeNode *node;
+
+                rc=ReadDecoded(group->first,scratch,node);
                 if (rc) { return rc; }
-                // update Ptrs of root node
-                rc=b.SetPtr(0,leafBlock1);
+                const BTreeNode &b=*node;
+
+                switch (b.info.nodetype) { 
+                    case BTREE_ROOT_NODE:
+                        if (b.info.numkeys==0) { 
+                            // empty tree, nothing to find
+                            break;
+                        }
+                    case BTREE_INTERIOR_NODE:
+                        for (i=0;i<waiting.size();i++) { 
+                            rc=nodeops.getptr(b,nodeops.findkey(b,keys[waiting[i]]),ptr);
+                            if (rc) { return rc; }
+                            next[ptr].push_back(waiting[i]);
+                        }
+                        break;
+                    case BTREE_LEAF_NODE:
+                        for (i=0;i<waiting.size();i++) { 
+                            offset=nodeops.findkey(b,keys[waiting[i]]);
+                            if (offset>=b.info.numkeys) { 
+                                continue;
+                            }
+                            if (nodeops.matchkey(b,offset,keys[waiting[i]]) && !b.IsTombstone(offset)) { 
+                                rc=nodeops.getval(b,offset,values[waiting[i]]);
+                                if (rc) { return rc; }
+                                statuses[waiting[i]]=ERROR_NOERROR;
+                            }
+                        }
+                        break;
+                    default:
+                        return ERROR_INSANE;
+                }
+            }
+        }
+        level.swap(next);
+    }
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanFn fn, void *arg)
+{
+    BTreeCursor cursor(this);
+    KEY_T key;
+    VALUE_T value;
+    ERROR_T rc;
+
+    if (lo.length!=superblock.info.keysize || hi.length!=superblock.info.keysize) { 
+        return ERROR_SIZE;
+    }
+
+    if (superblock.info.bufferratio) { 
+        // The range's messages, merged into the leaves' pairs as they
+        // go by, without flushing them
+        map<KEY_T, pair<int, VALUE_T> > messages;
+        map<KEY_T, pair<int, VALUE_T> >::const_iterator m;
+        ERROR_T at;   // the cursor's: on a pair, or past the last one
+        bool inleaf;
+
+        rc=CollectMessages(superblock.info.rootnode,&lo,&hi,messages);
+        if (rc) { return rc; }
+        m=messages.begin();
+        at=cursor.SeekLeaf(lo);
+        while (1) { 
+            if (at && at!=ERROR_NONEXISTENT) { 
+                return at;
+            }
+            inleaf=false;
+            if (!at) { 
+                rc=cursor.GetKey(key);
+                if (rc) { return rc; }
+                inleaf=memcmp(key.data,hi.data,superblock.info.keysize)<=0;
+            }
+            if (!inleaf && m==messages.end()) { 
+                return ERROR_NOERROR;
+            }
+            if (m!=messages.end() && (!inleaf || !(key<m->first))) { 
+                // the message is newer than the leaf's pair, if any
+                if (m->second.first!=BTREE_MESSAGE_DELETE &&
+                    !fn(m->first,m->second.second,arg)) { 
+                    return ERROR_NOERROR;
+                }
+                if (inleaf && key==m->first) { 
+                    at=cursor.Next();
+                }
+                ++m;
+                continue;
+            }
+            rc=cursor.GetVal(value);
+            if (rc) { return rc; }
+            if (!fn(key,value,arg)) { 
+                return ERROR_NOERROR;
+            }
+            at=cursor.Next();
+        }
+    }
+
+    for (rc=cursor.Seek(lo); rc==ERROR_NOERROR; rc=cursor.Next()) { 
+        rc=cursor.GetKey(key);
+        if (rc) { return rc; }
+        if (memcmp(key.data,hi.data,superblock.info.keysize)>0) { 
+            return ERROR_NOERROR;
+        }
+        rc=cursor.GetVal(value);
+        if (rc) { return rc; }
+        if (!fn(key,value,arg)) { 
+            return ERROR_NOERROR;
+        }
+    }
+    // ran off the end of the leaves
+    return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
+
+ostream & BTreeIndex::PrintKey(ostream &os, const KEY_T &key) const
+{
+    return ::PrintKey(os,superblock,key);
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+    ERROR_T rc;
+
+    CountOp();
+    if (superblock.info.bufferratio) { 
+        rc=BufferMessage(BTREE_MESSAGE_INSERT,key,value);
+    } else {
+        rc=InsertInternal(key,value);
+    }
+    if (!rc) { 
+        CountKeys(1);
+    }
+    rc=FlushNodes(rc);
+    // the changes are in the cache before anyone else can see them
+    ReleaseLatches();
+    return rc;
+}
+
+//
+// Insert
+//
+// The key goes into the leaf FindLeaf comes to.  A leaf that fills up
+// splits, and the new leaf gets a pointer in the parent, one step back
+// up the path; that may split the parent, and so on up to the root,
+// which when it splits gets a new root above it.
+//
+
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value)
+{
+    BTreePath path;
+    BTreeNode b;
+    bool appended;
+    ERROR_T rc;
+
+    if (latchmode==BTREE_LATCH_NONE) { 
+        rc=AppendToRightLeaf(key,value,appended);
+        if (rc) { return rc; }
+        if (appended) { 
+            appendhits++;
+            return ERROR_NOERROR;
+        }
+        appendmisses++;
+
+        if (insertmode==BTREE_INSERT_TOPDOWN) { 
+            return InsertTopDown(key,value);
+        }
+        rc=FindLeaf(&key,path,b);
+    } else if (latchmode==BTREE_LATCH_BLINK) { 
+        return InsertLinked(key,value);
+    } else {
+        rc=FindLeafLatched(key,BTREE_OP_INSERT,path,b);
+    }
+
+    if (rc==ERROR_NONEXISTENT) { 
+        return InsertFirst(key,value);
+    } else if (rc) { 
+        return rc;
+    }
+    return InsertIntoLeaf(path,b,key,value);
+}
+
+ERROR_T BTreeIndex::InsertIntoLeaf(BTreePath &path,
+        BTreeNode &b,
+        const KEY_T &key,
+        const VALUE_T &value)
+{
+    KEY_T newkey;
+    SIZE_T newnode=(SIZE_T)0;
+    SIZE_T node;
+    SIZE_T offset;
+    SIZE_T next;
+    SIZE_T level;
+    bool atend;
+    ERROR_T rc;
+
+    // FindLeaf found the first key that's larger or equal
+    // if it is a matching key, return ERROR_CONFLICT, unless
+    // it was deleted, when it comes back with the new value
+    // otherwise insert our key at that offset
+    level=path.depth-1;
+    node=path.block[level];
+    offset=path.slot[level];
+    if (offset<b.info.numkeys && nodeops.matchkey(b,offset,key)) { 
+        if (!b.IsTombstone(offset)) { 
+            return ERROR_CONFLICT;
+        }
+        rc=nodeops.setval(b,offset,value);
+        if (rc) { return rc; }
+        rc=b.SetTombstone(offset,false);
+        if (rc) { return rc; }
+        return WriteNode(node,b);
+    }
+    // if there is no key larger than the new key, offset==numkeys
+    // and it goes on the end of b
+    rc=b.GetPtr(0,next);
+    if (rc) { return rc; }
+    atend=offset==b.info.numkeys && next==0;
+    if (latchmode==BTREE_LATCH_NONE) { 
+        if (next==0) { 
+            rightleaf=node;
+        }
+        appendrun = atend ? appendrun+1 : 0;
+    }
+    rc=nodeops.insertleaf(b,offset,key,value);
+    if (rc) { return rc; }
+    atend=atend && Appending();
+
+    if (b.info.numkeys < nodeops.leafsplit) { 
+        rc=WriteNode(node,b);
+    } else if (splitmode==BTREE_SPLIT_REDISTRIBUTE && !atend && latchmode==BTREE_LATCH_NONE) { 
+        // make room for the leaf in a neighbour, or split it and a
+        // full neighbour three ways
+        BTreeNode parent;
+        rc=WriteNode(node,b);
+        if (rc) { return rc; }
+        rc=ReadNode(path.block[level-1],parent);
+        if (rc) { return rc; }
+        rc=RedistributeLeaf(parent,path.slot[level-1],newkey,newnode);
+        if (rc) { return rc; }
+        rc=WriteNode(path.block[level-1],parent);
+    } else {
+        rc=SplitNode(node,b,atend ? superblock.info.appendratio : superblock.info.splitratio,
+                     newkey,newnode);
+    }
+    if (rc) { return rc; }
+
+    // Walk back up the path while there is a new node to point to.
+    // The root is never a leaf, so the leaf has a parent.
+    while (newnode && level>0) { 
+        level--;
+        node=path.block[level];
+        offset=path.slot[level];
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+        // newkey goes at offset and newnode immediately to its right
+        atend=offset==b.info.numkeys && Appending();
+        rc=b.InsertSlot(offset,newkey,newnode);
+        if (rc) { return rc; }
+        if (nodeops.interiorsplit <= b.info.numkeys) { 
+            rc=SplitNode(node,b,atend ? superblock.info.appendratio : superblock.info.splitratio,
+                         newkey,newnode);
+        } else {
+            newnode=(SIZE_T)0;
+            rc=WriteNode(node,b);
+        }
+        if (rc) { return rc; }
+    }
+
+    if (newnode) { 
+        return GrowRoot(newkey,newnode);
+    }
+    return ERROR_NOERROR;
+}
+
+// The first key into an empty root gets two leaves, the second empty
+ERROR_T BTreeIndex::InsertFirst(const KEY_T &key, const VALUE_T &value)
+{
+    BTreeNode b;
+    SIZE_T node=superblock.info.rootnode;
+    ERROR_T rc;
+
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+
+    BTreeNode leaf1=b;
+    BTreeNode leaf2=b;
+    leaf1.info.numkeys=0;
+    leaf2.info.numkeys=0;
+    leaf1.info.nodetype=BTREE_LEAF_NODE;
+    leaf2.info.nodetype=BTREE_LEAF_NODE;
+    // leaf2 ends the leaf chain
+    rc=leaf2.SetPtr(0,0);
+    if (rc) { return rc; }
+
+    b.info.numkeys++;
+    rc=leaf1.InsertSlot(0,key,value);
+    if (rc) { return rc; }
+    rc=b.SetKey(0,key);
+    if (rc) { return rc; }
+
+    // allocate space for leaves
+    SIZE_T leafBlock1;
+    SIZE_T leafBlock2;
+    rc=AllocateNode(leafBlock1);
+    if (rc) { return rc; }
+    rc=AllocateNode(leafBlock2);
+    if (rc) { return rc; }
+    // update Ptrs of root node
+    rc=b.SetPtr(0,leafBlock1);
+    if (rc) { return rc; }
+    rc=b.SetPtr(1,leafBlock2);
+    if (rc) { return rc; }
+    rc=leaf1.SetPtr(0,leafBlock2);
+    if (rc) { return rc; }
+    if (latchmode==BTREE_LATCH_BLINK) { 
+        rc=leaf1.SetHighKey(key);
+        if (rc) { return rc; }
+    }
+    // serialize nodes
+    rc=WriteNode(node,b);
+    if (rc) { return rc; }
+    rc=WriteNode(leafBlock1,leaf1);
+    if (rc) { return rc; }
+    return WriteNode(leafBlock2,leaf2);
+}
+
+// The root split: a new root above it points to it and newnode
+ERROR_T BTreeIndex::GrowRoot(const KEY_T &key, const SIZE_T newnode)
+{
+    BTreeNode oldRoot;
+    ERROR_T rc;
+
+    rc=ReadNode(superblock.info.rootnode,oldRoot);
+    if (rc) { return rc; }
+    BTreeNode newRoot=oldRoot;
+
+    newRoot.info.numkeys=1;
+    // the old root and newnode have its messages
+    rc=newRoot.RemoveMessages(0,newRoot.GetNumMessages());
+    if (rc) { return rc; }
+    rc=newRoot.SetKey(0,key);
+    if (rc) { return rc; }
+    rc=newRoot.SetPtr(0,superblock.info.rootnode);
+    if (rc) { return rc; }
+    rc=newRoot.SetPtr(1,newnode);
+    if (rc) { return rc; }
+    if (latchmode==BTREE_LATCH_BLINK) { 
+        // the old root's link is its new sibling
+        rc=newRoot.SetRightLink(0);
+        if (rc) { return rc; }
+    }
+
+    // allocate space for newRoot on the disk
+    SIZE_T newRootBlock;
+    rc=AllocateNode(newRootBlock);
+    if (rc) { return rc; }
+
+    // update superblock to point to new root
+    pthread_mutex_lock(&supermutex);
+    superblock.info.rootnode=newRootBlock;
+    pthread_mutex_unlock(&supermutex);
+    rootchanged=true;
+
+    // serialize newRoot to the disk
+    return WriteNode(newRootBlock,newRoot);
+}
+
+//
+// Top-down insert (BTREE_INSERT_TOPDOWN)
+//
+// A node that could not take another key without reaching its split
+// threshold is split before the insert goes into it, while its parent,
+// which was made to have room on the way to it, is still at hand.  So
+// the key a split passes up always fits, and nothing is left to do on
+// the way back.  Interior nodes come from the decoded cache, and only
+// a split reads a node and its parent to change them.  A node with too
+// few keys to split into two useful halves is let reach the threshold
+// instead.
+//
+
+bool BTreeIndex::FullForInsert(const BTreeNode &b) const
+{
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+        return b.info.numkeys+1>=nodeops.leafsplit && b.info.numkeys>=2;
+    } else {
+        return b.info.numkeys+1>=nodeops.interiorsplit && b.info.numkeys>=3;
+    }
+}
+
+ERROR_T BTreeIndex::InsertTopDown(const KEY_T &key, const VALUE_T &value)
+{
+    const SIZE_T keysize=superblock.info.keysize;
+    const BTreeNode *b;
+    BTreeNode scratch;
+    BTreeNode parent;
+    KEY_T testkey;
+    KEY_T newkey;
+    SIZE_T node=superblock.info.rootnode;
+    SIZE_T parentnode=0;
+    SIZE_T poffset=0;
+    SIZE_T newnode;
+    SIZE_T offset;
+    SIZE_T next;
+    bool atend;
+    ERROR_T rc;
+
+    while (1) { 
+        // leaves, and any node about to change, are read into scratch
+        rc=ReadDecoded(node,scratch,b);
+        if (rc) { return rc; }
+        offset=nodeops.findkey(*b,key);
+        switch (b->info.nodetype) { 
+            case BTREE_ROOT_NODE:
+                if (b->info.numkeys==0) { 
+                    return InsertFirst(key,value);
+                }
+            case BTREE_INTERIOR_NODE:
+                atend=offset==b->info.numkeys;
+                break;
+            case BTREE_LEAF_NODE:
+                // a key that's there already needs no room
+                if (offset<scratch.info.numkeys) { 
+                    rc=scratch.GetKey(offset,testkey);
+                    if (rc) {  return rc; }
+                    if (testkey==key) { 
+                        if (!scratch.IsTombstone(offset)) { 
+                            return ERROR_CONFLICT;
+                        }
+                        rc=scratch.SetVal(offset,value);
+                        if (rc) { return rc; }
+                        rc=scratch.SetTombstone(offset,false);
+                        if (rc) { return rc; }
+                        return WriteNode(node,scratch);
+                    }
+                }
+                rc=scratch.GetPtr(0,next);
+                if (rc) { return rc; }
+                if (next==0) { 
+                    rightleaf=node;
+                }
+                atend=offset==scratch.info.numkeys && next==0;
+                appendrun = atend ? appendrun+1 : 0;
+                break;
+            default:
+                return ERROR_INSANE;
+        }
+
+        if (FullForInsert(*b)) { 
+            if (b!=&scratch) { 
+                rc=ReadNode(node,scratch);
+                if (rc) { return rc; }
+                b=&scratch;
+            }
+            atend=atend && Appending();
+            rc=SplitNode(node,scratch,atend ? superblock.info.appendratio : superblock.info.splitratio,
+                         newkey,newnode);
+            if (rc) { return rc; }
+            // the parent was split on the way here if it had to be
+            if (parentnode) { 
+                rc=ReadNode(parentnode,parent);
+                if (rc) { return rc; }
+                rc=parent.InsertSlot(poffset,newkey,newnode);
+                if (rc) { return rc; }
+                rc=WriteNode(parentnode,parent);
+            } else {
+                rc=GrowRoot(newkey,newnode);
+            }
+            if (rc) { return rc; }
+            // keys <= newkey stay in the left node
+            if (memcmp(key.data,newkey.data,keysize)>0) { 
+                node=newnode;
+                rc=ReadNode(node,scratch);
+                if (rc) { return rc; }
+            }
+            offset=nodeops.findkey(scratch,key);
+        }
+
+        if (b->info.nodetype==BTREE_LEAF_NODE) { 
+            rc=nodeops.insertleaf(scratch,offset,key,value);
+            if (rc) { return rc; }
+            return WriteNode(node,scratch);
+        }
+
+        rc=b->GetPtr(offset,next);
+        if (rc) { return rc; }
+        parentnode=node;
+        poffset=offset;
+        node=next;
+    }
+}
+
+// Appends to the last leaf if the key goes after all of its keys, and
+// so after every key in the index, and the leaf will not need to
+// split.  Otherwise appended is false and nothing is changed.
+ERROR_T BTreeIndex::AppendToRightLeaf(const KEY_T &key,
+        const VALUE_T &value,
+        bool &appended)
+{
+    BTreeNode b;
+    KEY_T last;
+    SIZE_T next;
+    ERROR_T rc;
+
+    appended=false;
+
+    // copy on write needs the leaf's parent, which this never reads
+    if (!rightleaf || writemode==BTREE_WRITE_COPY || key.length!=superblock.info.keysize) { 
+        return ERROR_NOERROR;
+    }
+
+    rc=ReadNode(rightleaf,b);
+    if (rc) { return rc; }
+
+    // since then, the block may have been freed, or split, or merged
+    // into another, and there is only ever one leaf with no next leaf
+    if (b.info.nodetype!=BTREE_LEAF_NODE || b.info.numkeys==0 ||
+        nodeops.leafsplit <= b.info.numkeys+1) { 
+        return ERROR_NOERROR;
+    }
+    rc=b.GetPtr(0,next);
+    if (rc) { return rc; }
+    if (next) { 
+        return ERROR_NOERROR;
+    }
+    rc=b.GetKey(b.info.numkeys-1,last);
+    if (rc) { return rc; }
+    if (!(last<key)) { 
+        return ERROR_NOERROR;
+    }
+
+    rc=b.InsertSlot(b.info.numkeys,key,value);
+    if (rc) { return rc; }
+    rc=WriteNode(rightleaf,b);
+    if (rc) { return rc; }
+    appendrun++;
+    appended=true;
+    return ERROR_NOERROR;
+}
+
+//
+// Where a node splits
+//
+// A full node keeps splitratio percent of its keys.  But if every
+// insert since the last leaf's last split (at least half a leaf's
+// worth) has gone on its end, as it does for increasing keys, the
+// inserts are appending, and the last leaf and each node above it
+// that takes the new separator on its end keep appendratio percent
+// instead.  Nothing will be inserted into the node left behind, so
+// it might as well be full.
+//
+
+bool BTreeIndex::Appending() const
+{
+    return latchmode==BTREE_LATCH_NONE &&
+        superblock.info.appendratio!=0 && appendrun>=nodeops.leafsplit/2;
+}
+
+// Keys the left node keeps when n keys split at ratio percent.  Both
+// nodes keep a key, and an interior split also promotes one.
+static SIZE_T SplitPoint(const SIZE_T n, const SIZE_T ratio, const bool interior)
+{
+    SIZE_T keep=n*ratio/100;
+    SIZE_T most=interior ? n-2 : n-1;
+
+    if (keep>most) { 
+        keep=most;
+    }
+    return keep<1 ? 1 : keep;
+}
+
+// Offset of the first message in b for a key after key; the ones
+// before it go down the pointer left of key
+static SIZE_T MessagesUpTo(const BTreeNode &b, const KEY_T &key)
+{
+    SIZE_T m=b.FindMessage(key);
+    KEY_T testkey;
+    VALUE_T value;
+    int type;
+
+    if (m<b.GetNumMessages() && b.GetMessage(m,type,testkey,value)==ERROR_NOERROR &&
+        testkey==key) { 
+        m++;
+    }
+    return m;
+}
+
+// Splits b, which is at block node, at ratio percent
+ERROR_T BTreeIndex::SplitNode(const SIZE_T node,
+        BTreeNode &b,
+        const SIZE_T ratio,
+        KEY_T &newkey,
+        SIZE_T &newnode)
+{
+    // copy b into splitNode
+    BTreeNode splitNode = b;
+    SIZE_T ptr;
+    ERROR_T rc;
+
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+        SIZE_T halfIndex=SplitPoint(b.info.numkeys,ratio,false);
+        rc=b.GetKey(halfIndex-1,newkey);
+        if (rc) { return rc; }
+
+        // move the second half of the old node into the beginning of newnode
+        rc=splitNode.MoveRange(0,halfIndex,b.info.numkeys-halfIndex);
+        if (rc) { return rc; }
+
+        splitNode.info.numkeys=b.info.numkeys-halfIndex;
+        b.info.numkeys=halfIndex;
+
+        // allocate space for newnode on the disk
+        rc=AllocateNode(newnode);
+        if (rc) { return rc; }
+        if (latchmode==BTREE_LATCH_NONE && rightleaf==node) { 
+            rightleaf=newnode;
+        }
+
+        // newnode takes over b's place in the leaf chain,
+        // splitNode already has b's next leaf
+        rc=b.SetPtr(0,newnode);
+        if (rc) { return rc; }
+    } else {
+        // last key of first node
+        SIZE_T lastKeyIndex=SplitPoint(b.info.numkeys,ratio,true)-1;
+        // first key of new split node
+        SIZE_T firstKeyIndex=lastKeyIndex+2;
+
+        // get the new key that we need to promote
+        rc=b.GetKey(lastKeyIndex+1,newkey);
+        if (rc) { return rc; }
+
+        // move the second half of the old node into the beginning of newnode
+        // the pointer left of firstKeyIndex becomes the first pointer
+        rc=b.GetPtr(firstKeyIndex,ptr);
+        if (rc) { return rc; }
+        rc=splitNode.SetPtr(0,ptr);
+        if (rc) { return rc; }
+        rc=splitNode.MoveRange(0,firstKeyIndex,b.info.numkeys-firstKeyIndex);
+        if (rc) { return rc; }
+
+        splitNode.info.numkeys=b.info.numkeys-firstKeyIndex;
+        b.info.numkeys=lastKeyIndex+1;
+
+        // and the messages for keys after newkey
+        SIZE_T m=MessagesUpTo(b,newkey);
+        rc=b.RemoveMessages(m,b.GetNumMessages()-m);
+        if (rc) { return rc; }
+        rc=splitNode.RemoveMessages(0,m);
+        if (rc) { return rc; }
+
+        // allocate space for newnode on the disk
+        rc=AllocateNode(newnode);
+        if (rc) { return rc; }
+        if (latchmode==BTREE_LATCH_BLINK) { 
+            rc=b.SetRightLink(newnode);
+            if (rc) { return rc; }
+        }
+    }
+    if (latchmode==BTREE_LATCH_BLINK) { 
+        // splitNode keeps b's high key and right link, and b now ends
+        // at newkey
+        rc=b.SetHighKey(newkey);
+        if (rc) { return rc; }
+    }
+
+    // serialize newnode and b to the disk
+    rc=WriteNode(newnode,splitNode);
+    if (rc) { return rc; }
+    return WriteNode(node,b);
+}
+
+//
+// Redistribution (BTREE_SPLIT_REDISTRIBUTE)
+//
+// As in a B*-tree, a leaf is let fill up completely, and a full leaf
+// first hands half of its excess to a neighbour that has room.  Only
+// when both neighbours are full too does it split, and then together
+// with one of them, two leaves into three, each about two thirds full.
+//
+
+// The pair of a leaf slot, with its tombstone
+static ERROR_T AppendLeafSlot(BTreeNode &to, const BTreeNode &from, const SIZE_T i)
+{
+    KEY_T key;
+    VALUE_T value;
+    ERROR_T rc;
+
+    rc=from.GetKey(i,key);
+    if (rc) { return rc; }
+    rc=from.GetVal(i,value);
+    if (rc) { return rc; }
+    rc=to.InsertSlot(to.info.numkeys,key,value);
+    if (rc) { return rc; }
+    return to.SetTombstone(to.info.numkeys-1,from.IsTombstone(i));
+}
+
+// Moves the last n slots of left to the front of right
+static ERROR_T ShiftRight(BTreeNode &left, BTreeNode &right, const SIZE_T n)
+{
+    BTreeNode moved=right;
+    ERROR_T rc;
+
+    moved.info.numkeys=0;
+    for (SIZE_T i=left.info.numkeys-n;i<left.info.numkeys;i++) { 
+        rc=AppendLeafSlot(moved,left,i);
+        if (rc) { return rc; }
+    }
+    for (SIZE_T i=0;i<right.info.numkeys;i++) { 
+        rc=AppendLeafSlot(moved,right,i);
+        if (rc) { return rc; }
+    }
+    left.info.numkeys-=n;
+    right.info.numkeys=0;
+    for (SIZE_T i=0;i<moved.info.numkeys;i++) { 
+        rc=AppendLeafSlot(right,moved,i);
+        if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+}
+
+// Moves the first n slots of right to the end of left
+static ERROR_T ShiftLeft(BTreeNode &left, BTreeNode &right, const SIZE_T n)
+{
+    ERROR_T rc;
+
+    for (SIZE_T i=0;i<n;i++) { 
+        rc=AppendLeafSlot(left,right,i);
+        if (rc) { return rc; }
+    }
+    rc=right.MoveRange(0,n,right.info.numkeys-n);
+    if (rc) { return rc; }
+    right.info.numkeys-=n;
+    return ERROR_NOERROR;
+}
+
+// The leaf under parent's pointer offset has just filled up.  Either
+// the parent's keys are adjusted for a shift into a neighbour, and
+// newnode is 0, or newnode is a third leaf, to go in after pointer
+// offset (which may have moved left) with newkey, as after a split.
+ERROR_T BTreeIndex::RedistributeLeaf(BTreeNode &parent, SIZE_T &offset, KEY_T &newkey, SIZE_T &newnode)
+{
+    SIZE_T childnode, leftnode=0, rightnode=0;
+    BTreeNode child, left, right;
+    KEY_T key;
+    ERROR_T rc;
+
+    newnode=0;
+
+    rc=parent.GetPtr(offset,childnode);
+    if (rc) { return rc; }
+    rc=ReadNode(childnode,child);
+    if (rc) { return rc; }
+
+    if (offset>0) { 
+        rc=parent.GetPtr(offset-1,leftnode);
+        if (rc) { return rc; }
+        rc=ReadNode(leftnode,left);
+        if (rc) { return rc; }
+        if (left.info.numkeys+1<nodeops.leafsplit) { 
+            rc=ShiftLeft(left,child,(child.info.numkeys-left.info.numkeys)/2);
+            if (rc) { return rc; }
+            rc=left.GetKey(left.info.numkeys-1,key);
+            if (rc) { return rc; }
+            rc=parent.SetKey(offset-1,key);
+            if (rc) { return rc; }
+            rc=WriteNode(leftnode,left);
+            if (rc) { return rc; }
+            return WriteNode(childnode,child);
+        }
+    }
+    if (offset<parent.info.numkeys) { 
+        rc=parent.GetPtr(offset+1,rightnode);
+        if (rc) { return rc; }
+        rc=ReadNode(rightnode,right);
+        if (rc) { return rc; }
+        if (right.info.numkeys+1<nodeops.leafsplit) { 
+            rc=ShiftRight(child,right,(child.info.numkeys-right.info.numkeys)/2);
+            if (rc) { return rc; }
+            rc=child.GetKey(child.info.numkeys-1,key);
+            if (rc) { return rc; }
+            rc=parent.SetKey(offset,key);
+            if (rc) { return rc; }
+            rc=WriteNode(rightnode,right);
+            if (rc) { return rc; }
+            return WriteNode(childnode,child);
+        }
+    }
+
+    // Split the leaf and a neighbour, a and b, three ways
+    BTreeNode &a = rightnode ? child : left;
+    BTreeNode &b = rightnode ? right : child;
+    SIZE_T anode = rightnode ? childnode : leftnode;
+    SIZE_T bnode = rightnode ? rightnode : childnode;
+    SIZE_T total=a.info.numkeys+b.info.numkeys;
+    SIZE_T na=total/3 + (total%3>0 ? 1 : 0);
+    SIZE_T nb=total/3;
+    BTreeNode middle=b;
+
+    if (!rightnode) { 
+        offset--;
+    }
+    rc=AllocateNode(newnode);
+    if (rc) { return rc; }
+
+    // a keeps its first na slots, b its last nb, the rest go in the middle
+    middle.info.numkeys=0;
+    for (SIZE_T i=na;i<a.info.numkeys;i++) { 
+        rc=AppendLeafSlot(middle,a,i);
+        if (rc) { return rc; }
+    }
+    if (na<a.info.numkeys) { 
+        a.info.numkeys=na;
+    } else { 
+        rc=ShiftLeft(a,b,na-a.info.numkeys);
+        if (rc) { return rc; }
+    }
+    rc=ShiftLeft(middle,b,b.info.numkeys-nb);
+    if (rc) { return rc; }
+
+    // a -> middle -> b along the chain
+    rc=middle.SetPtr(0,bnode);
+    if (rc) { return rc; }
+    rc=a.SetPtr(0,newnode);
+    if (rc) { return rc; }
+
+    rc=a.GetKey(a.info.numkeys-1,newkey);
+    if (rc) { return rc; }
+    rc=middle.GetKey(middle.info.numkeys-1,key);
+    if (rc) { return rc; }
+    // the key between a and b now separates the middle from b
+    rc=parent.SetKey(offset,key);
+    if (rc) { return rc; }
+
+    rc=WriteNode(anode,a);
+    if (rc) { return rc; }
+    rc=WriteNode(newnode,middle);
+    if (rc) { return rc; }
+    return WriteNode(bnode,b);
+}
+
+//
+// Batched insert
+//
+// The batch is sorted, so the keys headed for one child are adjacent.
+// Each node reads its keys' child once, and a child that has to grow
+// is laid out in one pass over its old and new contents into as many
+// nodes as needed, each written once.  The new nodes come back up as
+// (separator, node) pairs for the parent, just like a single split.
+//
+
+// Orders a batch by key, with the pairs of the wrong size at the end
+struct BatchKeyLess {
+    const vector<KeyValuePair> &pairs;
+    const NodeMetadata &info;
+    BatchKeyLess(const vector<KeyValuePair> &p, const NodeMetadata &i) : pairs(p), info(i) {}
+    bool Fits(const KeyValuePair &p) const {
+        return p.key.length==info.keysize && p.value.length==info.valuesize;
+    }
+    bool operator()(const SIZE_T a, const SIZE_T b) const {
+        if (!Fits(pairs[a]) || !Fits(pairs[b])) { 
+            return Fits(pairs[a]) && !Fits(pairs[b]);
+        }
+        return memcmp(pairs[a].key.data,pairs[b].key.data,info.keysize)<0;
+    }
+};
+
+// Split count so that n keys, less the k-1 promoted between k nodes,
+// leave each node below the split threshold
+static SIZE_T InteriorNodesFor(const SIZE_T n, const SIZE_T split)
+{
+    return n<split ? 1 : (n+1+split-1)/split;
+}
+
+ERROR_T BTreeIndex::InsertBatch(vector<KeyValuePair> &pairs, vector<ERROR_T> &statuses)
+{
+    return FlushNodes(InsertBatchInternal(pairs,statuses));
+}
+
+ERROR_T BTreeIndex::InsertBatchInternal(vector<KeyValuePair> &pairs, vector<ERROR_T> &statuses)
+{
+    vector<SIZE_T> order(pairs.size());
+    vector<KeyValuePair> sorted;
+    vector<KEY_T> newkeys;
+    vector<SIZE_T> newnodes;
+    BatchKeyLess less(pairs,superblock.info);
+    SIZE_T inserted=0;
+    SIZE_T first=0;
+    SIZE_T last=0;
+    SIZE_T i;
+    BTreeNode root;
+    ERROR_T rc;
+
+    // Sort by rebuilding the vector rather than swapping pairs in place
+    for (i=0;i<order.size();i++) { 
+        order[i]=i;
+    }
+    stable_sort(order.begin(),order.end(),less);
+    sorted.reserve(pairs.size());
+    for (i=0;i<order.size();i++) { 
+        sorted.push_back(pairs[order[i]]);
+        if (less.Fits(sorted.back())) { 
+            last++;
+        }
+    }
+    pairs.swap(sorted);
+
+    statuses.assign(pairs.size(),ERROR_SIZE);
+    for (i=0;i<last;i++) { 
+        statuses[i]=ERROR_NOERROR;
+    }
+
+    if (latchmode!=BTREE_LATCH_NONE) { 
+        // the batch writers take no latches, so each pair goes in by
+        // itself, latched (and, for a B-link tree, linked) as usual
+        for (i=0;i<last;i++) { 
+            statuses[i]=Insert(pairs[i].key,pairs[i].value);
+            if (statuses[i]!=ERROR_NOERROR && statuses[i]!=ERROR_CONFLICT) { 
+                return statuses[i];
+            }
+        }
+        return ERROR_NOERROR;
+    }
+    if (superblock.info.bufferratio) { 
+        // the buffers batch the inserts up on their own
+        for (i=0;i<last;i++) { 
+            statuses[i]=BufferMessage(BTREE_MESSAGE_INSERT,pairs[i].key,pairs[i].value);
+            if (statuses[i]==ERROR_NOERROR) { 
+                CountKeys(1);
+            } else if (statuses[i]!=ERROR_CONFLICT) { 
+                return statuses[i];
+            }
+        }
+        return ERROR_NOERROR;
+    }
+
+    // An empty tree gets its first leaves from Insert
+    rc=ReadNode(superblock.info.rootnode,root);
+    if (rc) { return rc; }
+    while (root.info.numkeys==0 && first<last) { 
+        statuses[first]=InsertInternal(pairs[first].key,pairs[first].value);
+        if (statuses[first]==ERROR_NOERROR) { 
+            CountKeys(1);
+        }
+        first++;
+        rc=ReadNode(superblock.info.rootnode,root);
+        if (rc) { return rc; }
+    }
+    if (first==last) { 
+        return ERROR_NOERROR;
+    }
+
+    rc=InsertBatchRecursion(superblock.info.rootnode,pairs,first,last,
+                            statuses,inserted,newkeys,newnodes);
+    CountKeys((int)inserted);
+    if (rc) { return rc; }
+
+    // The root split, perhaps several ways: grow new roots above it
+    while (!newnodes.empty()) { 
+        vector<KEY_T> keys;
+        vector<SIZE_T> ptrs;
+        SIZE_T newroot;
+
+        keys.swap(newkeys);
+        ptrs.push_back(superblock.info.rootnode);
+        ptrs.insert(ptrs.end(),newnodes.begin(),newnodes.end());
+        newnodes.clear();
+
+        rc=AllocateNode(newroot);
+        if (rc) { return rc; }
+        rc=WriteInteriorNodes(newroot,root,keys,ptrs,newkeys,newnodes);
+        if (rc) { return rc; }
+        superblock.info.rootnode=newroot;
+    }
+    return ERROR_NOERROR;
+}
+
+// Lays out keys and ptrs (one more ptr than keys) as a run of interior
+// nodes like proto, the first at node.  The others are allocated and
+// returned with the keys that separate them.
+ERROR_T BTreeIndex::WriteInteriorNodes(const SIZE_T node,
+        const BTreeNode &proto,
+        const vector<KEY_T> &keys,
+        const vector<SIZE_T> &ptrs,
+        vector<KEY_T> &newkeys,
+        vector<SIZE_T> &newnodes)
+{
+    SIZE_T count=InteriorNodesFor(keys.size(),nodeops.interiorsplit);
+    SIZE_T perNode=keys.size()-(count-1);
+    SIZE_T k=0;
+    SIZE_T i;
+    ERROR_T rc;
+
+    for (SIZE_T n=0;n<count;n++) { 
+        BTreeNode b=proto;
+        SIZE_T block=node;
+
+        if (n>0) { 
+            rc=AllocateNode(block);
+            if (rc) { return rc; }
+            // the key between the previous node and this one moves up
+            newkeys.push_back(keys[k]);
+            newnodes.push_back(block);
+            k++;
+        }
+        b.info.numkeys=perNode/count + (n<perNode%count ? 1 : 0);
+        for (i=0;i<b.info.numkeys;i++) { 
+            rc=b.SetKey(i,keys[k+i]);
+            if (rc) { return rc; }
+            rc=b.SetPtr(i,ptrs[k+i]);
+            if (rc) { return rc; }
+        }
+        rc=b.SetPtr(i,ptrs[k+i]);
+        if (rc) { return rc; }
+        k+=b.info.numkeys;
+
+        rc=WriteNode(block,b);
+        if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::InsertBatchRecursion(const SIZE_T node,
+        const vector<KeyValuePair> &pairs,
+        const SIZE_T first,
+        const SIZE_T last,
+        vector<ERROR_T> &statuses,
+        SIZE_T &inserted,
+        vector<KEY_T> &newkeys,
+        vector<SIZE_T> &newnodes)
+{
+    const SIZE_T keysize=superblock.info.keysize;
+    BTreeNode b;
+    KEY_T key;
+    VALUE_T value;
+    SIZE_T i, j;
+    ERROR_T rc;
+
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+
+    switch (b.info.nodetype) { 
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE: {
+            vector<KEY_T> keys;
+            vector<SIZE_T> ptrs;
+            bool grew=false;
+
+            for (i=0;i<b.info.numkeys;i++) { 
+                rc=b.GetKey(i,key);
+                if (rc) { return rc; }
+                keys.push_back(key);
+            }
+            for (i=0;i<=b.info.numkeys;i++) { 
+                SIZE_T ptr;
+                rc=b.GetPtr(i,ptr);
+                if (rc) { return rc; }
+                ptrs.push_back(ptr);
+            }
+
+            // Hand each child its run of keys, right to left so that
+            // the new entries for one child don't move those to its left
+            j=last;
+            while (j>first) { 
+                SIZE_T child=nodeops.findkey(b,pairs[j-1].key);
+                vector<KEY_T> childkeys;
+                vector<SIZE_T> childnodes;
+
+                // keys <= the separator left of child belong further left
+                for (i=j-1;i>first && (child==0 ||
+                                       memcmp(pairs[i-1].key.data,keys[child-1].data,keysize)>0);i--) { 
+                }
+                rc=InsertBatchRecursion(ptrs[child],pairs,i,j,statuses,inserted,
+                                        childkeys,childnodes);
+                if (rc) { return rc; }
+                if (!childnodes.empty()) { 
+                    keys.insert(keys.begin()+child,childkeys.begin(),childkeys.end());
+                    ptrs.insert(ptrs.begin()+child+1,childnodes.begin(),childnodes.end());
+                    grew=true;
+                }
+                j=i;
+            }
+
+            if (grew) { 
+                return WriteInteriorNodes(node,b,keys,ptrs,newkeys,newnodes);
+            }
+            return ERROR_NOERROR;
+        }
+        case BTREE_LEAF_NODE: {
+            vector<KEY_T> keys;
+            vector<VALUE_T> values;
+            SIZE_T added=0;
+            SIZE_T next;
+
+            // Merge the leaf and the batch, as one Insert after another
+            // would.  The leaf is rewritten anyway, so its tombstones go.
+            i=0;
+            j=first;
+            while (i<b.info.numkeys || j<last) { 
+                if (i<b.info.numkeys) { 
+                    rc=b.GetKey(i,key);
+                    if (rc) { return rc; }
+                }
+                int c = i==b.info.numkeys ? 1 :
+                        j==last ? -1 : memcmp(key.data,pairs[j].key.data,keysize);
+                if (c<=0 && b.IsTombstone(i)) { 
+                    // deleted, and maybe coming back in the batch
+                    i++;
+                } else if (c==0 || (c>0 && !keys.empty() &&
+                             memcmp(keys.back().data,pairs[j].key.data,keysize)==0)) { 
+                    // already there, or earlier in the batch
+                    statuses[j++]=ERROR_CONFLICT;
+                } else if (c<0) { 
+                    rc=b.GetVal(i,value);
+                    if (rc) { return rc; }
+                    keys.push_back(key);
+                    values.push_back(value);
+                    i++;
+                } else {
+                    keys.push_back(pairs[j].key);
+                    values.push_back(pairs[j].value);
+                    statuses[j++]=ERROR_NOERROR;
+                    added++;
+                }
+            }
+            if (!added) { 
+                return ERROR_NOERROR;
+            }
+            inserted+=added;
+
+            // Enough leaves to stay below the split threshold
+            SIZE_T count=keys.size()<nodeops.leafsplit ? 1 :
+                (keys.size()+nodeops.leafsplit-2)/(nodeops.leafsplit-1);
+            vector<SIZE_T> blocks(1,node);
+            for (i=1;i<count;i++) { 
+                SIZE_T block;
+                rc=AllocateNode(block);
+                if (rc) { return rc; }
+                blocks.push_back(block);
+            }
+            rc=b.GetPtr(0,next);
+            if (rc) { return rc; }
+
+            SIZE_T k=0;
+            for (SIZE_T n=0;n<count;n++) { 
+                BTreeNode leaf=b;
+                SIZE_T numkeys=keys.size()/count + (n<keys.size()%count ? 1 : 0);
+
+                leaf.info.numkeys=0;
+                for (i=0;i<numkeys;i++) { 
+                    rc=leaf.InsertSlot(i,keys[k+i],values[k+i]);
+                    if (rc) { return rc; }
+                }
+                k+=numkeys;
+                // the chain runs through the new leaves to the old next one
+                rc=leaf.SetPtr(0,n+1<count ? blocks[n+1] : next);
+                if (rc) { return rc; }
+                if (n>0) { 
+                    newkeys.push_back(keys[k-numkeys-1]);
+                    newnodes.push_back(blocks[n]);
+                }
+                rc=WriteNode(blocks[n],leaf);
+                if (rc) { return rc; }
+            }
+            return ERROR_NOERROR;
+        }
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+//
+// Bulk loading
+//
+// Nodes go straight to disk in runs of consecutive blocks instead of
+// through the cache one at a time.  On a freshly created index the free
+// list is in block order, so nodes allocated one after another form a
+// single run.
+//
+#define BULKLOAD_MAX_RUN 64
+
+struct BulkRun {
+    SIZE_T        first;
+    vector<Block> blocks;
+};
+
+// A finished node, as its parent will see it
+struct BulkChild {
+    SIZE_T node;
+    KEY_T  maxkey;
+};
+
+static ERROR_T FlushBulkRun(BufferCache *cache, BulkRun &run)
+{
+    ERROR_T rc;
+
+    if (run.blocks.empty()) { 
+        return ERROR_NOERROR;
+    }
+    rc=cache->WriteBlocks(run.first,run.blocks);
+    run.blocks.clear();
+    return rc;
+}
+
+static ERROR_T EmitBulkNode(BufferCache *cache, BulkRun &run, vector<BulkChild> &level,
+                            const BTreeNode &node, const SIZE_T block, const KEY_T &maxkey)
+{
+    ERROR_T rc;
+
+    if (!run.blocks.empty() &&
+        (block!=run.first+run.blocks.size() || run.blocks.size()>=BULKLOAD_MAX_RUN)) { 
+        rc=FlushBulkRun(cache,run);
+        if (rc) { return rc; }
+    }
+    if (run.blocks.empty()) { 
+        run.first=block;
+    }
+    run.blocks.push_back(Block());
+    rc=node.Serialize(run.blocks.back());
+    if (rc) { return rc; }
+
+    BulkChild child;
+    child.node=block;
+    child.maxkey=maxkey;
+    level.push_back(child);
+    return ERROR_NOERROR;
+}
+
+// Keys per node for a fill factor.  A node must keep room for one more
+// key, since inserts add the key before splitting.  Returns 0 if a node
+// cannot hold least keys.
+static SIZE_T BulkFill(const SIZE_T slots, const double fillfactor, const SIZE_T least)
+{
+    if (slots<least+1) { 
+        return 0;
+    }
+    SIZE_T n=(SIZE_T)(slots*fillfactor);
+    if (n>slots-1) { 
+        n=slots-1;
+    }
+    if (n<least) { 
+        n=least;
+    }
+    return n;
+}
+
+// Builds the nodes for BulkLoad, noting each block it takes in taken,
+// and leaves the root in the write set
+ERROR_T BTreeIndex::BulkLoadNodes(BTreeLoadIterator &input, const double fillfactor,
+                                  vector<SIZE_T> &taken, SIZE_T &numkeys)
+{
+    const SIZE_T keysize=superblock.info.keysize;
+    const SIZE_T valuesize=superblock.info.valuesize;
+    BTreeNode root;
+    BTreeNode leaf(BTREE_LEAF_NODE,keysize,valuesize,buffercache->GetBlockSize(),
+                   superblock.info.nodeformat,superblock.info.keytype);
+    BTreeNode prev;
+    SIZE_T leafblock=0;
+    SIZE_T prevblock=0;
+    bool haveprev=false;
+    KeyValuePair pair;
+    KEY_T lastkey;
+    KEY_T key;
+    VALUE_T value;
+    BulkRun run;
+    vector<BulkChild> level;
+    SIZE_T i;
+    ERROR_T rc;
+
+    numkeys=0;
+    leaf.info.tombstones=superblock.info.tombstones;
+    SIZE_T leaffill=BulkFill(superblock.info.GetNumSlotsAsLeaf(),fillfactor,1);
+    SIZE_T interiorfill=BulkFill(superblock.info.GetNumSlotsAsInterior(),fillfactor,2);
+    if (fillfactor<=0 || fillfactor>1 || !leaffill || !interiorfill) { 
+        return ERROR_SIZE;
+    }
+
+    // The leaves, left to right.  The previous leaf is held back until
+    // the input ends so that the last two can be evened out.
+    while ((rc=input.Next(pair))==ERROR_NOERROR) { 
+        if (pair.key.length!=keysize || pair.value.length!=valuesize) { 
+            return ERROR_SIZE;
+        }
+        if (numkeys>0 && memcmp(lastkey.data,pair.key.data,keysize)>=0) { 
+            return ERROR_CONFLICT;
+        }
+        if (numkeys==0) { 
+            rc=AllocateNode(leafblock);
+            if (rc) { return rc; }
+            taken.push_back(leafblock);
+        } else if (leaf.info.numkeys==leaffill) { 
+            SIZE_T next;
+            rc=AllocateNode(next);
+            if (rc) { return rc; }
+            taken.push_back(next);
+            rc=leaf.SetPtr(0,next);
+            if (rc) { return rc; }
+            if (haveprev) { 
+                rc=prev.GetKey(prev.info.numkeys-1,key);
+                if (rc) { return rc; }
+                rc=EmitBulkNode(buffercache,run,level,prev,prevblock,key);
+                if (rc) { return rc; }
+            }
+            prev=leaf;
+            prevblock=leafblock;
+            haveprev=true;
+            leaf.info.numkeys=0;
+            leafblock=next;
+        }
+        rc=leaf.InsertSlot(leaf.info.numkeys,pair.key,pair.value);
+        if (rc) { return rc; }
+        lastkey=pair.key;
+        numkeys++;
+    }
+    if (rc!=ERROR_NONEXISTENT) { 
+        return rc;
+    }
+    if (numkeys==0) { 
+        return ERROR_NOERROR;
+    }
+
+    rc=leaf.SetPtr(0,0);
+    if (rc) { return rc; }
+    if (haveprev) { 
+        // don't leave a nearly empty leaf at the end
+        SIZE_T keep=(prev.info.numkeys+leaf.info.numkeys+1)/2;
+        for (i=prev.info.numkeys;i>keep;i--) { 
+            rc=prev.GetKey(i-1,key);
+            if (rc) { return rc; }
+            rc=prev.GetVal(i-1,value);
+            if (rc) { return rc; }
+            rc=leaf.InsertSlot(0,key,value);
+            if (rc) { return rc; }
+        }
+        if (keep<prev.info.numkeys) { 
+            prev.info.numkeys=keep;
+        }
+        rc=prev.GetKey(prev.info.numkeys-1,key);
+        if (rc) { return rc; }
+        rc=EmitBulkNode(buffercache,run,level,prev,prevblock,key);
+        if (rc) { return rc; }
+        rc=EmitBulkNode(buffercache,run,level,leaf,leafblock,lastkey);
+        if (rc) { return rc; }
+    } else {
+        // As after the first Insert, a lone leaf has an empty right
+        // sibling, so that the root has two children
+        BTreeNode empty=leaf;
+        SIZE_T emptyblock;
+        rc=AllocateNode(emptyblock);
+        if (rc) { return rc; }
+        taken.push_back(emptyblock);
+        rc=leaf.SetPtr(0,emptyblock);
+        if (rc) { return rc; }
+        empty.info.numkeys=0;
+        rc=EmitBulkNode(buffercache,run,level,leaf,leafblock,lastkey);
+        if (rc) { return rc; }
+        rc=EmitBulkNode(buffercache,run,level,empty,emptyblock,lastkey);
+        if (rc) { return rc; }
+    }
+
+    // The interior levels, bottom up, until one node is left: the root
+    while (level.size()>1) { 
+        vector<BulkChild> parents;
+        SIZE_T fanout=interiorfill+1;
+        SIZE_T nodes=(level.size()+fanout-1)/fanout;
+        SIZE_T c=0;
+
+        for (SIZE_T n=0;n<nodes;n++) { 
+            // spread the children evenly, so no node is left nearly empty
+            SIZE_T m=level.size()/nodes + (n<level.size()%nodes ? 1 : 0);
+            BTreeNode node(nodes==1 ? BTREE_ROOT_NODE : BTREE_INTERIOR_NODE,
+                           keysize,valuesize,buffercache->GetBlockSize(),
+                           superblock.info.nodeformat,superblock.info.keytype);
+            // with an empty message buffer
+            node.info.bufferratio=superblock.info.bufferratio;
+            node.info.tombstones=superblock.info.tombstones;
+            node.info.numkeys=m-1;
+            for (i=0;i<m;i++) { 
+                rc=node.SetPtr(i,level[c+i].node);
+                if (rc) { return rc; }
+                if (i<m-1) { 
+                    rc=node.SetKey(i,level[c+i].maxkey);
+                    if (rc) { return rc; }
+                }
+            }
+            c+=m;
+
+            if (nodes==1) { 
+                // the root stays where the superblock says it is
+                rc=FlushBulkRun(buffercache,run);
+                if (rc) { return rc; }
+                rc=WriteNode(superblock.info.rootnode,node);
+                if (rc) { return rc; }
+            } else {
+                SIZE_T block;
+                rc=AllocateNode(block);
+                if (rc) { return rc; }
+                taken.push_back(block);
+                rc=EmitBulkNode(buffercache,run,parents,node,block,level[c-1].maxkey);
+                if (rc) { return rc; }
+            }
+        }
+        level.swap(parents);
+    }
+    return ERROR_NOERROR;
+}
+
+// Puts the blocks a failed bulk load took back on the free list.  The
+// ones it wrote now hold nodes, so each is written as a free block
+// again; those from the run of never used blocks go back to it.
+ERROR_T BTreeIndex::UndoBulkLoad(vector<SIZE_T> &taken, const SIZE_T freerun)
+{
+    BTreeNode unused(BTREE_UNALLOCATED_BLOCK,
+                     superblock.info.keysize,
+                     superblock.info.valuesize,
+                     buffercache->GetBlockSize(),
+                     superblock.info.nodeformat,
+                     superblock.info.keytype);
+    SIZE_T n;
+    ERROR_T rc;
+
+    writeset.clear();
+    unused.info.rootnode=superblock.info.rootnode;
+    if (freerun && superblock.info.freerun!=freerun) { 
+        // the run was reached, so the rest of the list was used up
+        superblock.info.freelist=freerun;
+        superblock.info.freerun=freerun;
+    }
+    // highest first, so the list comes back in block order
+    sort(taken.begin(),taken.end());
+    for (SIZE_T i=taken.size();i>0;i--) { 
+        n=taken[i-1];
+        if (freerun && n>=freerun) { 
+            unused.info.freelist = n+1<buffercache->GetNumBlocks() ? n+1 : 0;
+        } else {
+            unused.info.freelist=superblock.info.freelist;
+            superblock.info.freelist=n;
+        }
+        rc=unused.Serialize(buffercache,n);
+        if (rc) { return rc; }
+        buffercache->NotifyDeallocateBlock(n);
+        allocated.erase(n);
+    }
+    taken.clear();
+    superdirty=false;
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BulkLoad(BTreeLoadIterator &input, const double fillfactor)
+{
+    const SIZE_T freerun=superblock.info.freerun;
+    vector<SIZE_T> taken;
+    BTreeNode root;
+    SIZE_T numkeys;
+    ERROR_T rc;
+
+    if (latchmode==BTREE_LATCH_BLINK || latchmode==BTREE_LATCH_OPTIMISTIC) { 
+        // the levels are built unlinked, and written around the frames
+        // that optimistic lookups read
+        return ERROR_BADCONFIG;
+    }
+    rc=ReadNode(superblock.info.rootnode,root);
+    if (rc) { return rc; }
+    if (root.info.numkeys!=0 || superblock.info.numkeys!=0) { 
+        return ERROR_CONFLICT;
+    }
+    // the nodes are written around the write set
+    decoded.clear();
+
+    rc=BulkLoadNodes(input,fillfactor,taken,numkeys);
+    if (rc) { 
+        // the index is left as it was, empty
+        ERROR_T undorc=UndoBulkLoad(taken,freerun);
+        return undorc ? undorc : rc;
+    }
+    if (numkeys==0) { 
+        return ERROR_NOERROR;
+    }
+    superblock.info.numkeys=numkeys;
+    superdirty=true;
+    return FlushNodes();
+}
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+    ERROR_T rc;
+
+    CountOp();
+    if (superblock.info.bufferratio) { 
+        return FlushNodes(BufferMessage(BTREE_MESSAGE_UPDATE,key,value));
+    }
+    rc=FlushNodes(LookupOrUpdateInternal(BTREE_OP_UPDATE, key, (VALUE_T&)value));
+    ReleaseLatches();
+    return rc;
+}
+
+
+//
+// Delete
+//
+// A node that falls below half of its split threshold borrows a key
+// from a sibling, or, if the sibling has none to spare, is merged with
+// it.  Merging removes a separator from the parent, which may underflow
+// in turn.  When the root is left with a single interior child, that
+// child becomes the root.
+//
+// In BTREE_DELETE_TOMBSTONE mode the key is only marked deleted in its
+// leaf.  Tombstones take up their slots, and count towards splits and
+// underflows, until the compactor purges them from the leaf, which is
+// then fixed up like any other.
+//
+
+// Fewest keys a node should keep.  Two nodes that hold fewer between
+// them than this twice fit in one node below the split threshold.
+static SIZE_T MinKeys(const BTreeNodeOps &ops, const BTreeNode &b)
+{
+    SIZE_T split = b.info.nodetype==BTREE_LEAF_NODE ? ops.leafsplit : ops.interiorsplit;
+    SIZE_T min=(split-1)/2;
+    return min<1 ? 1 : min;
+}
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+    BTreePath path;
+    BTreeNode leaf;
+    bool underflow;
+    ERROR_T rc;
+
+    CountOp();
+
+    if (key.length!=superblock.info.keysize) { 
+        return ERROR_SIZE;
+    }
+
+    if (superblock.info.bufferratio) { 
+        rc=BufferMessage(BTREE_MESSAGE_DELETE,key,VALUE_T());
+    } else if (latchmode==BTREE_LATCH_NONE) { 
+        // the root has no siblings, so its own underflow is not handled here
+        rc=DeleteRecursion(superblock.info.rootnode,key,false,underflow);
+    } else if (latchmode==BTREE_LATCH_BLINK) { 
+        // just the leaf, which is left short if it must be
+        rc=FindLeafLinked(key,BTREE_OP_DELETE,path,leaf);
+        if (!rc) { 
+            rc=DeleteRecursion(path.Leaf(),key,false,underflow);
+        }
+    } else {
+        // from the highest node still latched, which will not underflow
+        rc=FindLeafLatched(key,BTREE_OP_DELETE,path,leaf);
+        if (!rc) { 
+            rc=DeleteRecursion(latched[latched[0]==superblock_index ? 1 : 0],key,false,underflow);
+        }
+    }
+    if (!rc) { 
+        CountKeys(-1);
+    }
+    rc=FlushNodes(rc);
+    ReleaseLatches();
+    return rc;
+}
+
+// With purge, removes every tombstone from the leaf that key leads to
+// instead, or returns ERROR_NONEXISTENT if it has none
+ERROR_T BTreeIndex::DeleteRecursion(const SIZE_T node, const KEY_T &key, const bool purge, bool &underflow)
+{
+    BTreeNode b;
+    KEY_T testkey;
+    SIZE_T offset;
+    SIZE_T ptr;
+    bool childunderflow;
+    ERROR_T rc;
+
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+
+    underflow=false;
+
+    switch (b.info.nodetype) { 
+        case BTREE_ROOT_NODE:
+            if (b.info.numkeys==0) { 
+                // empty tree
+                return ERROR_NONEXISTENT;
+            }
+        case BTREE_INTERIOR_NODE:
+            offset=nodeops.findkey(b,key);
+            rc=b.GetPtr(offset,ptr);
+            if (rc) { return rc; }
+            rc=DeleteRecursion(ptr,key,purge,childunderflow);
+            if (rc) { return rc; }
+            if (childunderflow) { 
+                rc=FixUnderflow(b,node,offset);
+                if (rc) { return rc; }
+                // interior nodes with message buffers never merge or
+                // borrow, which would take keys away from their messages
+                underflow = b.info.numkeys<MinKeys(nodeops,b) && !superblock.info.bufferratio;
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+            if (purge) { 
+                if (b.GetNumTombstones()==0) { 
+                    return ERROR_NONEXISTENT;
+                }
+                for (offset=b.info.numkeys;offset>0;offset--) { 
+                    if (b.IsTombstone(offset-1)) { 
+                        rc=b.RemoveSlot(offset-1);
+                        if (rc) { return rc; }
+                    }
+                }
+                rc=WriteNode(node,b);
+                if (rc) { return rc; }
+                underflow = b.info.numkeys<MinKeys(nodeops,b);
+                return ERROR_NOERROR;
+            }
+            offset=nodeops.findkey(b,key);
+            if (offset>=b.info.numkeys) { 
+                return ERROR_NONEXISTENT;
+            }
+            rc=b.GetKey(offset,testkey);
+            if (rc) { return rc; }
+            if (!(testkey==key) || b.IsTombstone(offset)) { 
+                return ERROR_NONEXISTENT;
+            }
+            if (deletemode==BTREE_DELETE_TOMBSTONE) { 
+                // one write, and no siblings to look at
+                rc=b.SetTombstone(offset,true);
+                if (rc) { return rc; }
+                return WriteNode(node,b);
+            }
+            rc=b.RemoveSlot(offset);
+            if (rc) { return rc; }
+            rc=WriteNode(node,b);
+            if (rc) { return rc; }
+            underflow = b.info.numkeys<MinKeys(nodeops,b);
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+// Child number child of parent is short of keys: borrow one for it from
+// a sibling, or merge it with the sibling.  parent is updated and
+// written, and may be short of keys afterwards.
+ERROR_T BTreeIndex::FixUnderflow(BTreeNode &parent, const SIZE_T parentnode, const SIZE_T child)
+{
+    // work on the pair (left, right) = (child-1, child), or (0, 1)
+    SIZE_T i = child>0 ? child-1 : 0;
+    SIZE_T leftnode, rightnode;
+    BTreeNode left, right;
+    KEY_T key, sep;
+    VALUE_T value;
+    SIZE_T ptr;
+    SIZE_T j;
+    ERROR_T rc;
+
+    rc=parent.GetPtr(i,leftnode);
+    if (rc) { return rc; }
+    rc=parent.GetPtr(i+1,rightnode);
+    if (rc) { return rc; }
+    if (latchmode!=BTREE_LATCH_NONE) { 
+        // the child is latched already; the parent's latch keeps any
+        // more threads from coming down to the sibling
+        rc=Latch(child>0 ? leftnode : rightnode,true);
+        if (rc) { return rc; }
+    }
+    rc=ReadNode(leftnode,left);
+    if (rc) { return rc; }
+    rc=ReadNode(rightnode,right);
+    if (rc) { return rc; }
+    rc=parent.GetKey(i,sep);
+    if (rc) { return rc; }
+
+    bool leaf = left.info.nodetype==BTREE_LEAF_NODE;
+    BTreeNode &sibling = child>0 ? left : right;
+
+    if (sibling.info.numkeys>MinKeys(nodeops,sibling)) { 
+        if (child>0) { 
+            // the last entry of left moves to the front of right
+            j=left.info.numkeys-1;
+            rc=left.GetKey(j,key);
+            if (rc) { return rc; }
+            if (leaf) { 
+                rc=left.GetVal(j,value);
+                if (rc) { return rc; }
+                rc=right.InsertSlot(0,key,value);
+                if (rc) { return rc; }
+                rc=right.SetTombstone(0,left.IsTombstone(j));
+                if (rc) { return rc; }
+                rc=left.RemoveSlot(j);
+                if (rc) { return rc; }
+                rc=left.GetKey(j-1,sep);
+                if (rc) { return rc; }
+            } else {
+                // the separator comes down and left's last key goes up
+                rc=left.GetPtr(j+1,ptr);
+                if (rc) { return rc; }
+                SIZE_T first;
+                rc=right.GetPtr(0,first);
+                if (rc) { return rc; }
+                rc=right.InsertSlot(0,sep,first);
+                if (rc) { return rc; }
+                rc=right.SetPtr(0,ptr);
+                if (rc) { return rc; }
+                rc=left.RemoveSlot(j);
+                if (rc) { return rc; }
+                sep=key;
+            }
+        } else {
+            // the first entry of right moves to the end of left
+            rc=right.GetKey(0,key);
+            if (rc) { return rc; }
+            if (leaf) { 
+                rc=right.GetVal(0,value);
+                if (rc) { return rc; }
+                rc=left.InsertSlot(left.info.numkeys,key,value);
+                if (rc) { return rc; }
+                rc=left.SetTombstone(left.info.numkeys-1,right.IsTombstone(0));
+                if (rc) { return rc; }
+                rc=right.RemoveSlot(0);
+                if (rc) { return rc; }
+                sep=key;
+            } else {
+                // the separator comes down and right's first key goes up
+                rc=right.GetPtr(0,ptr);
+                if (rc) { return rc; }
+                rc=left.InsertSlot(left.info.numkeys,sep,ptr);
+                if (rc) { return rc; }
+                rc=right.GetPtr(1,ptr);
+                if (rc) { return rc; }
+                rc=right.SetPtr(0,ptr);
+                if (rc) { return rc; }
+                rc=right.RemoveSlot(0);
+                if (rc) { return rc; }
+                sep=key;
+            }
+        }
+        rc=parent.SetKey(i,sep);
+        if (rc) { return rc; }
+        rc=WriteNode(leftnode,left);
+        if (rc) { return rc; }
+        rc=WriteNode(rightnode,right);
+        if (rc) { return rc; }
+        return WriteNode(parentnode,parent);
+    }
+
+    if (superblock.info.bufferratio && parent.info.numkeys==1) { 
+        // An interior node with no keys would look like an empty tree,
+        // and the root must stay put with its messages, so the leaves
+        // are left short
+        return ERROR_NOERROR;
+    }
+
+    if (leaf && parent.info.numkeys==1 && parentnode==superblock.info.rootnode) { 
+        // The root keeps two leaves, as after the first Insert, until
+        // both are empty and the tree is empty again
+        if (left.info.numkeys+right.info.numkeys>0) { 
+            return ERROR_NOERROR;
+        }
+        parent.info.numkeys=0;
+        rc=WriteNode(parentnode,parent);
+        if (rc) { return rc; }
+        rc=DeallocateNode(leftnode);
+        if (rc) { return rc; }
+        return DeallocateNode(rightnode);
+    }
+
+    // Merge right into left, and drop right and its separator
+    if (leaf) { 
+        for (j=0;j<right.info.numkeys;j++) { 
+            rc=right.GetKey(j,key);
+            if (rc) { return rc; }
+            rc=right.GetVal(j,value);
+            if (rc) { return rc; }
+            rc=left.InsertSlot(left.info.numkeys,key,value);
+            if (rc) { return rc; }
+            rc=left.SetTombstone(left.info.numkeys-1,right.IsTombstone(j));
+            if (rc) { return rc; }
+        }
+        // left takes over right's place in the leaf chain
+        rc=right.GetPtr(0,ptr);
+        if (rc) { return rc; }
+        rc=left.SetPtr(0,ptr);
+        if (rc) { return rc; }
+    } else {
+        rc=right.GetPtr(0,ptr);
+        if (rc) { return rc; }
+        rc=left.InsertSlot(left.info.numkeys,sep,ptr);
+        if (rc) { return rc; }
+        for (j=0;j<right.info.numkeys;j++) { 
+            rc=right.GetKey(j,key);
+            if (rc) { return rc; }
+            rc=right.GetPtr(j+1,ptr);
+            if (rc) { return rc; }
+            rc=left.InsertSlot(left.info.numkeys,key,ptr);
+            if (rc) { return rc; }
+        }
+    }
+    rc=DeallocateNode(rightnode);
+    if (rc) { return rc; }
+    rc=parent.RemoveSlot(i);
+    if (rc) { return rc; }
+
+    if (parent.info.numkeys==0 && parentnode==superblock.info.rootnode) { 
+        // left is all that is left below the root: it becomes the root
+        left.info.nodetype=BTREE_ROOT_NODE;
+        rc=WriteNode(leftnode,left);
+        if (rc) { return rc; }
+        pthread_mutex_lock(&supermutex);
+        superblock.info.rootnode=leftnode;
+        pthread_mutex_unlock(&supermutex);
+        rootchanged=true;
+        return DeallocateNode(parentnode);
+    }
+    rc=WriteNode(leftnode,left);
+    if (rc) { return rc; }
+    return WriteNode(parentnode,parent);
+}
+
+//
+// Latch crabbing (BTREE_LATCH_CRABBING)
+//
+// A descent latches the superblock, which holds the root pointer, and
+// then each node on the way down, before letting go of the latch above
+// it.  A lookup takes shared latches all the way.  An update, or a
+// delete that only leaves a tombstone, changes just the leaf, which it
+// latches exclusively.  Inserts and deletes that merge may change the
+// nodes above the leaf, so they latch exclusively, and hold on to the
+// latches above a node until they come to a safe one.  Only a node on
+// the path, or a sibling of one whose parent is latched, is ever
+// latched, always going down, so no two threads wait for each other.
+// An operation writes its nodes to the cache before it lets go of
+// them.
+//
+
+ERROR_T BTreeIndex::SetLatchMode(const int mode)
+{
+    if (mode!=BTREE_LATCH_NONE &&
+        (writemode==BTREE_WRITE_COPY || superblock.info.bufferratio)) { 
+        return ERROR_BADCONFIG;
+    }
+    latchmode=mode;
+    decoded.clear();
+    rightleaf=0;
+    appendrun=0;
+    FreeFrames();
+    if (mode==BTREE_LATCH_OPTIMISTIC) { 
+        SetupFrames();
+    }
+    if (nodeops.leafsplit) { 
+        // B-link nodes keep a slot for the high key
+        SetupSplits();
+    }
+    if (mode==BTREE_LATCH_BLINK) { 
+        return FlushNodes(LinkLevels());
+    }
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Latch(const SIZE_T block, const bool exclusive)
+{
+    ERROR_T rc;
+
+    rc=buffercache->LatchBlock(block,exclusive);
+    if (rc) { return rc; }
+    latched.push_back(block);
+    return ERROR_NOERROR;
+}
+
+void BTreeIndex::ReleaseLatches(const SIZE_T keep)
+{
+    if (latched.size()<=keep) { 
+        return;
+    }
+    SIZE_T n=latched.size()-keep;
+    for (SIZE_T i=0;i<n;i++) { 
+        buffercache->UnlatchBlock(latched[i]);
+    }
+    latched.erase(latched.begin(),latched.begin()+n);
+}
+
+// The superblock's key count; many threads may change it, so it
+// changes in FlushNodes, with the rest of the operation's superblock.
+// Only a redo log needs it on disk after every operation; otherwise it
+// goes out with the next change to the superblock, or at Detach.
+void BTreeIndex::CountKeys(const int n)
+{
+    counted+=n;
+    if (buffercache->IsLogging()) { 
+        superdirty=true;
+    }
+}
+
+// True if op can change b without changing any node above it
+bool BTreeIndex::IsSafe(const BTreeNode &b, const BTreeOp op, const bool root) const
+{
+    if (op==BTREE_OP_INSERT) { 
+        SIZE_T split = b.info.nodetype==BTREE_LEAF_NODE ? nodeops.leafsplit : nodeops.interiorsplit;
+        return b.info.numkeys+1<split;
+    }
+    if (op==BTREE_OP_DELETE && deletemode==BTREE_DELETE_MERGE) { 
+        // the root has no minimum, but it goes when its last key does
+        return root ? b.info.numkeys>1 : b.info.numkeys>MinKeys(nodeops,b);
+    }
+    return true;
+}
+
+ERROR_T BTreeIndex::FindLeafLatched(const KEY_T &key,
+        const BTreeOp op,
+        BTreePath &path,
+        BTreeNode &b)
+{
+    const bool structural = op==BTREE_OP_INSERT ||
+        (op==BTREE_OP_DELETE && deletemode==BTREE_DELETE_MERGE);
+    SIZE_T node;
+    SIZE_T slot;
+    ERROR_T rc;
+
+    rc=Latch(superblock_index,structural);
+    if (rc) { return rc; }
+    node=superblock.info.rootnode;
+    path.depth=0;
+    while (1) { 
+        rc=Latch(node,structural);
+        if (rc) { return rc; }
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+        if (b.info.nodetype==BTREE_LEAF_NODE && op!=BTREE_OP_LOOKUP && !structural) { 
+            // the parent's latch keeps the leaf from splitting or going
+            // away while its latch is traded for an exclusive one
+            buffercache->UnlatchBlock(node);
+            latched.pop_back();
+            rc=Latch(node,true);
+            if (rc) { return rc; }
+            rc=ReadNode(node,b);
+            if (rc) { return rc; }
+        }
+        if (!structural || IsSafe(b,op,path.depth==0)) { 
+            ReleaseLatches(1);
+        }
+        switch (b.info.nodetype) { 
+            case BTREE_ROOT_NODE:
+                if (b.info.numkeys==0) { 
+                    return ERROR_NONEXISTENT;
+                }
+            case BTREE_INTERIOR_NODE:
+                slot=nodeops.findkey(b,key);
+                rc=path.Push(node,slot);
+                if (rc) { return rc; }
+                rc=b.GetPtr(slot,node);
+                if (rc) { return rc; }
+                break;
+            case BTREE_LEAF_NODE:
+                return path.Push(node,nodeops.findkey(b,key));
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+//
+// Optimistic lock coupling (BTREE_LATCH_OPTIMISTIC)
+//
+// Writers latch and write exactly as with crabbing.  Before letting go
+// of its latches, a writer also copies each node it changed into that
+// node's frame, with the node's version odd while it does.  A lookup
+// reads only frames and versions.  It notes a node's version, checks
+// that its parent's version has not changed since it read the parent,
+// copies the frame, and checks the node's version again.  Having the
+// parent unchanged means the pointer it followed is still good, and
+// the node's version means the copy is whole.  Frames are never freed
+// while the mode lasts, so a lookup that reads one a writer is
+// changing reads junk, never unmapped memory, and then starts over.
+// Freed blocks are not reused until the parents that pointed at them
+// are published (see FlushNodes).
+//
+
+void BTreeIndex::SetupFrames()
+{
+    numframes=buffercache->GetNumBlocks();
+    frames=new atomic<BYTE_T *>[numframes];
+    versions=new atomic<unsigned long long>[numframes];
+    for (SIZE_T i=0;i<numframes;i++) { 
+        frames[i]=0;
+        versions[i]=0;
+    }
+    publishedroot=superblock.info.rootnode;
+}
+
+void BTreeIndex::FreeFrames()
+{
+    if (!frames) { 
+        return;
+    }
+    for (SIZE_T i=0;i<numframes;i++) { 
+        delete [] frames[i].load();
+    }
+    delete [] frames;
+    delete [] versions;
+    frames=0;
+    versions=0;
+    numframes=0;
+}
+
+// The block's version, once no writer holds it
+unsigned long long BTreeIndex::StableVersion(const SIZE_T block) const
+{
+    unsigned long long v;
+
+    while ((v=versions[block].load(memory_order_acquire))&1) { 
+        sched_yield();
+    }
+    return v;
+}
+
+void BTreeIndex::LockVersion(const SIZE_T block)
+{
+    unsigned long long v;
+
+    do { 
+        v=StableVersion(block);
+    } while (!versions[block].compare_exchange_weak(v,v+1,memory_order_acquire));
+}
+
+void BTreeIndex::UnlockVersion(const SIZE_T block)
+{
+    versions[block].fetch_add(1,memory_order_release);
+}
+
+// Copy b into the block's frame; the caller holds the block's version
+void BTreeIndex::PublishNode(const SIZE_T block, const Block &b)
+{
+    BYTE_T *frame=frames[block].load(memory_order_relaxed);
+
+    if (frame) { 
+        memcpy(frame,b.data,b.length);
+        return;
+    }
+    frame=new BYTE_T [b.length];
+    memcpy(frame,b.data,b.length);
+    frames[block].store(frame,memory_order_release);
+}
+
+// The first lookup to reach a block fills its frame from the cache.
+// Writers publish through the version, so if the frame is still empty
+// once the version is held, the cache has the latest node.
+ERROR_T BTreeIndex::LoadFrame(const SIZE_T block)
+{
+    Block b;
+    ERROR_T rc=ERROR_NOERROR;
+
+    LockVersion(block);
+    if (!frames[block].load(memory_order_relaxed)) { 
+        rc=buffercache->ReadBlock(block,b);
+        if (!rc) { 
+            PublishNode(block,b);
+        }
+    }
+    UnlockVersion(block);
+    return rc;
+}
+
+ERROR_T BTreeIndex::FindLeafOptimistic(const KEY_T &key,
+        BTreePath &path,
+        BTreeNode &b)
+{
+    const SIZE_T blocksize=buffercache->GetBlockSize();
+    Block copy(blocksize);
+    SIZE_T parent;
+    SIZE_T node;
+    SIZE_T slot;
+    unsigned long long parentversion;
+    unsigned long long version;
+    const BYTE_T *frame;
+    ERROR_T rc;
+
+    while (1) { 
+        path.depth=0;
+        parent=superblock_index;
+        parentversion=StableVersion(parent);
+        node=publishedroot.load(memory_order_acquire);
+        while (1) { 
+            if (node>=numframes) { 
+                return ERROR_INSANE;
+            }
+            frame=frames[node].load(memory_order_acquire);
+            if (!frame) { 
+                rc=LoadFrame(node);
+                if (rc) { return rc; }
+                continue;
+            }
+            version=StableVersion(node);
+            if (versions[parent].load(memory_order_acquire)!=parentversion) { 
+                break;
+            }
+            memcpy(copy.data,frame,blocksize);
+            atomic_thread_fence(memory_order_acquire);
+            if (versions[node].load(memory_order_relaxed)!=version) { 
+                break;
+            }
+            // copy is a node as some writer left it
+            rc=b.Unserialize(copy);
+            if (rc) { return rc; }
+            if (b.info.nodetype==BTREE_LEAF_NODE) { 
+                return path.Push(node,nodeops.findkey(b,key));
+            }
+            if (b.info.nodetype!=BTREE_ROOT_NODE &&
+                b.info.nodetype!=BTREE_INTERIOR_NODE) { 
+                return ERROR_INSANE;
+            }
+            if (b.info.nodetype==BTREE_ROOT_NODE && b.info.numkeys==0) { 
+                return ERROR_NONEXISTENT;
+            }
+            slot=nodeops.findkey(b,key);
+            rc=path.Push(node,slot);
+            if (rc) { return rc; }
+            rc=b.GetPtr(slot,node);
+            if (rc) { return rc; }
+            parent=path.block[path.depth-1];
+            parentversion=version;
+        }
+        restarts++;
+    }
+}
+
+//
+// B-link tree (BTREE_LATCH_BLINK)
+//
+// After Lehman and Yao.  Every node has a high key, and a link to the
+// node to its right, so the nodes at each depth form a chain like the
+// leaves.  A node that splits keeps the low half, and hands its high
+// key and link to the new node, which it then links to.  Until the
+// separator is in the parent, the parent still sends the new node's
+// keys to the old one, where the high key turns a descent right.  So a
+// split need hold only the node that splits, and nothing holds a
+// latch while it waits for one above it or to its left, which is all
+// it takes to keep threads from waiting on each other in a circle.
+// Nodes are never freed, so a descent never lands on one that is gone.
+//
+
+// Links an existing tree a depth at a time: each node's right link is
+// the next node at its depth, and its high key is the separator after
+// its pointer in the parent, or the parent's own high key
+ERROR_T BTreeIndex::LinkLevels()
+{
+    vector<SIZE_T> level;
+    vector<SIZE_T> next;
+    vector<KEY_T> highs;       // meaningful where bounded
+    vector<KEY_T> nexthighs;
+    vector<bool> bounded;
+    vector<bool> nextbounded;
+    BTreeNode b;
+    KEY_T key;
+    SIZE_T ptr;
+    ERROR_T rc;
+
+    level.push_back(superblock.info.rootnode);
+    highs.push_back(KEY_T());
+    bounded.push_back(false);
+    while (!level.empty()) { 
+        next.clear();
+        nexthighs.clear();
+        nextbounded.clear();
+        for (SIZE_T i=0;i<level.size();i++) { 
+            rc=ReadNode(level[i],b);
+            if (rc) { return rc; }
+            if (b.info.numkeys>=b.GetNumSlots()) { 
+                return ERROR_NOSPACE;
+            }
+            if (bounded[i]) { 
+                rc=b.SetHighKey(highs[i]);
+                if (rc) { return rc; }
+            }
+            rc=b.SetRightLink(i+1<level.size() ? level[i+1] : 0);
+            if (rc) { return rc; }
+            rc=WriteNode(level[i],b);
+            if (rc) { return rc; }
+            if (b.info.nodetype==BTREE_LEAF_NODE || b.info.numkeys==0) { 
+                // a leaf, or the root of an empty tree
+                continue;
+            }
+            for (SIZE_T j=0;j<=b.info.numkeys;j++) { 
+                rc=b.GetPtr(j,ptr);
+                if (rc) { return rc; }
+                next.push_back(ptr);
+                if (j<b.info.numkeys) { 
+                    rc=b.GetKey(j,key);
+                    if (rc) { return rc; }
+                    nexthighs.push_back(key);
+                    nextbounded.push_back(true);
+                } else {
+                    nexthighs.push_back(highs[i]);
+                    nextbounded.push_back(bounded[i]);
+                }
+            }
+        }
+        rc=FlushNodes(ERROR_NOERROR);
+        if (rc) { return rc; }
+        level.swap(next);
+        highs.swap(nexthighs);
+        bounded.swap(nextbounded);
+    }
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::MoveRight(const KEY_T &key,
+        SIZE_T &node,
+        BTreeNode &b,
+        const bool exclusive)
+{
+    KEY_T high;
+    SIZE_T right;
+    ERROR_T rc;
+
+    while (1) { 
+        rc=b.GetRightLink(right);
+        if (rc) { return rc; }
+        if (right==0) { 
+            return ERROR_NOERROR;
+        }
+        rc=b.GetHighKey(high);
+        if (rc) { return rc; }
+        if (memcmp(key.data,high.data,superblock.info.keysize)<=0) { 
+            return ERROR_NOERROR;
+        }
+        rc=Latch(right,exclusive);
+        if (rc) { return rc; }
+        ReleaseLatches(1);
+        node=right;
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+    }
+}
+
+ERROR_T BTreeIndex::FindLeafLinked(const KEY_T &key,
+        const BTreeOp op,
+        BTreePath &path,
+        BTreeNode &b)
+{
+    SIZE_T node;
+    SIZE_T slot;
+    ERROR_T rc;
+
+    // the root only moves under an exclusive latch on the superblock
+    rc=Latch(superblock_index,false);
+    if (rc) { return rc; }
+    node=superblock.info.rootnode;
+    path.depth=0;
+    while (1) { 
+        rc=Latch(node,false);
+        if (rc) { return rc; }
+        ReleaseLatches(1);
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+        rc=MoveRight(key,node,b,false);
+        if (rc) { return rc; }
+        switch (b.info.nodetype) { 
+            case BTREE_ROOT_NODE:
+                if (b.info.numkeys==0) { 
+                    return ERROR_NONEXISTENT;
+                }
+            case BTREE_INTERIOR_NODE:
+                slot=nodeops.findkey(b,key);
+                rc=path.Push(node,slot);
+                if (rc) { return rc; }
+                rc=b.GetPtr(slot,node);
+                if (rc) { return rc; }
+                break;
+            case BTREE_LEAF_NODE:
+                if (op!=BTREE_OP_LOOKUP) { 
+                    // the leaf may split while no latch is held on it,
+                    // and then key may be to the right
+                    ReleaseLatches();
+                    rc=Latch(node,true);
+                    if (rc) { return rc; }
+                    rc=ReadNode(node,b);
+                    if (rc) { return rc; }
+                    rc=MoveRight(key,node,b,true);
+                    if (rc) { return rc; }
+                }
+                return path.Push(node,nodeops.findkey(b,key));
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+ERROR_T BTreeIndex::InsertLinked(const KEY_T &key, const VALUE_T &value)
+{
+    BTreePath path;
+    BTreeNode b;
+    KEY_T newkey;
+    SIZE_T newnode;
+    SIZE_T node;
+    SIZE_T offset;
+    SIZE_T level;
+    SIZE_T height;
+    ERROR_T rc;
+
+    while (1) { 
+        rc=FindLeafLinked(key,BTREE_OP_INSERT,path,b);
+        if (rc!=ERROR_NONEXISTENT) { 
+            break;
+        }
+        // an empty tree, whose root stays put until it has a key
+        ReleaseLatches();
+        rc=Latch(superblock_index,false);
+        if (rc) { return rc; }
+        node=superblock.info.rootnode;
+        rc=Latch(node,true);
+        if (rc) { return rc; }
+        ReleaseLatches(1);
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+        if (b.info.numkeys==0) { 
+            return InsertFirst(key,value);
+        }
+        ReleaseLatches();
+    }
+    if (rc) { return rc; }
+
+    // as in InsertIntoLeaf
+    level=path.depth-1;
+    node=path.block[level];
+    offset=path.slot[level];
+    if (offset<b.info.numkeys && nodeops.matchkey(b,offset,key)) { 
+        if (!b.IsTombstone(offset)) { 
+            return ERROR_CONFLICT;
+        }
+        rc=nodeops.setval(b,offset,value);
+        if (rc) { return rc; }
+        rc=b.SetTombstone(offset,false);
+        if (rc) { return rc; }
+        return WriteNode(node,b);
+    }
+    rc=nodeops.insertleaf(b,offset,key,value);
+    if (rc) { return rc; }
+
+    // height is node's distance from the leaves, which never changes
+    for (height=0;;height++) { 
+        if (b.info.numkeys < (height ? nodeops.interiorsplit : nodeops.leafsplit)) { 
+            return WriteNode(node,b);
+        }
+        rc=SplitNode(node,b,superblock.info.splitratio,newkey,newnode);
+        if (rc) { return rc; }
+        // both halves are in the cache before the node is let go
+        rc=FlushNodes(ERROR_NOERROR);
+        if (rc) { return rc; }
+        ReleaseLatches();
+        while (level==0) { 
+            rc=Latch(superblock_index,true);
+            if (rc) { return rc; }
+            if (superblock.info.rootnode==node) { 
+                return GrowRoot(newkey,newnode);
+            }
+            // node was not the root, or another split has put a new
+            // root above it since: come down again to find its parent
+            ReleaseLatches();
+            rc=FindLeafLinked(newkey,BTREE_OP_LOOKUP,path,b);
+            ReleaseLatches();
+            if (rc) { return rc; }
+            if (path.depth-1>height) { 
+                level=path.depth-1-height;
+            } else {
+                // the root is node's left sibling, and the insert that
+                // split it has yet to put a root above the two
+                sched_yield();
+            }
+        }
+        // the separator goes into whichever node at the level above
+        // now holds the pointer to node
+        level--;
+        node=path.block[level];
+        rc=Latch(node,true);
+        if (rc) { return rc; }
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+        rc=MoveRight(newkey,node,b,true);
+        if (rc) { return rc; }
+        rc=b.InsertSlot(nodeops.findkey(b,newkey),newkey,newnode);
+        if (rc) { return rc; }
+    }
+}
+
+//
+// Copy on write (BTREE_WRITE_COPY)
+//
+// No node another version can see is changed where it is.  Until the
+// operation finishes, its changes are in the write set under the old
+// blocks as usual; then each committed node it changed moves to a new
+// block, which changes the pointer to it in its parent, so the parent
+// moves too, and so on up to the root.  Every node the operation
+// changed was reached from its parent, so the interior nodes it read
+// are where the parents are found.  Once the new nodes are all in the
+// cache, the new root is published, and the blocks the new version no
+// longer uses are retired with it.  A block retired by version v is
+// only seen by snapshots of versions before v, and goes on the free
+// list once none is open.
+//
+// Leaves are not chained: moving a leaf would move the leaf before it,
+// and everything above that.  Scans and cursors step from leaf to leaf
+// through their ancestors instead.
+//
+
+// Puts a block nothing points at any more on the free list, straight
+// through the cache
+ERROR_T BTreeIndex::FreeBlock(const SIZE_T block)
+{
+    BTreeNode node;
+    ERROR_T rc;
+
+    rc=node.Unserialize(buffercache,block);
+    if (rc) { return rc; }
+    node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+    pthread_mutex_lock(&supermutex);
+    node.info.freelist=superblock.info.freelist;
+    rc=node.Serialize(buffercache,block);
+    if (!rc) { 
+        superblock.info.freelist=block;
+        superdirty=true;
+        buffercache->NotifyDeallocateBlock(block);
+    }
+    pthread_mutex_unlock(&supermutex);
+    return rc;
+}
+
+// Moves the committed nodes in the write set, and their ancestors, to
+// new blocks.  retiring gets the blocks the new version drops.
+ERROR_T BTreeIndex::CopyOnWrite(vector<SIZE_T> &retiring)
+{
+    map<SIZE_T, SIZE_T> parent;
+    map<SIZE_T, SIZE_T> moved;
+    map<SIZE_T, SIZE_T>::iterator m;
+    map<SIZE_T, Block> relocated;
+    map<SIZE_T, Block>::iterator i;
+    set<SIZE_T> gone(freed.begin(),freed.end());
+    vector<SIZE_T> candidates(visited.begin(),visited.end());
+    vector<SIZE_T> work;
+    vector<SIZE_T> fresh;
+    BTreeNode b;
+    SIZE_T ptr;
+    SIZE_T n;
+    ERROR_T rc;
+
+    // a committed block that was deallocated is kept for the snapshots;
+    // one allocated since was never seen, and is freed now
+    for (n=0;n<freed.size();n++) { 
+        if (allocated.count(freed[n])) { 
+            fresh.push_back(freed[n]);
+        } else {
+            retiring.push_back(freed[n]);
+        }
+    }
+    freed.swap(fresh);
+
+    // what points where, in the nodes as they are now
+    for (i=writeset.begin();i!=writeset.end();i++) { 
+        candidates.push_back(i->first);
+    }
+    for (n=0;n<candidates.size();n++) { 
+        if (gone.count(candidates[n])) { 
+            continue;
+        }
+        rc=ReadNode(candidates[n],b);
+        if (rc) { return rc; }
+        if ((b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) ||
+            b.info.numkeys==0) { 
+            continue;
+        }
+        for (SIZE_T s=0;s<=b.info.numkeys;s++) { 
+            rc=b.GetPtr(s,ptr);
+            if (rc) { return rc; }
+            parent[ptr]=candidates[n];
+        }
+    }
+
+    // the committed nodes changed, and everything above them
+    for (i=writeset.begin();i!=writeset.end();i++) { 
+        if (!allocated.count(i->first)) { 
+            work.push_back(i->first);
+        }
+    }
+    while (!work.empty()) { 
+        n=work.back();
+        work.pop_back();
+        if (moved.count(n)) { 
+            continue;
+        }
+        moved[n]=0;
+        if (n==superblock.info.rootnode) { 
+            continue;
+        }
+        m=parent.find(n);
+        if (m==parent.end()) { 
+            // the operation never came down to it
+            return ERROR_INSANE;
+        }
+        if (!writeset.count(m->second)) { 
+            rc=ReadNode(m->second,b);
+            if (rc) { return rc; }
+            rc=WriteNode(m->second,b);
+            if (rc) { return rc; }
+        }
+        if (!allocated.count(m->second)) { 
+            work.push_back(m->second);
+        }
+    }
+
+    for (m=moved.begin();m!=moved.end();m++) { 
+        rc=AllocateNode(m->second);
+        if (rc) { return rc; }
+        retiring.push_back(m->first);
+        decoded.erase(m->first);
+    }
+
+    // and the pointers to them
+    for (i=writeset.begin();i!=writeset.end();i++) { 
+        m=moved.find(i->first);
+        n = m==moved.end() ? i->first : m->second;
+        rc=b.Unserialize(i->second);
+        if (rc) { return rc; }
+        if ((b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) ||
+            b.info.numkeys==0) { 
+            relocated.insert(make_pair(n,i->second));
+            continue;
+        }
+        for (SIZE_T s=0;s<=b.info.numkeys;s++) { 
+            rc=b.GetPtr(s,ptr);
+            if (rc) { return rc; }
+            m=moved.find(ptr);
+            if (m!=moved.end()) { 
+                rc=b.SetPtr(s,m->second);
                 if (rc) { return rc; }
-                rc=b.SetPtr(1,leafBlock2);
+            }
+        }
+        rc=b.Serialize(relocated[n]);
+        if (rc) { return rc; }
+    }
+    writeset.swap(relocated);
+
+    m=moved.find(superblock.info.rootnode);
+    if (m!=moved.end()) { 
+        superblock.info.rootnode=m->second;
+        superdirty=true;
+    }
+    return ERROR_NOERROR;
+}
+
+// A copy-on-write operation that fails leaves the published version as
+// it was, and gives back the blocks it allocated
+ERROR_T BTreeIndex::AbandonWrites(const ERROR_T oprc)
+{
+    set<SIZE_T> fresh;
+    set<SIZE_T>::const_iterator f;
+    ERROR_T rc;
+
+    fresh.swap(allocated);
+    writeset.clear();
+    freed.clear();
+    visited.clear();
+    decoded.clear();
+    rootchanged=false;
+    counted=0;
+
+    // the key count only takes in counted once the operation commits
+    superblock.info.rootnode=publishedroot;
+    rc=ERROR_NOERROR;
+    for (f=fresh.begin();f!=fresh.end() && !rc;f++) { 
+        rc=FreeBlock(*f);
+    }
+    if (!rc && !fresh.empty()) { 
+        rc=superblock.Serialize(buffercache,superblock_index);
+    }
+    superdirty=false;
+    return oprc;
+}
+
+// Frees the retired blocks no open snapshot can see, counting the
+// blocks written in n
+ERROR_T BTreeIndex::ReclaimBlocks(SIZE_T &n)
+{
+    vector<SIZE_T> reclaim;
+    SIZE_T r;
+    ERROR_T rc=ERROR_NOERROR;
+
+    pthread_mutex_lock(&supermutex);
+    for (r=0;r<retired.size();r++) { 
+        if (!snapshots.empty() && *snapshots.begin()<retired[r].first) { 
+            break;
+        }
+        reclaim.push_back(retired[r].second);
+    }
+    retired.erase(retired.begin(),retired.begin()+r);
+    pthread_mutex_unlock(&supermutex);
+
+    for (r=0;r<reclaim.size() && !rc;r++) { 
+        decoded.erase(reclaim[r]);
+        rc=FreeBlock(reclaim[r]);
+        n++;
+    }
+    return rc;
+}
+
+ERROR_T BTreeIndex::SetWriteMode(const int mode)
+{
+    SIZE_T n=0;
+    ERROR_T rc;
+
+    if (mode==BTREE_WRITE_COPY &&
+        (latchmode!=BTREE_LATCH_NONE || superblock.info.bufferratio)) { 
+        return ERROR_BADCONFIG;
+    }
+    if (mode!=BTREE_WRITE_COPY && writemode==BTREE_WRITE_COPY) { 
+        if (!snapshots.empty()) { 
+            return ERROR_CONFLICT;
+        }
+        rc=ReclaimBlocks(n);
+        if (rc) { return rc; }
+        rc=FlushNodes();
+        if (rc) { return rc; }
+    }
+    writemode=mode;
+    rightleaf=0;
+    appendrun=0;
+    visited.clear();
+    allocated.clear();
+    publishedroot=superblock.info.rootnode;
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BeginSnapshot(BTreeSnapshot &snapshot)
+{
+    if (writemode!=BTREE_WRITE_COPY) { 
+        return ERROR_BADCONFIG;
+    }
+    if (snapshot.index) { 
+        return ERROR_CONFLICT;
+    }
+    pthread_mutex_lock(&supermutex);
+    snapshot.index=this;
+    snapshot.root=publishedroot;
+    snapshot.version=commits;
+    snapshots.insert(commits);
+    pthread_mutex_unlock(&supermutex);
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::EndSnapshot(BTreeSnapshot &snapshot)
+{
+    if (snapshot.index!=this) { 
+        return ERROR_NONEXISTENT;
+    }
+    pthread_mutex_lock(&supermutex);
+    snapshots.erase(snapshots.find(snapshot.version));
+    pthread_mutex_unlock(&supermutex);
+    snapshot.index=0;
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::FindLeafAt(const SIZE_T root,
+        const KEY_T *key,
+        BTreePath &path,
+        BTreeNode &leaf) const
+{
+    SIZE_T node=root;
+    SIZE_T slot;
+    ERROR_T rc;
+
+    path.depth=0;
+    while (1) { 
+        rc=leaf.Unserialize(buffercache,node);
+        if (rc) { return rc; }
+        switch (leaf.info.nodetype) { 
+            case BTREE_ROOT_NODE:
+                if (leaf.info.numkeys==0) { 
+                    return ERROR_NONEXISTENT;
+                }
+            case BTREE_INTERIOR_NODE:
+                slot=key ? nodeops.findkey(leaf,*key) : 0;
+                rc=path.Push(node,slot);
                 if (rc) { return rc; }
-                // serialize nodes
-                rc=b.Serialize(buffercache,node);
+                rc=leaf.GetPtr(slot,node);
                 if (rc) { return rc; }
-                rc=leaf1.Serialize(buffercache,leafBlock1);
+                break;
+            case BTREE_LEAF_NODE:
+                return path.Push(node,key ? nodeops.findkey(leaf,*key) : 0);
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+ERROR_T BTreeIndex::StepLeafAt(BTreePath &path, BTreeNode &leaf) const
+{
+    SIZE_T level=path.depth-1;
+    SIZE_T node;
+    ERROR_T rc;
+
+    // up to the nearest node with a pointer to the right of the path
+    while (1) { 
+        if (level==0) { 
+            return ERROR_NONEXISTENT;
+        }
+        level--;
+        rc=leaf.Unserialize(buffercache,path.block[level]);
+        if (rc) { return rc; }
+        if (path.slot[level]<leaf.info.numkeys) { 
+            break;
+        }
+    }
+    path.slot[level]++;
+    rc=leaf.GetPtr(path.slot[level],node);
+    if (rc) { return rc; }
+    path.depth=level+1;
+
+    // and down its left edge to a leaf
+    while (1) { 
+        rc=leaf.Unserialize(buffercache,node);
+        if (rc) { return rc; }
+        switch (leaf.info.nodetype) { 
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                rc=path.Push(node,0);
                 if (rc) { return rc; }
-                rc=leaf2.Serialize(buffercache,leafBlock2);
+                rc=leaf.GetPtr(0,node);
                 if (rc) { return rc; }
+                break;
+            case BTREE_LEAF_NODE:
+                return path.Push(node,0);
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+ERROR_T BTreeSnapshot::Lookup(const KEY_T &key, VALUE_T &value) const
+{
+    BTreePath path;
+    BTreeNode leaf;
+    KEY_T testkey;
+    SIZE_T offset;
+    ERROR_T rc;
+
+    if (!index) { 
+        return ERROR_NONEXISTENT;
+    }
+    if (key.length!=index->superblock.info.keysize) { 
+        return ERROR_SIZE;
+    }
+    rc=index->FindLeafAt(root,&key,path,leaf);
+    if (rc) { return rc; }
+    offset=path.slot[path.depth-1];
+    if (offset==leaf.info.numkeys) { 
+        return ERROR_NONEXISTENT;
+    }
+    rc=leaf.GetKey(offset,testkey);
+    if (rc) { return rc; }
+    if (testkey==key && !leaf.IsTombstone(offset)) { 
+        return leaf.GetVal(offset,value);
+    }
+    return ERROR_NONEXISTENT;
+}
+
+ERROR_T BTreeSnapshot::Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanFn fn, void *arg) const
+{
+    BTreePath path;
+    BTreeNode leaf;
+    KEY_T key;
+    VALUE_T value;
+    SIZE_T offset;
+    ERROR_T rc;
+
+    if (!index) { 
+        return ERROR_NONEXISTENT;
+    }
+    const SIZE_T keysize=index->superblock.info.keysize;
+    if (lo.length!=keysize || hi.length!=keysize) { 
+        return ERROR_SIZE;
+    }
+    rc=index->FindLeafAt(root,&lo,path,leaf);
+    for (offset = rc ? 0 : path.slot[path.depth-1]; rc==ERROR_NOERROR; offset=0) { 
+        for (;offset<leaf.info.numkeys;offset++) { 
+            if (leaf.IsTombstone(offset)) { 
+                continue;
+            }
+            rc=leaf.GetKey(offset,key);
+            if (rc) { return rc; }
+            if (memcmp(key.data,hi.data,keysize)>0) { 
                 return ERROR_NOERROR;
             }
-        case BTREE_INTERIOR_NODE:
-            // Scan through key/ptr pairs
-            //and recurse if possible
-            for (offset=0;offset<b.info.numkeys;offset++) { 
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (key<testkey || key==testkey) {
-                    // OK, so we now have the first key that's larger
-                    // so we need to recurse on the ptr immediately previous to 
-                    // this one, if it exists
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    rc=InsertRecursion(ptr,key,value,newkey,newnode);
-                    if (rc) { return rc; }
+            rc=leaf.GetVal(offset,value);
+            if (rc) { return rc; }
+            if (!fn(key,value,arg)) { 
+                return ERROR_NOERROR;
+            }
+        }
+        rc=index->StepLeafAt(path,leaf);
+    }
+    // an empty tree, or off the end of the leaves
+    return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
+
+ERROR_T BTreeSnapshot::Display(ostream &o, BTreeDisplayType display_type) const
+{
+    ERROR_T rc;
+
+    if (!index) { 
+        return ERROR_NONEXISTENT;
+    }
+    if (display_type==BTREE_DEPTH_DOT) { 
+        o << "digraph tree { \n";
+    }
+    rc=index->DisplayInternal(root,o,display_type);
+    if (display_type==BTREE_DEPTH_DOT) { 
+        o << "}\n";
+    }
+    return rc;
+}
+
+//
+// Compaction
+//
+// The compactor walks the leaves left to right, a few at a time,
+// purging the tombstones from each.  Between calls it remembers only
+// the last key of the leaf it did last, and finds its way back from the
+// root, so it never holds on to a block that a merge may have freed.
+//
+
+// The leaf that key leads to, or the first leaf if key is 0
+// return ERROR_NONEXISTENT if the tree is empty
+ERROR_T BTreeIndex::FindLeaf(const KEY_T *key, BTreePath &path, BTreeNode &leaf)
+{
+    ERROR_T rc;
+
+    const BTreeNode *b;
+    SIZE_T node=superblock.info.rootnode;
+    SIZE_T slot;
+
+    path.depth=0;
+    while (1) { 
+        rc=ReadDecoded(node,leaf,b);
+        if (rc) { return rc; }
+        switch (b->info.nodetype) { 
+            case BTREE_ROOT_NODE:
+                if (b->info.numkeys==0) { 
+                    return ERROR_NONEXISTENT;
+                }
+            case BTREE_INTERIOR_NODE:
+                slot=key ? nodeops.findkey(*b,*key) : 0;
+                rc=path.Push(node,slot);
+                if (rc) { return rc; }
+                rc=nodeops.getptr(*b,slot,node);
+                if (rc) { return rc; }
+                break;
+            case BTREE_LEAF_NODE:
+                // leaves are never decoded, so b is &leaf
+                return path.Push(node,key ? nodeops.findkey(leaf,*key) : 0);
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+ERROR_T BTreeIndex::StepLeaf(BTreePath &path, BTreeNode &leaf, const bool forward)
+{
+    ERROR_T rc;
+
+    const BTreeNode *b;
+    BTreeNode scratch;
+    SIZE_T level=path.depth-1;
+    SIZE_T node;
+    SIZE_T slot;
+
+    // up to the nearest node with a pointer on that side of the path
+    while (1) { 
+        if (level==0) { 
+            return ERROR_NONEXISTENT;
+        }
+        level--;
+        rc=ReadDecoded(path.block[level],scratch,b);
+        if (rc) { return rc; }
+        slot=path.slot[level];
+        if (forward ? slot<b->info.numkeys : slot>0) { 
+            break;
+        }
+    }
+    path.slot[level] = forward ? slot+1 : slot-1;
+    rc=b->GetPtr(path.slot[level],node);
+    if (rc) { return rc; }
+    path.depth=level+1;
+
+    // and down its near edge to a leaf
+    while (1) { 
+        rc=ReadDecoded(node,leaf,b);
+        if (rc) { return rc; }
+        switch (b->info.nodetype) { 
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                slot = forward ? 0 : b->info.numkeys;
+                rc=path.Push(node,slot);
+                if (rc) { return rc; }
+                rc=b->GetPtr(slot,node);
+                if (rc) { return rc; }
+                break;
+            case BTREE_LEAF_NODE:
+                return path.Push(node,forward ? 0 : leaf.info.numkeys);
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+ERROR_T BTreeIndex::Compact(const SIZE_T budget)
+{
+    if (latchmode==BTREE_LATCH_BLINK) { 
+        // purging merges nodes
+        return ERROR_BADCONFIG;
+    }
+    return FlushNodes(CompactInternal(budget));
+}
+
+ERROR_T BTreeIndex::CompactInternal(const SIZE_T budget)
+{
+    const SIZE_T keysize=superblock.info.keysize;
+    BTreePath path;
+    BTreeNode leaf;
+    SIZE_T leafnum;
+    KEY_T first;
+    KEY_T last;
+    bool underflow;
+    ERROR_T rc;
+
+    for (SIZE_T n=0;n<budget;n++) { 
+        rc=FindLeaf(compacting ? &compactkey : 0,path,leaf);
+        if (rc==ERROR_NONEXISTENT) { 
+            compacting=false;
+            return ERROR_NOERROR;
+        }
+        if (rc) { return rc; }
+        leafnum=path.Leaf();
+
+        // Move on past the leaf done last time, and any empty leaves
+        while (1) { 
+            if (leaf.info.numkeys>0) { 
+                rc=leaf.GetKey(leaf.info.numkeys-1,last);
+                if (rc) { return rc; }
+                if (!compacting || memcmp(last.data,compactkey.data,keysize)>0) { 
+                    break;
+                }
+            }
+            rc=StepLeaf(path,leaf,true);
+            if (rc==ERROR_NONEXISTENT) { 
+                leafnum=0;
+                break;
+            }
+            if (rc) { return rc; }
+            leafnum=path.Leaf();
+        }
+        if (!leafnum) { 
+            // off the end, start over at the first leaf
+            compacting=false;
+            continue;
+        }
+
+        if (leaf.GetNumTombstones()>0) { 
+            rc=leaf.GetKey(0,first);
+            if (rc) { return rc; }
+            rc=DeleteRecursion(superblock.info.rootnode,first,true,underflow);
+            if (rc) { return rc; }
+        }
+        rc=leaf.GetKey(leaf.info.numkeys-1,compactkey);
+        if (rc) { return rc; }
+        compacting=true;
+    }
+    return ERROR_NOERROR;
+}
 
-                    // the case where a new node is returned
-                    if (newnode) {
-                        // fix up pointers for this interior node
-                        // initialize temporary key and ptr variables
-                        KEY_T tempKeyPrev=newkey;
-                        SIZE_T tempPtrPrev=newnode;
-                        KEY_T tempKeyCurrent=testkey; 
-                        SIZE_T tempPtrCurrent;
-                        rc=b.GetPtr(offset+1,tempPtrCurrent);
-                        if (rc) { return rc; }
-                        
-                        // increment number of keys
-                        b.info.numkeys+=1;
+void BTreeIndex::SetCompaction(const SIZE_T everyops, const SIZE_T budget)
+{
+    compactevery=everyops;
+    compactbudget=budget;
+    compactops=0;
+}
 
-                        // iterate through and move all keys and ptrs over by one
-                        for (SIZE_T i=offset;i<b.info.numkeys-1;i++) {
-                            rc=b.SetKey(i,tempKeyPrev);
-                            if (rc) { return rc; }
-                            rc=b.SetPtr(i+1,tempPtrPrev);
-                            if (rc) { return rc; }
-                            tempKeyPrev=tempKeyCurrent;
-                            tempPtrPrev=tempPtrCurrent;
-                            rc=b.GetKey(i+1,tempKeyCurrent);
-                            if (rc) { return rc; }
-                            rc=b.GetPtr(i+2,tempPtrCurrent);
-                            if (rc) { return rc; }
-                        } 
+// Called by each Insert, Update, Delete and Lookup
+void BTreeIndex::CountOp()
+{
+    if (latchmode!=BTREE_LATCH_NONE || !compactevery || ++compactops<compactevery) { 
+        return;
+    }
+    compactops=0;
+    // A step that fails leaves the tree as it was, or with some of the
+    // tombstones gone, so there is nothing to undo; the next step
+    // tries again.
+    Compact(compactbudget);
+}
 
-                        // just set the key and ptr of last position in b 
-                        rc=b.SetKey(b.info.numkeys-1,tempKeyPrev);
-                        if (rc) { return rc; }
-                        rc=b.SetPtr(b.info.numkeys,tempPtrPrev);
-                        if (rc) { return rc; }
-                        rc=b.Serialize(buffercache,node);
-                        if (rc) { return rc; }
 
-                        // if the node is now too full, split and return the new node
-                        if ((int)(b.info.GetNumSlotsAsInterior()*(2./3.)) <= b.info.numkeys) {
-                            //    copy b into splitNode
-                            BTreeNode splitNode = b;
+//
+// Message buffers (SetMessageBuffers)
+//
+// Each interior node keeps a buffer of messages: inserts, updates and
+// deletes of keys under it that have not got down to their leaves
+// yet.  An operation only looks its key up, to know whether it can go
+// ahead, and adds its message to the root's buffer.  The first message
+// on a key's way down is the newest, so it decides, and the leaf only
+// counts if there is none.  A full buffer sends the messages for one
+// child, the one with the most, down a level at a time, so a leaf is
+// read and written once for a whole batch of them.  Down at the leaf,
+// each message is made by the plain B-tree code, with its splits and
+// merges, so the messages are routed by key, to wherever their keys
+// are, only as they go down.  Interior nodes never merge or borrow,
+// as that would take keys away from their messages.
+//
 
-                            // last key of first node
-                            SIZE_T lastKeyIndex= (SIZE_T)(int)(b.info.numkeys/2)-1;
-                            // first key of new split node
-                            SIZE_T firstKeyIndex=lastKeyIndex+2;
+// The message that does what older and then newer do, 0 if together
+// they do nothing, or -1 if newer cannot follow older
+static int CombineMessages(const int older, const int newer)
+{
+    switch (older) { 
+        case BTREE_MESSAGE_INSERT:
+            if (newer==BTREE_MESSAGE_UPDATE) { 
+                return BTREE_MESSAGE_INSERT;
+            }
+            if (newer==BTREE_MESSAGE_DELETE) { 
+                return 0;
+            }
+            break;
+        case BTREE_MESSAGE_UPDATE:
+            if (newer==BTREE_MESSAGE_UPDATE || newer==BTREE_MESSAGE_DELETE) { 
+                return newer;
+            }
+            break;
+        case BTREE_MESSAGE_DELETE:
+            if (newer==BTREE_MESSAGE_INSERT) { 
+                return BTREE_MESSAGE_UPDATE;
+            }
+            break;
+    }
+    return -1;
+}
 
-                            // get the new key that we need to promote
-                            rc=b.GetKey(lastKeyIndex+1,newkey);
-                            if (rc) { return rc; }
+// Adds a message to b's buffer, or combines it with the one there for
+// the same key.  full is set, and b left alone, if it needs a new
+// message slot and there is none.
+static ERROR_T PutMessage(BTreeNode &b, const int type, const KEY_T &key, const VALUE_T &value, bool &full)
+{
+    SIZE_T offset=b.FindMessage(key);
+    KEY_T testkey;
+    VALUE_T oldvalue;
+    int oldtype;
+    int newtype;
+    ERROR_T rc;
 
-                            // move the second half of the old node into the beginning of newnode
-                            SIZE_T insertIndex=0;
-                            KEY_T tempKey;
-                            SIZE_T tempPtr;
-                            for (SIZE_T i=firstKeyIndex;i<splitNode.info.numkeys;i++) {
-                                rc=b.GetKey(i,tempKey);
-                                if (rc) { return rc; }
-                                rc=b.GetPtr(i,tempPtr);
-                                if (rc) { return rc; }
-                                rc=splitNode.SetKey(insertIndex,tempKey);
-                                if (rc) { return rc; }
-                                rc=splitNode.SetPtr(insertIndex,tempPtr);
-                                if (rc) { return rc; }
-                                insertIndex++;
-                            }
-                            // insert extra pointers
-                            rc=b.GetPtr(b.info.numkeys,tempPtr);
-                            rc=splitNode.SetPtr(insertIndex,tempPtr);
+    full=false;
+    if (offset<b.GetNumMessages()) { 
+        rc=b.GetMessage(offset,oldtype,testkey,oldvalue);
+        if (rc) { return rc; }
+        if (testkey==key) { 
+            newtype=CombineMessages(oldtype,type);
+            if (newtype<0) { 
+                return ERROR_INSANE;
+            }
+            return newtype ? b.SetMessage(offset,newtype,value) : b.RemoveMessages(offset,1);
+        }
+    }
+    if (b.GetNumMessages()>=b.GetMaxMessages()) { 
+        full=true;
+        return ERROR_NOERROR;
+    }
+    return b.InsertMessage(offset,type,key,value);
+}
 
-                            b.info.numkeys=lastKeyIndex+1;
-                            splitNode.info.numkeys=insertIndex;
+ERROR_T BTreeIndex::LookupBuffered(const KEY_T &key, VALUE_T &value)
+{
+    const BTreeNode *b;
+    BTreeNode scratch;
+    SIZE_T node=superblock.info.rootnode;
+    SIZE_T offset;
+    KEY_T testkey;
+    VALUE_T msgvalue;
+    int type;
+    ERROR_T rc;
 
-                            // allocate space for newnode on the disk
-                            rc=AllocateNode(newnode);
-                            if (rc) { return rc; }
+    if (key.length!=superblock.info.keysize) { 
+        return ERROR_SIZE;
+    }
 
-                            // serialize newnode and b to the disk
-                            rc=splitNode.Serialize(buffercache,newnode);
-                            if (rc) { return rc; }
-                            rc=b.Serialize(buffercache,node);
-                            if (rc) { return rc; }
-                        } else {
-                            // this node is NOT full
-                            // so we need to reset newnode to the null pointer
-                            // so the parent caller knows that no newnode was
-                            // created at this level
-                            newnode=(SIZE_T)0;
+    while (1) { 
+        rc=ReadDecoded(node,scratch,b);
+        if (rc) { return rc; }
+        switch (b->info.nodetype) { 
+            case BTREE_ROOT_NODE:
+                if (b->info.numkeys==0) { 
+                    return ERROR_NONEXISTENT;
+                }
+            case BTREE_INTERIOR_NODE:
+                offset=b->FindMessage(key);
+                if (offset<b->GetNumMessages()) { 
+                    rc=b->GetMessage(offset,type,testkey,msgvalue);
+                    if (rc) { return rc; }
+                    if (testkey==key) { 
+                        if (type==BTREE_MESSAGE_DELETE) { 
+                            return ERROR_NONEXISTENT;
                         }
-                        return ERROR_NOERROR;   
+                        rc=value.Resize(msgvalue.length,false);
+                        if (rc) { return rc; }
+                        memcpy(value.data,msgvalue.data,msgvalue.length);
+                        return ERROR_NOERROR;
                     }
-                    // there was no newnode
-                    // return to parent
-                    return ERROR_NOERROR;
                 }
-            }
-            // if we got here, we need to go to the next pointer, if it exists
-            if (true) { 
-                rc=b.GetPtr(b.info.numkeys,ptr);
+                rc=b->GetPtr(nodeops.findkey(*b,key),node);
                 if (rc) { return rc; }
-                return InsertRecursion(ptr,key,value,newkey,newnode);
+                break;
+            case BTREE_LEAF_NODE:
+                offset=nodeops.findkey(*b,key);
+                if (offset>=b->info.numkeys) { 
+                    return ERROR_NONEXISTENT;
+                }
+                rc=b->GetKey(offset,testkey);
                 if (rc) { return rc; }
-                if (newnode) {
-                    // fix up pointers for this interior node
-                    // since this was the last pointer, we just
-                    // need to add a new key and pointer at the end
-                    // increment number of keys
-                    b.info.numkeys+=1;
+                if (!(testkey==key) || b->IsTombstone(offset)) { 
+                    return ERROR_NONEXISTENT;
+                }
+                return b->GetVal(offset,value);
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
 
-                    // just set the key and ptr of last position in b 
-                    rc=b.SetKey(b.info.numkeys-1,newkey);
-                    if (rc) { return rc; }
-                    rc=b.SetPtr(b.info.numkeys,newnode);
-                    if (rc) { return rc; }
-                    rc=b.Serialize(buffercache,node);
-                    if (rc) { return rc; } 
-                    // if now too full, split and return the new node
-                    if ((int)(b.info.GetNumSlotsAsInterior()*(2./3.)) <= b.info.numkeys) {
-                        //    copy b into splitNode
-                        BTreeNode splitNode = b;
-
-                        // last key of first node
-                        SIZE_T lastKeyIndex= (SIZE_T)(int)(b.info.numkeys/2)-1;
-                        // first key of new split node
-                        SIZE_T firstKeyIndex=lastKeyIndex+2;
-
-                        // get the new key that we need to promote
-                        rc=b.GetKey(lastKeyIndex+1,newkey);
-                        if (rc) { return rc; }
+ERROR_T BTreeIndex::BufferMessage(const int type, const KEY_T &key, const VALUE_T &value)
+{
+    VALUE_T none(superblock.info.valuesize);
+    const VALUE_T &v = type==BTREE_MESSAGE_DELETE ? none : value;
+    VALUE_T current;
+    BTreeNode b;
+    SIZE_T node;
+    bool full;
+    ERROR_T rc;
 
-                        // move the second half of the old node into the beginning of newnode
-                        SIZE_T insertIndex=0;
-                        KEY_T tempKey;
-                        SIZE_T tempPtr;
-                        for (SIZE_T i=firstKeyIndex;i<splitNode.info.numkeys;i++) {
-                            rc=b.GetKey(i,tempKey);
-                            if (rc) { return rc; }
-                            rc=b.GetPtr(i,tempPtr);
-                            if (rc) { return rc; }
-                            rc=splitNode.SetKey(insertIndex,tempKey);
-                            if (rc) { return rc; }
-                            rc=splitNode.SetPtr(insertIndex,tempPtr);
-                            if (rc) { return rc; }
-                            insertIndex++;
-                        }
-                        // insert extra pointers
-                        rc=b.GetPtr(b.info.numkeys,tempPtr);
-                        rc=splitNode.SetPtr(insertIndex,tempPtr);
+    if (key.length!=superblock.info.keysize || v.length!=superblock.info.valuesize) { 
+        return ERROR_SIZE;
+    }
+    memset(none.data,0,none.length);
 
-                        b.info.numkeys=lastKeyIndex+1;
-                        splitNode.info.numkeys=insertIndex;
+    // whether the key is there, messages and all, says if this can go ahead
+    rc=LookupBuffered(key,current);
+    if (rc==ERROR_NOERROR && type==BTREE_MESSAGE_INSERT) { 
+        return ERROR_CONFLICT;
+    }
+    if (rc==ERROR_NONEXISTENT && type!=BTREE_MESSAGE_INSERT) { 
+        return ERROR_NONEXISTENT;
+    }
+    if (rc && rc!=ERROR_NONEXISTENT) { 
+        return rc;
+    }
 
-                        // allocate space for newnode on the disk
-                        rc=AllocateNode(newnode);
-                        if (rc) { return rc; }
+    while (1) { 
+        node=superblock.info.rootnode;
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+        if (b.info.numkeys==0) { 
+            // the first key makes the first leaves, as ever
+            return InsertFirst(key,v);
+        }
+        rc=PutMessage(b,type,key,v,full);
+        if (rc) { return rc; }
+        if (!full) { 
+            bufferedmessages++;
+            return WriteNode(node,b);
+        }
+        // this may split the root, so it is read again
+        rc=FlushBuffer(node);
+        if (rc) { return rc; }
+    }
+}
 
-                        // serialize newnode and b to the disk
-                        rc=splitNode.Serialize(buffercache,newnode);
-                        if (rc) { return rc; }
-                        rc=b.Serialize(buffercache,node);
-                        if (rc) { return rc; }
-                    } else {
-                        // this node is NOT full
-                        // so we need to reset newnode to the null pointer
-                        // so the parent caller knows that no newnode was
-                        // created at this level
-                        newnode=(SIZE_T)0;
-                    }
-                    // this is the end of the case where child returns a newnode
-                    return ERROR_NOERROR;
-                }
-                // this is the end of the case where there was no newnode
-                return ERROR_NOERROR;
-            } else {
-                // There are no keys at all on this node, so nowhere to go
-                return ERROR_NONEXISTENT;
-            }
+ERROR_T BTreeIndex::FlushBuffer(const SIZE_T node)
+{
+    BTreeNode b;
+    BTreeNode child;
+    vector<int> types;
+    vector<KeyValuePair> batch;
+    KEY_T key;
+    KEY_T sep;
+    VALUE_T value;
+    SIZE_T n;
+    SIZE_T first=0;
+    SIZE_T count=0;
+    SIZE_T slot=0;
+    SIZE_T s;
+    SIZE_T i, j;
+    SIZE_T childnode;
+    SIZE_T moved;
+    bool full;
+    int type;
+    ERROR_T rc;
+
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+    n=b.GetNumMessages();
+    if (n==0) { 
+        return ERROR_NOERROR;
+    }
+
+    // the messages are in key order, so each child's are together
+    for (i=0;i<n;i=j) { 
+        rc=b.GetMessage(i,type,key,value);
+        if (rc) { return rc; }
+        s=nodeops.findkey(b,key);
+        if (s<b.info.numkeys) { 
+            rc=b.GetKey(s,sep);
+            if (rc) { return rc; }
+            j=MessagesUpTo(b,sep);
+        } else {
+            j=n;
+        }
+        if (j-i>count) { 
+            first=i;
+            count=j-i;
+            slot=s;
+        }
+    }
+    rc=b.GetPtr(slot,childnode);
+    if (rc) { return rc; }
+    rc=ReadNode(childnode,child);
+    if (rc) { return rc; }
+
+    if (child.info.nodetype==BTREE_LEAF_NODE) { 
+        // The batch comes out of the buffer first, as making the
+        // changes may split or merge the leaf, and so change node
+        for (i=first;i<first+count;i++) { 
+            rc=b.GetMessage(i,type,key,value);
+            if (rc) { return rc; }
+            types.push_back(type);
+            batch.push_back(KeyValuePair(key,value));
+        }
+        rc=b.RemoveMessages(first,count);
+        if (rc) { return rc; }
+        rc=WriteNode(node,b);
+        if (rc) { return rc; }
+        for (i=0;i<count;i++) { 
+            rc=ApplyMessage(types[i],batch[i].key,batch[i].value);
+            if (rc) { return rc; }
+        }
+        appliedmessages+=count;
+        leafbatches++;
+        return ERROR_NOERROR;
+    }
+
+    // into the child's buffer, as many as there is room for
+    for (moved=0;moved<count;moved++) { 
+        rc=b.GetMessage(first+moved,type,key,value);
+        if (rc) { return rc; }
+        rc=PutMessage(child,type,key,value,full);
+        if (rc) { return rc; }
+        if (full) { 
             break;
-        case BTREE_LEAF_NODE:
-            // Scan through keys
-            // if we find a matching key, return ERROR_CONFLICT
-            // if we find a key that is larger, begin insert process
-            for (offset=0;offset<b.info.numkeys;offset++) { 
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (testkey==key) { 
-                    return ERROR_CONFLICT;
-                } else if (key<testkey) {
-                    // the key we found is larger than the key we want to insert
-                    // we need to insert our key at this offset
-
-                    // initialize temporary key and value variables
-                    KEY_T tempKeyPrev=key; 
-                    VALUE_T tempValuePrev=value;
-                    KEY_T tempKeyCurrent=testkey; 
-                    VALUE_T tempValueCurrent;
-                    rc=b.GetVal(offset,tempValueCurrent);
-                    if (rc) { return rc; }
-                    
-                    // increment number of keys
-                    b.info.numkeys+=1;
+        }
+    }
+    if (moved==0) { 
+        // make room in the child; the caller comes back
+        return FlushBuffer(childnode);
+    }
+    rc=b.RemoveMessages(first,moved);
+    if (rc) { return rc; }
+    rc=WriteNode(childnode,child);
+    if (rc) { return rc; }
+    return WriteNode(node,b);
+}
 
-                    // iterate through and move all keys and values over by one
-                    for (SIZE_T i=offset;i<b.info.numkeys-1;i++) {
-                        rc=b.SetKey(i,tempKeyPrev);
-                        if (rc) { return rc; }
-                        rc=b.SetVal(i,tempValuePrev);
-                        if (rc) { return rc; }
-                        tempKeyPrev=tempKeyCurrent;
-                        tempValuePrev=tempValueCurrent;
-                        rc=b.GetKey(i+1,tempKeyCurrent);
-                        if (rc) { return rc; }
-                        rc=b.GetVal(i+1,tempValueCurrent);
-                        if (rc) { return rc; }
-                    }
+// Makes a message's change in its leaf, as the plain B-tree does
+ERROR_T BTreeIndex::ApplyMessage(const int type, const KEY_T &key, const VALUE_T &value)
+{
+    bool underflow;
+    ERROR_T rc;
 
-                    // edge case where we don't want to get next key and val
-                    // just set the key and val of last position in b 
-                    rc=b.SetKey(b.info.numkeys-1,tempKeyPrev);
-                    if (rc) { return rc; }
-                    rc=b.SetVal(b.info.numkeys-1,tempValuePrev);
-                    if (rc) { return rc; }
-                    rc=b.Serialize(buffercache,node);
-                    if (rc) { return rc; }
-                    // if the node is now too big, split using recursion and return the new node
-                    // otherwise just return 0
-                    if ((int)(b.info.GetNumSlotsAsLeaf()*(2./3.)) <= b.info.numkeys) {
-                        // copy b into splitNode
-                        BTreeNode splitNode = b;
-
-                        SIZE_T halfIndex= (SIZE_T)(int)(b.info.numkeys/2);
-                        rc=b.GetKey(halfIndex-1,newkey);
-                        if (rc) { return rc; }
+    switch (type) { 
+        case BTREE_MESSAGE_INSERT:
+            rc=InsertInternal(key,value);
+            break;
+        case BTREE_MESSAGE_UPDATE:
+            rc=LookupOrUpdateInternal(BTREE_OP_UPDATE,key,(VALUE_T&)value);
+            break;
+        case BTREE_MESSAGE_DELETE:
+            rc=DeleteRecursion(superblock.info.rootnode,key,false,underflow);
+            break;
+        default:
+            return ERROR_INSANE;
+    }
+    // the key was checked when the message was buffered
+    if (rc==ERROR_CONFLICT || rc==ERROR_NONEXISTENT) { 
+        return ERROR_INSANE;
+    }
+    return rc;
+}
 
-                        // move the second half of the old node into the beginning of newnode
-                        SIZE_T insertIndex=0;
-                        KEY_T tempKey;
-                        VALUE_T tempValue;
-                        for (SIZE_T i=halfIndex;i<splitNode.info.numkeys;i++) {
-                            rc=b.GetKey(i,tempKey);
-                            if (rc) { return rc; }
-                            rc=b.GetVal(i,tempValue);
-                            if (rc) { return rc; }
-                            rc=splitNode.SetKey(insertIndex,tempKey);
-                            if (rc) { return rc; }
-                            rc=splitNode.SetVal(insertIndex,tempValue);
-                            if (rc) { return rc; }
-                            insertIndex++;
-                        }
-                        b.info.numkeys=halfIndex;
-                        splitNode.info.numkeys=insertIndex;
+ERROR_T BTreeIndex::FlushMessages()
+{
+    SIZE_T flushed;
+    ERROR_T rc;
 
-                        // allocate space for newnode on the disk
-                        rc=AllocateNode(newnode);
-                        if (rc) { return rc; }
+    // Flushing may split nodes the pass has gone by, so it goes round
+    // until a pass finds nothing to do
+    do { 
+        flushed=0;
+        rc=FlushNodes(FlushAllBuffers(superblock.info.rootnode,flushed));
+        if (rc) { return rc; }
+    } while (flushed);
+    return ERROR_NOERROR;
+}
 
-                        // serialize newnode to the disk
-                        rc=splitNode.Serialize(buffercache,newnode);
-                        if (rc) { return rc; }
-                        rc=b.Serialize(buffercache,node);
-                        if (rc) { return rc; }
-                        return ERROR_NOERROR;
-                    }
-                    return ERROR_NOERROR;
-                }
-            }
-            // there is no key larger than the new key
-            // add it on to the end of b
-            //
-            // increment number of keys
-            b.info.numkeys+=1;
+// Empties the buffers of node and the nodes under it, counting the
+// batches in flushed
+ERROR_T BTreeIndex::FlushAllBuffers(const SIZE_T node, SIZE_T &flushed)
+{
+    BTreeNode b;
+    SIZE_T ptr;
+    SIZE_T i;
+    ERROR_T rc;
 
-            // set the key and val
-            rc=b.SetKey(b.info.numkeys-1,key);
-            if (rc) { return rc; }
-            rc=b.SetVal(b.info.numkeys-1,value);
-            if (rc) { return rc; }
-            rc=b.Serialize(buffercache,node);
-            if (rc) { return rc; }
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE || b.info.numkeys==0) { 
+        return ERROR_NOERROR;
+    }
+    while (b.GetNumMessages()>0) { 
+        rc=FlushBuffer(node);
+        if (rc) { return rc; }
+        flushed++;
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+    }
+    // node is read again each time, as flushing below may split it
+    for (i=0;i<=b.info.numkeys;i++) { 
+        rc=b.GetPtr(i,ptr);
+        if (rc) { return rc; }
+        rc=FlushAllBuffers(ptr,flushed);
+        if (rc) { return rc; }
+        rc=ReadNode(node,b);
+        if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+}
 
-            // if the node is too big, split using recursion, then return the new node
-            if ((int)(b.info.GetNumSlotsAsLeaf()*(2./3.)) <= b.info.numkeys) {
-                // copy b into splitNode
-                BTreeNode splitNode = b;
+ERROR_T BTreeIndex::CollectMessages(const SIZE_T node,
+        const KEY_T *lo,
+        const KEY_T *hi,
+        map<KEY_T, pair<int, VALUE_T> > &messages) const
+{
+    BTreeNode b;
+    KEY_T key;
+    VALUE_T value;
+    SIZE_T first;
+    SIZE_T last;
+    SIZE_T ptr;
+    SIZE_T i;
+    int type;
+    ERROR_T rc;
 
-                SIZE_T halfIndex= (SIZE_T)(int)(b.info.numkeys/2);
-                rc=b.GetKey(halfIndex-1,newkey);
-                if (rc) { return rc; }
+    rc=b.Unserialize(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE || b.info.numkeys==0) { 
+        return ERROR_NOERROR;
+    }
 
-                // move the second half of the old node into the beginning of newnode
-                SIZE_T insertIndex=0;
-                KEY_T tempKey;
-                VALUE_T tempValue;
-                for (SIZE_T i=halfIndex;i<splitNode.info.numkeys;i++) {
-                    rc=b.GetKey(i,tempKey);
-                    if (rc) { return rc; }
-                    rc=b.GetVal(i,tempValue);
-                    if (rc) { return rc; }
-                    rc=splitNode.SetKey(insertIndex,tempKey);
-                    if (rc) { return rc; }
-                    rc=splitNode.SetVal(insertIndex,tempValue);
-                    if (rc) { return rc; }
-                    insertIndex++;
-                }
-                b.info.numkeys=halfIndex;
-                splitNode.info.numkeys=insertIndex;
+    // a message higher up for the same key is already there, and wins
+    for (i=lo ? b.FindMessage(*lo) : 0;i<b.GetNumMessages();i++) { 
+        rc=b.GetMessage(i,type,key,value);
+        if (rc) { return rc; }
+        if (hi && memcmp(key.data,hi->data,superblock.info.keysize)>0) { 
+            break;
+        }
+        messages.insert(make_pair(key,make_pair(type,value)));
+    }
 
-                // allocate space for newnode on the disk
-                rc=AllocateNode(newnode);
-                if (rc) { return rc; }
+    // the children whose ranges meet [lo,hi]
+    first=lo ? nodeops.findkey(b,*lo) : 0;
+    last=hi ? nodeops.findkey(b,*hi) : b.info.numkeys;
+    for (i=first;i<=last;i++) { 
+        rc=b.GetPtr(i,ptr);
+        if (rc) { return rc; }
+        rc=CollectMessages(ptr,lo,hi,messages);
+        if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Fill statistics
+//
+ERROR_T BTreeIndex::GetFillStats(BTreeFillStats &stats) const
+{
+    stats.height=0;
+    stats.interiornodes=0;
+    stats.leaves=0;
+    stats.interiorkeys=0;
+    stats.interiorslots=0;
+    stats.leafkeys=0;
+    stats.tombstones=0;
+    stats.leafslots=0;
+    stats.messages=0;
+    stats.messageslots=0;
+    if (!nodeops.leafsplit) { 
+        // not attached, so there is no tree
+        return ERROR_NONEXISTENT;
+    }
+    return FillStatsInternal(superblock.info.rootnode,1,stats);
+}
+
+ERROR_T BTreeIndex::FillStatsInternal(const SIZE_T node, const SIZE_T depth, BTreeFillStats &stats) const
+{
+    BTreeNode b;
+    SIZE_T ptr;
+    SIZE_T dead;
+    ERROR_T rc;
+
+    rc=b.Unserialize(buffercache,node);
+    if (rc) { return rc; }
+
+    if (depth>stats.height) { 
+        stats.height=depth;
+    }
 
-                // serialize newnode to the disk
-                rc=splitNode.Serialize(buffercache,newnode);
+    switch (b.info.nodetype) { 
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            stats.interiornodes++;
+            stats.interiorkeys+=b.info.numkeys;
+            stats.interiorslots+=b.GetNumSlots();
+            stats.messages+=b.GetNumMessages();
+            stats.messageslots+=b.GetMaxMessages();
+            if (b.info.numkeys==0) { 
+                // empty tree
+                return ERROR_NOERROR;
+            }
+            for (SIZE_T offset=0;offset<=b.info.numkeys;offset++) { 
+                rc=b.GetPtr(offset,ptr);
                 if (rc) { return rc; }
-                rc=b.Serialize(buffercache,node);
+                rc=FillStatsInternal(ptr,depth+1,stats);
                 if (rc) { return rc; }
-                return ERROR_NOERROR;
             }
             return ERROR_NOERROR;
-            break;
+        case BTREE_LEAF_NODE:
+            dead=b.GetNumTombstones();
+            stats.leaves++;
+            stats.leafkeys+=b.info.numkeys-dead;
+            stats.tombstones+=dead;
+            stats.leafslots+=b.GetNumSlots();
+            return ERROR_NOERROR;
         default:
-            // We can't be looking at anything other than a root, internal, or leaf
             return ERROR_INSANE;
-            break;
-    }  
-    return ERROR_INSANE;
-}
-
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-    // WRITE ME
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, (VALUE_T&)value);
+    }
 }
 
-
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+ostream & BTreeFillStats::Print(ostream &os) const
 {
-    // This is optional extra credit 
-    //
-    // 
-    return ERROR_UNIMPL;
+    os << "height          = "<<height<<endl;
+    os << "interiornodes   = "<<interiornodes<<endl;
+    os << "leaves          = "<<leaves<<endl;
+    os << "keys            = "<<leafkeys<<endl;
+    os << "tombstones      = "<<tombstones<<endl;
+    // the share of the slots in use, tombstones included
+    os << "interiorfill    = "<<(interiorslots ? (double)interiorkeys/interiorslots : 0)<<endl;
+    os << "leaffill        = "<<(leafslots ? (double)(leafkeys+tombstones)/leafslots : 0)<<endl;
+    if (messageslots) { 
+        os << "messages        = "<<messages<<endl;
+        os << "bufferfill      = "<<(double)messages/messageslots<<endl;
+    }
+    return os;
 }
 
 
@@ -818,66 +4473,85 @@ ERROR_T BTreeIndex::Delete(const KEY_T &key)
 
 ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
         ostream &o,
-        BTreeDisplayType display_type) const
-{
-    KEY_T testkey;
-    SIZE_T ptr;
-    BTreeNode b;
+        BTreeDisplayType display_type) const
+{
+    BTreePath path;
+    BTreeNode nodes[BTREE_MAX_HEIGHT];
+    SIZE_T ptr=node;
+    SIZE_T level;
     ERROR_T rc;
-    SIZE_T offset;
 
-    rc= b.Unserialize(buffercache,node);
+    // Each node is printed when the walk first comes to it.  The slot
+    // of each node on the path is the next pointer to go down.
+    while (1) { 
+        level=path.depth;
+        rc=path.Push(ptr,0);
+        if (rc) { return rc; }
+        BTreeNode &b=nodes[level];
 
-    if (rc!=ERROR_NOERROR) { 
-        return rc;
-    }
+        rc= b.Unserialize(buffercache,ptr);
 
-    rc = PrintNode(o,node,b,display_type);
+        if (rc!=ERROR_NOERROR) { 
+            return rc;
+        }
 
-    if (rc) { return rc; }
+        rc = PrintNode(o,ptr,b,display_type);
 
-    if (display_type==BTREE_DEPTH_DOT) { 
-        o << ";";
-    }
+        if (rc) { return rc; }
 
-    if (display_type!=BTREE_SORTED_KEYVAL) {
-        o << endl;
-    }
+        if (display_type==BTREE_DEPTH_DOT) { 
+            o << ";";
+        }
 
-    switch (b.info.nodetype) { 
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            if (b.info.numkeys>0) { 
-                for (offset=0;offset<=b.info.numkeys;offset++) { 
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    if (display_type==BTREE_DEPTH_DOT) { 
-                        o << node << " -> "<<ptr<<";\n";
-                    }
-                    rc=DisplayInternal(ptr,o,display_type);
-                    if (rc) { return rc; }
+        if (display_type!=BTREE_SORTED_KEYVAL) {
+            o << endl;
+        }
+
+        switch (b.info.nodetype) { 
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                if (b.info.numkeys==0) { 
+                    path.depth--;
                 }
+                break;
+            case BTREE_LEAF_NODE:
+                path.depth--;
+                break;
+            default:
+                if (display_type==BTREE_DEPTH_DOT) { 
+                } else {
+                    o << "Unsupported Node Type " << b.info.nodetype ;
+                }
+                return ERROR_INSANE;
+        }
+
+        // back up to the nearest node with pointers left to go down
+        while (path.depth>0) { 
+            level=path.depth-1;
+            if (path.slot[level]<=nodes[level].info.numkeys) { 
+                break;
             }
+            path.depth--;
+        }
+        if (path.depth==0) { 
             return ERROR_NOERROR;
-            break;
-        case BTREE_LEAF_NODE:
-            return ERROR_NOERROR;
-            break;
-        default:
-            if (display_type==BTREE_DEPTH_DOT) { 
-            } else {
-                o << "Unsupported Node Type " << b.info.nodetype ;
-            }
-            return ERROR_INSANE;
+        }
+        rc=nodes[level].GetPtr(path.slot[level],ptr);
+        if (rc) { return rc; }
+        path.slot[level]++;
+        if (display_type==BTREE_DEPTH_DOT) { 
+            o << path.block[level] << " -> "<<ptr<<";\n";
+        }
     }
-
-    return ERROR_NOERROR;
 }
 
 
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
     ERROR_T rc;
+    if (display_type==BTREE_SORTED_KEYVAL && superblock.info.bufferratio) { 
+        return DisplayMerged(o);
+    }
     if (display_type==BTREE_DEPTH_DOT) { 
         o << "digraph tree { \n";
     }
@@ -889,6 +4563,86 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 }
 
 
+// One "(key,value)" line, as PrintNode writes it for a leaf
+static void PrintPair(ostream &os, const BTreeNode &b, const KEY_T &key, const VALUE_T &value)
+{
+    os << "(";
+    PrintKey(os,b,key);
+    os << ",";
+    for (unsigned i=0;i<b.info.valuesize;i++) { 
+        os << value.data[i];
+    }
+    os << ")\n";
+}
+
+// Goes down the left edge and along the leaf chain, with the messages
+// for keys up to each leaf key written out before it
+ERROR_T BTreeIndex::DisplayMerged(ostream &o) const
+{
+    map<KEY_T, pair<int, VALUE_T> > messages;
+    map<KEY_T, pair<int, VALUE_T> >::const_iterator m;
+    BTreeNode b;
+    KEY_T key;
+    VALUE_T value;
+    SIZE_T node=superblock.info.rootnode;
+    SIZE_T offset;
+    bool replaced;
+    ERROR_T rc;
+
+    rc=CollectMessages(node,0,0,messages);
+    if (rc) { return rc; }
+    m=messages.begin();
+
+    rc=b.Unserialize(buffercache,node);
+    if (rc) { return rc; }
+    if (b.info.numkeys==0) { 
+        // an empty tree
+        return ERROR_NOERROR;
+    }
+    while (b.info.nodetype!=BTREE_LEAF_NODE) { 
+        rc=b.GetPtr(0,node);
+        if (rc) { return rc; }
+        rc=b.Unserialize(buffercache,node);
+        if (rc) { return rc; }
+    }
+    while (1) { 
+        for (offset=0;offset<b.info.numkeys;offset++) { 
+            if (b.IsTombstone(offset)) { 
+                continue;
+            }
+            rc=b.GetKey(offset,key);
+            if (rc) { return rc; }
+            replaced=false;
+            for (;m!=messages.end() && !(key<m->first);++m) { 
+                if (m->second.first!=BTREE_MESSAGE_DELETE) { 
+                    PrintPair(o,superblock,m->first,m->second.second);
+                }
+                replaced=m->first==key;
+            }
+            if (replaced) { 
+                continue;
+            }
+            rc=b.GetVal(offset,value);
+            if (rc) { return rc; }
+            PrintPair(o,superblock,key,value);
+        }
+        rc=b.GetPtr(0,node);
+        if (rc) { return rc; }
+        if (node==0) { 
+            break;
+        }
+        rc=b.Unserialize(buffercache,node);
+        if (rc) { return rc; }
+    }
+    for (;m!=messages.end();++m) { 
+        if (m->second.first!=BTREE_MESSAGE_DELETE) { 
+            PrintPair(o,superblock,m->first,m->second.second);
+        }
+    }
+    return ERROR_NOERROR;
+}
+
+
 ERROR_T BTreeIndex::SanityCheck() const
 {
     ERROR_T rc;
@@ -908,71 +4662,215 @@ ERROR_T BTreeIndex::SanityCheck() const
 
 
 // Kind of a misnomer, because we've included multiple insanity check invariants here
-ERROR_T BTreeIndex::NodesInOrder(const SIZE_T &node, SIZE_T &totalKeys) const 
+//
+// The walk goes depth first, left to right, with the way down in a
+// BTreePath, and checks that
+//   no node holds more keys than it has slots
+//   the keys in each node are strictly increasing
+//   the keys under each pointer are within the separators either side of it
+//   all the leaves are at the same depth
+//   the leaf chain goes through the leaves in the same order, and ends
+//     (except with copy on write, which does not keep it)
+//   in a B-link tree, each node links to the next one at its depth,
+//     and its high key is the separator above it
+//   the messages in each buffer are in order, fit, and are for keys
+//     under the node, and the keys come to numkeys once they are made
+//
+// ERROR_INSANE unless key is within the separators either side of the
+// pointer the walk took to the node at level: after the one on the
+// left, and no further than the one on the right
+static ERROR_T WithinSeparators(const BTreePath &path, const BTreeNode *nodes,
+        const SIZE_T level, const KEY_T &key)
 {
+    const SIZE_T keysize=nodes[level].info.keysize;
+    KEY_T bound;
+    SIZE_T s;
+    SIZE_T j;
+    ERROR_T rc;
 
+    // the slot of each ancestor is one past the pointer we came down
+    for (j=level;j>0;j--) { 
+        s=path.slot[j-1]-1;
+        if (s>0) { 
+            rc=nodes[j-1].GetKey(s-1,bound);
+            if (rc) { return rc; }
+            if (memcmp(key.data,bound.data,keysize)<=0) { 
+                return ERROR_INSANE;
+            }
+            break;
+        }
+    }
+    for (j=level;j>0;j--) { 
+        s=path.slot[j-1]-1;
+        if (s<nodes[j-1].info.numkeys) { 
+            rc=nodes[j-1].GetKey(s,bound);
+            if (rc) { return rc; }
+            if (memcmp(key.data,bound.data,keysize)>0) { 
+                return ERROR_INSANE;
+            }
+            break;
+        }
+    }
     return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::NodesInOrder(const SIZE_T &node, SIZE_T &totalKeys) const 
+{
+    const SIZE_T keysize=superblock.info.keysize;
+    BTreePath path;
+    BTreeNode nodes[BTREE_MAX_HEIGHT];
     KEY_T key;
-    SIZE_T ptr;
     KEY_T prev;
+    KEY_T bound;
+    VALUE_T value;
+    int type;
+    int prevtype;
+    SIZE_T ptr=node;
+    SIZE_T nextleaf=0;
+    SIZE_T nextlink[BTREE_MAX_HEIGHT];
+    bool linked[BTREE_MAX_HEIGHT]={false};
+    SIZE_T leafdepth=0;
+    SIZE_T level;
     SIZE_T offset;
-    int first=1;
+    SIZE_T s;
+    SIZE_T j;
+    bool first=true;
     ERROR_T rc;
-    BTreeNode b;
-    totalKeys = 0;
 
-    rc= b.Unserialize(buffercache,node);
-    if(rc) {
-        return rc;
-    }
-    switch(b.info.nodetype){
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            if ((int)(b.info.GetNumSlotsAsInterior()*(2./3.)) <= b.info.numkeys) {
-                // Node is too big
+    totalKeys = 0;
+    while (1) { 
+        level=path.depth;
+        rc=path.Push(ptr,0);
+        if (rc) { return rc; }
+        BTreeNode &b=nodes[level];
+        rc= b.Unserialize(buffercache,ptr);
+        if(rc) {
+            return rc;
+        }
+        if (b.info.numkeys > b.GetNumSlots()) { 
+            // Node is too big
+            return ERROR_INSANE;
+        }
+        for (offset=1;offset<b.info.numkeys;offset++) { 
+            rc=b.GetKey(offset-1,prev);
+            if (rc) { return rc; }
+            rc=b.GetKey(offset,key);
+            if (rc) { return rc; }
+            if (memcmp(prev.data,key.data,keysize)>=0) { 
+                //This value is not more than the one before it. Uh oh.
                 return ERROR_INSANE;
             }
-            if (b.info.numkeys>0) { 
-                for (offset=0;offset<=b.info.numkeys;offset++) {
+        }
+        if (b.info.numkeys>0) { 
+            rc=b.GetKey(0,key);
+            if (rc) { return rc; }
+            rc=WithinSeparators(path,nodes,level,key);
+            if (rc) { return rc; }
+            rc=b.GetKey(b.info.numkeys-1,key);
+            if (rc) { return rc; }
+            rc=WithinSeparators(path,nodes,level,key);
+            if (rc) { return rc; }
+        }
 
-                    // Recurse down to check the next nodes
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    rc=NodesInOrder(ptr,totalKeys);
-                    if (rc) { return rc; }
+        if (b.GetNumMessages()>b.GetMaxMessages()) { 
+            return ERROR_INSANE;
+        }
+        for (offset=0;offset<b.GetNumMessages();offset++) { 
+            rc=b.GetMessage(offset,type,key,value);
+            if (rc) { return rc; }
+            if (offset>0) { 
+                rc=b.GetMessage(offset-1,prevtype,prev,value);
+                if (rc) { return rc; }
+                if (memcmp(prev.data,key.data,keysize)>=0) { 
+                    return ERROR_INSANE;
                 }
             }
-            return ERROR_NOERROR;
-            break;
-        case BTREE_LEAF_NODE:
-            if ((int)(b.info.GetNumSlotsAsLeaf()*(2./3.)) <= b.info.numkeys){
-                // Node is too big
+            rc=WithinSeparators(path,nodes,level,key);
+            if (rc) { return rc; }
+            // what the message will do to the count of keys
+            if (type==BTREE_MESSAGE_INSERT) { 
+                totalKeys++;
+            } else if (type==BTREE_MESSAGE_DELETE) { 
+                totalKeys--;
+            } else if (type!=BTREE_MESSAGE_UPDATE) { 
                 return ERROR_INSANE;
             }
-            if (b.info.numkeys>0) { 
-                // keep track of the total number of keys
-                totalKeys += b.info.numkeys;
-                for (offset=0;offset<=b.info.numkeys;offset++) { 
-                    rc=b.GetKey(offset,key);
-                    if ( rc ) { return rc; } 
-                    if(first==1){
-                        prev = key;
-                        first = 0;
-                    } else {
-                        if(prev<key || prev==key){
-                            prev=key;
-                        }else{
-                            //This value is less than the one before it. Uh oh.
-                            return ERROR_INSANE;
-                        }
-                    }
+        }
+
+        if (latchmode==BTREE_LATCH_BLINK) { 
+            if (b.info.numkeys>=b.GetNumSlots() || (linked[level] && nextlink[level]!=ptr)) { 
+                return ERROR_INSANE;
+            }
+            rc=b.GetRightLink(nextlink[level]);
+            if (rc) { return rc; }
+            linked[level]=true;
+            for (j=level;j>0;j--) { 
+                s=path.slot[j-1]-1;
+                if (s<nodes[j-1].info.numkeys) { 
+                    break;
                 }
             }
-            return ERROR_NOERROR;
-            break;
-        default:
-            // should never get here
-            return ERROR_NOERROR;
+            if (j==0) { 
+                // the last node at its depth
+                if (nextlink[level]!=0) { 
+                    return ERROR_INSANE;
+                }
+            } else {
+                rc=b.GetHighKey(key);
+                if (rc) { return rc; }
+                rc=nodes[j-1].GetKey(s,bound);
+                if (rc) { return rc; }
+                if (nextlink[level]==0 || memcmp(key.data,bound.data,keysize)!=0) { 
+                    return ERROR_INSANE;
+                }
+            }
+        }
+
+        switch(b.info.nodetype){
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                if (b.info.numkeys==0 && level==0) { 
+                    // an empty tree
+                    return ERROR_NOERROR;
+                }
+                break;
+            case BTREE_LEAF_NODE:
+                if (level==0) { 
+                    return ERROR_INSANE;
+                }
+                if (first) { 
+                    leafdepth=level;
+                    first=false;
+                } else if (level!=leafdepth ||
+                           (ptr!=nextleaf && writemode!=BTREE_WRITE_COPY)) { 
+                    return ERROR_INSANE;
+                }
+                rc=b.GetPtr(0,nextleaf);
+                if (rc) { return rc; }
+                // keep track of the total number of keys
+                totalKeys += b.info.numkeys-b.GetNumTombstones();
+                path.depth--;
+                break;
+            default:
+                // should never get here
+                return ERROR_INSANE;
+        }
+
+        // back up to the nearest node with pointers left to go down
+        while (path.depth>0) { 
+            level=path.depth-1;
+            if (path.slot[level]<=nodes[level].info.numkeys) { 
+                break;
+            }
+            path.depth--;
+        }
+        if (path.depth==0) { 
+            // the last leaf ends the chain
+            return nextleaf==0 || writemode==BTREE_WRITE_COPY ? ERROR_NOERROR : ERROR_INSANE;
+        }
+        rc=nodes[level].GetPtr(path.slot[level],ptr);
+        if (rc) { return rc; }
+        path.slot[level]++;
     }
 }
 
@@ -983,3 +4881,190 @@ ostream & BTreeIndex::Print(ostream &os) const
     Display(os, BTREE_SORTED_KEYVAL);
     return os;
 }
+
+
+BTreeCursor::BTreeCursor(BTreeIndex *i) :
+    index(i), offset(0), valid(false)
+{
+}
+
+// Start reading the leaf after this one, which is where a scan goes next
+void BTreeCursor::ReadAhead()
+{
+    SIZE_T next;
+
+    // copy on write does not keep the leaf chain
+    if (index->writemode!=BTREE_WRITE_COPY && leaf.GetPtr(0,next)==ERROR_NOERROR && next) { 
+        // ERROR_NOFETCH just means the cache had no clean block to spare
+        index->buffercache->PrefetchBlock(next);
+    }
+}
+
+// The leaf to the right, along the leaf chain.  Copy on write does not
+// keep the chain, so there the path is backed up instead.
+ERROR_T BTreeCursor::NextLeaf()
+{
+    SIZE_T next;
+    ERROR_T rc;
+
+    if (index->writemode==BTREE_WRITE_COPY) { 
+        return index->StepLeaf(path,leaf,true);
+    }
+    rc=leaf.GetPtr(0,next);
+    if (rc) { return rc; }
+    if (!next) { 
+        return ERROR_NONEXISTENT;
+    }
+    // the path no longer leads here; Prev finds it again if it needs it
+    path.depth=0;
+    return index->ReadNode(next,leaf);
+}
+
+// Move forward through the leaves until offset names a key that is not
+// a tombstone
+ERROR_T BTreeCursor::SkipEmpty()
+{
+    ERROR_T rc;
+
+    while (offset<leaf.info.numkeys && leaf.IsTombstone(offset)) { 
+        offset++;
+    }
+    while (offset>=leaf.info.numkeys) { 
+        rc=NextLeaf();
+        if (rc) { 
+            valid=false;
+            return rc;
+        }
+        if (leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+            valid=false;
+            return ERROR_INSANE;
+        }
+        offset=0;
+        ReadAhead();
+        while (offset<leaf.info.numkeys && leaf.IsTombstone(offset)) { 
+            offset++;
+        }
+    }
+    valid=true;
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCursor::Seek(const KEY_T &key)
+{
+    ERROR_T rc;
+
+    if (index->superblock.info.bufferratio) { 
+        rc=index->FlushMessages();
+        if (rc) { 
+            valid=false;
+            return rc;
+        }
+    }
+    return SeekLeaf(key);
+}
+
+ERROR_T BTreeCursor::SeekLeaf(const KEY_T &key)
+{
+    ERROR_T rc;
+
+    valid=false;
+
+    // ERROR_NONEXISTENT for an empty tree
+    rc=index->FindLeaf(&key,path,leaf);
+    if (rc) { return rc; }
+    offset=path.slot[path.depth-1];
+    ReadAhead();
+    return SkipEmpty();
+}
+
+// The leaf FindLeaf finds holds key, if it is there, at the slot it
+// finds; otherwise the last key before it is the one Prev finds
+ERROR_T BTreeCursor::SeekBack(const KEY_T &key)
+{
+    ERROR_T rc;
+
+    valid=false;
+    if (index->superblock.info.bufferratio) { 
+        rc=index->FlushMessages();
+        if (rc) { return rc; }
+    }
+
+    // ERROR_NONEXISTENT for an empty tree
+    rc=index->FindLeaf(&key,path,leaf);
+    if (rc) { return rc; }
+    offset=path.slot[path.depth-1];
+    valid=true;
+    if (offset<leaf.info.numkeys && index->nodeops.matchkey(leaf,offset,key) &&
+        !leaf.IsTombstone(offset)) { 
+        return ERROR_NOERROR;
+    }
+    return Prev();
+}
+
+ERROR_T BTreeCursor::Next()
+{
+    if (!valid) { 
+        return ERROR_NONEXISTENT;
+    }
+    offset++;
+    return SkipEmpty();
+}
+
+// There is no left link, so this backs up the path to the leaf to the
+// left, skipping any empty leaves
+ERROR_T BTreeCursor::Prev()
+{
+    ERROR_T rc;
+
+    if (!valid) { 
+        return ERROR_NONEXISTENT;
+    }
+    while (1) { 
+        while (offset>0) { 
+            offset--;
+            if (!leaf.IsTombstone(offset)) { 
+                return ERROR_NOERROR;
+            }
+        }
+        if (!path.depth) { 
+            // Next came along the leaf chain, so find the way down to
+            // this leaf through one of its keys
+            BTreeNode scratch;
+            KEY_T key;
+            rc=leaf.GetKey(0,key);
+            if (!rc) { 
+                rc=index->FindLeaf(&key,path,scratch);
+            }
+            if (rc) { 
+                valid=false;
+                return rc;
+            }
+        }
+        rc=index->StepLeaf(path,leaf,false);
+        if (rc) { 
+            valid=false;
+            return rc;
+        }
+        if (leaf.info.nodetype!=BTREE_LEAF_NODE) { 
+            valid=false;
+            return ERROR_INSANE;
+        }
+        offset=leaf.info.numkeys;
+    }
+}
+
+ERROR_T BTreeCursor::GetKey(KEY_T &key) const
+{
+    if (!valid) { 
+        return ERROR_NONEXISTENT;
+    }
+    return leaf.GetKey(offset,key);
+}
+
+ERROR_T BTreeCursor::GetVal(VALUE_T &value) const
+{
+    if (!valid) { 
+        return ERROR_NONEXISTENT;
+    }
+    return leaf.GetVal(offset,value);
+}
@@ -3,6 +3,10 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
 
 #include "global.h"
 #include "block.h"
@@ -41,27 +45,374 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+enum BTreeDeleteMode {BTREE_DELETE_MERGE, BTREE_DELETE_TOMBSTONE};
+
+enum BTreeSplitMode {BTREE_SPLIT_MIDDLE, BTREE_SPLIT_REDISTRIBUTE};
+
+enum BTreeInsertMode {BTREE_INSERT_BOTTOMUP, BTREE_INSERT_TOPDOWN};
+
+enum BTreeLatchMode {BTREE_LATCH_NONE, BTREE_LATCH_CRABBING, BTREE_LATCH_OPTIMISTIC, BTREE_LATCH_BLINK};
+
+enum BTreeWriteMode {BTREE_WRITE_INPLACE, BTREE_WRITE_COPY};
+
+// Interior nodes BTreeIndex keeps decoded for descents
+#define BTREE_DECODED_NODES 64
+
+// Defaults for BTreeIndex::SetSplitPolicy
+#define BTREE_DEFAULT_SPLITFILL 0     // two thirds
+#define BTREE_DEFAULT_SPLITRATIO 50
+#define BTREE_DEFAULT_APPENDRATIO 90
+
+// What BTreeIndex::GetFillStats finds in the tree
+struct BTreeFillStats {
+  SIZE_T height;         // levels, counting the root and the leaves
+  SIZE_T interiornodes;  // including the root
+  SIZE_T leaves;
+  SIZE_T interiorkeys;
+  SIZE_T interiorslots;  // capacity of the interior nodes
+  SIZE_T leafkeys;       // not counting tombstones
+  SIZE_T tombstones;     // deleted keys still taking up leaf slots
+  SIZE_T leafslots;      // capacity of the leaves
+  SIZE_T messages;       // buffered in interior nodes, not yet in the leaves
+  SIZE_T messageslots;   // capacity of the buffers
+
+  ostream &Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const BTreeFillStats &s) { return s.Print(os); }
+
+// Supplies the pairs for BTreeIndex::BulkLoad, in increasing key order
+class BTreeLoadIterator {
+ public:
+  virtual ~BTreeLoadIterator() {}
+  // return ERROR_NONEXISTENT when there are no more pairs
+  virtual ERROR_T Next(KeyValuePair &pair) = 0;
+};
+
+// Called by BTreeIndex::Scan for each pair in range, in key order.
+// Return false to stop the scan.
+typedef bool (*BTreeScanFn)(const KEY_T &key, const VALUE_T &value, void *arg);
+
+// The way down the tree to a leaf: the block of each node, root first,
+// and the slot taken in it, which is the pointer followed out of an
+// interior node and the key's offset in the leaf.  Splits go back up
+// it, and cursors move along it.
+#define BTREE_MAX_HEIGHT 32
+
+struct BTreePath {
+  SIZE_T depth;
+  SIZE_T block[BTREE_MAX_HEIGHT];
+  SIZE_T slot[BTREE_MAX_HEIGHT];
+
+  BTreePath() : depth(0) {}
+
+  // return ERROR_INSANE if the tree is deeper than anything it could hold
+  ERROR_T Push(const SIZE_T b, const SIZE_T s)
+  {
+    if (depth>=BTREE_MAX_HEIGHT) { 
+      return ERROR_INSANE;
+    }
+    block[depth]=b;
+    slot[depth]=s;
+    depth++;
+    return ERROR_NOERROR;
+  }
+  SIZE_T Leaf() const { return block[depth-1]; }
+};
+
+// How the index searches and splits its nodes.  The runtime version
+// works from the sizes in the superblock; btree_fixed.h has versions
+// specialized at compile time for particular sizes.  The split
+// thresholds follow the split policy, so they are runtime values in
+// both (see SetupSplits).
+struct BTreeNodeOps {
+  SIZE_T  (*findkey)(const BTreeNode &node, const KEY_T &key); // as BTreeNode::FindKey
+  ERROR_T (*getptr)(const BTreeNode &node, const SIZE_T offset, SIZE_T &ptr); // as GetPtr, interior
+  bool    (*matchkey)(const BTreeNode &leaf, const SIZE_T offset, const KEY_T &key); // the key there is key
+  ERROR_T (*getval)(const BTreeNode &leaf, const SIZE_T offset, VALUE_T &value); // as GetVal
+  ERROR_T (*setval)(BTreeNode &leaf, const SIZE_T offset, const VALUE_T &value); // as SetVal
+  ERROR_T (*insertleaf)(BTreeNode &leaf, const SIZE_T offset,
+                        const KEY_T &key, const VALUE_T &value); // as InsertSlot, leaf
+  SIZE_T leafsplit;      // split a leaf once it holds this many keys
+  SIZE_T interiorsplit;  // split an interior node once it holds this many keys
+  bool   fixed;          // true if specialized
+};
+
+class BTreeSnapshot;
+
 class BTreeIndex {
+  friend class BTreeCursor;
+  friend class BTreeSnapshot;
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  BTreeNodeOps nodeops;
+  int          deletemode;
+  int          splitmode;
+  int          insertmode;
+  int          latchmode;
+  int          writemode;
+  pthread_mutex_t supermutex;  // for the superblock's free list, counts and root,
+                               // and the snapshots and retired blocks
+  // BTREE_LATCH_OPTIMISTIC: by block, the copy of each node lookups
+  // read, and its version, which is odd while a writer changes it.
+  // The superblock's version covers the root pointer.
+  SIZE_T       numframes;
+  atomic<BYTE_T *> *frames;
+  atomic<unsigned long long> *versions;
+  // The root readers without latches start from: all of the tree under
+  // it is in the cache.  Optimistic lookups and snapshots use it.
+  atomic<SIZE_T> publishedroot;
+  // BTREE_WRITE_COPY: the versions published so far, the version each
+  // open snapshot sees, and the blocks each version stopped using,
+  // oldest first, kept until no snapshot of an older version is open
+  SIZE_T       commits;
+  multiset<SIZE_T> snapshots;
+  vector<pair<SIZE_T, SIZE_T> > retired;
+  SIZE_T       compactevery;   // operations between compaction steps, 0 for none
+  SIZE_T       compactbudget;  // leaves per step
+  SIZE_T       compactops;     // operations since the last step
+  bool         compacting;     // false to start at the first leaf
+  KEY_T        compactkey;     // else the last key of the leaf done last
+  SIZE_T       appendrun;      // inserts in a row at the end of the last leaf
+  SIZE_T       rightleaf;      // the last leaf, as of the last insert there, or 0
+  SIZE_T       appendhits;     // inserts appended to it directly
+  SIZE_T       appendmisses;   // inserts that came down from the root
+  // The operation in progress on this thread.  With latching, many
+  // threads run operations at once, so each keeps its own.
+  static thread_local map<SIZE_T, Block> writeset; // nodes it changed
+  static thread_local vector<SIZE_T> freed;        // blocks it deallocated
+  static thread_local bool superdirty;             // true if it changed the superblock
+  static thread_local int counted;                // keys it added, less those it deleted
+  static thread_local vector<SIZE_T> latched;      // blocks it latched, top down
+  static thread_local bool rootchanged;            // true if it moved the root
+  static thread_local SIZE_T restarts;             // optimistic lookups restarted
+  static thread_local set<SIZE_T> visited;         // interior nodes it read (BTREE_WRITE_COPY)
+  static thread_local set<SIZE_T> allocated;       // blocks it allocated (BTREE_WRITE_COPY)
+  SIZE_T       bufferedmessages; // messages the operations added to the root's buffer
+  SIZE_T       appliedmessages;  // messages that got down to the leaves
+  SIZE_T       leafbatches;      // batches of them, each for one leaf
+  SIZE_T       nodewrites;     // blocks written by operations
+  SIZE_T       writeops;       // operations that wrote any
+
+  struct DecodedNode { 
+    BTreeNode node;
+    SIZE_T    lastused;
+
+    DecodedNode(const BTreeNode &n, const SIZE_T t) : node(n), lastused(t) {}
+  };
+  map<SIZE_T, DecodedNode> decoded; // read-only interior nodes, by block
+  SIZE_T       decodedclock;   // for lastused
+  SIZE_T       decodedhits;
+  SIZE_T       decodedmisses;
+
+  void         SetupNodeOps();
+  void         SetupSplits();
+  bool         Appending() const;
+  bool         FullForInsert(const BTreeNode &b) const;
+  bool         IsSafe(const BTreeNode &b, const BTreeOp op, const bool root) const;
+  void         CountOp();
+  void         CountKeys(const int n);
+  void         SetupFrames();
+  void         FreeFrames();
+  unsigned long long StableVersion(const SIZE_T block) const;
+  void         LockVersion(const SIZE_T block);
+  void         UnlockVersion(const SIZE_T block);
+  ERROR_T      LoadFrame(const SIZE_T block);
+  void         PublishNode(const SIZE_T block, const Block &b);
+  ERROR_T      LinkLevels();
+  ERROR_T      FreeBlock(const SIZE_T block);
+  ERROR_T      BulkLoadNodes(BTreeLoadIterator &input, const double fillfactor,
+                             vector<SIZE_T> &taken, SIZE_T &numkeys);
+  ERROR_T      UndoBulkLoad(vector<SIZE_T> &taken, const SIZE_T freerun);
+  ERROR_T      CopyOnWrite(vector<SIZE_T> &retiring);
+  ERROR_T      AbandonWrites(const ERROR_T oprc);
+  ERROR_T      ReclaimBlocks(SIZE_T &n);
+  ERROR_T      ApplyMessage(const int type, const KEY_T &key, const VALUE_T &value);
+  ERROR_T      FlushAllBuffers(const SIZE_T node, SIZE_T &flushed);
 
  protected:
+  // Install specialized node operations for an index of the given
+  // shape, returning ERROR_SIZE if the attached index is not that shape
+  ERROR_T      SetNodeOps(const SIZE_T keysize,
+			  const SIZE_T valuesize,
+			  const SIZE_T blocksize,
+			  const int nodeformat,
+			  const BTreeNodeOps &ops);
+  // Go back to the runtime-sized node operations, as for a shape with
+  // no specialization, eg, to compare the two
+  void         UseRuntimeNodeOps();
+
+  // An operation reads and changes nodes through its write set, and
+  // each node it changed is written to the cache once, when FlushNodes
+  // finishes the operation.  FlushNodes returns oprc, or if that is
+  // zero, any error writing the nodes.
+  ERROR_T      ReadNode(const SIZE_T block, BTreeNode &node) const;
+  ERROR_T      WriteNode(const SIZE_T block, const BTreeNode &node);
+  ERROR_T      FlushNodes(const ERROR_T oprc=ERROR_NOERROR);
+
+  // For descents: points node at a decoded copy of the block if it is
+  // an interior node, which stays valid until the next call and must
+  // not be changed, or else reads it into scratch and points node
+  // there.  A leaf always ends up in scratch.
+  ERROR_T      ReadDecoded(const SIZE_T block,
+			   BTreeNode &scratch,
+			   const BTreeNode *&node);
 
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op, 
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op, 
 				      const KEY_T &key,
 				      VALUE_T &val);
+
+  // Descends to the leaf key belongs in, or the first leaf if key is
+  // 0, recording the way in path
+  // return ERROR_NONEXISTENT if the tree is empty
+  ERROR_T      FindLeaf(const KEY_T *key, BTreePath &path, BTreeNode &leaf);
+
+  // FindLeaf with latch crabbing, for op; the latches it keeps are
+  // left for ReleaseLatches
+  ERROR_T      FindLeafLatched(const KEY_T &key,
+				const BTreeOp op,
+				BTreePath &path,
+				BTreeNode &leaf);
+
+  // FindLeaf for a lookup with BTREE_LATCH_OPTIMISTIC; it takes no
+  // latches, and leaf is a copy that was current when it was read
+  ERROR_T      FindLeafOptimistic(const KEY_T &key,
+				   BTreePath &path,
+				   BTreeNode &leaf);
+
+  // FindLeaf with BTREE_LATCH_BLINK.  It holds one latch at a time,
+  // moving right past nodes that split since their parent was read,
+  // and keeps the leaf's, exclusive unless op is a lookup
+  ERROR_T      FindLeafLinked(const KEY_T &key,
+			       const BTreeOp op,
+			       BTreePath &path,
+			       BTreeNode &leaf);
+
+  // Follows right links from node, latched, while key is past its high
+  // key, trading each latch for the next
+  ERROR_T      MoveRight(const KEY_T &key,
+			  SIZE_T &node,
+			  BTreeNode &b,
+			  const bool exclusive);
+
+  // Latch a block for the operation in progress, and let go of all but
+  // the last keep latches it took
+  ERROR_T      Latch(const SIZE_T block, const bool exclusive);
+  void         ReleaseLatches(const SIZE_T keep=0);
+
+  // Moves path and leaf on to the next leaf (or the one before),
+  // through their nearest common ancestor
+  // return ERROR_NONEXISTENT if there is none
+  ERROR_T      StepLeaf(BTreePath &path, BTreeNode &leaf, const bool forward);
+
+  // FindLeaf and StepLeaf (forward) for a snapshot: from root, and
+  // straight from the buffer cache, as the writer may be busy
+  ERROR_T      FindLeafAt(const SIZE_T root,
+			   const KEY_T *key,
+			   BTreePath &path,
+			   BTreeNode &leaf) const;
+  ERROR_T      StepLeafAt(BTreePath &path, BTreeNode &leaf) const;
   
 
+  ERROR_T      InsertBatchRecursion(const SIZE_T node,
+				       const vector<KeyValuePair> &pairs,
+				       const SIZE_T first,
+				       const SIZE_T last,
+				       vector<ERROR_T> &statuses,
+				       SIZE_T &inserted,
+				       vector<KEY_T> &newkeys,
+				       vector<SIZE_T> &newnodes);
+
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value);
+
+  // Inserts into leaf, at the end of path, and splits back up the path
+  ERROR_T      InsertIntoLeaf(BTreePath &path,
+			       BTreeNode &leaf,
+			       const KEY_T &key,
+			       const VALUE_T &value);
+
+  ERROR_T      InsertLinked(const KEY_T &key, const VALUE_T &value);
+
+  ERROR_T      InsertBatchInternal(vector<KeyValuePair> &pairs, vector<ERROR_T> &statuses);
+
+  // Lookup through the message buffers: the first message for key on
+  // the way down decides, and the leaf only if there is none
+  ERROR_T      LookupBuffered(const KEY_T &key, VALUE_T &value);
+
+  // Insert, Update or Delete (a BTREE_MESSAGE_* type) with message
+  // buffers: checks that the key is there, or not, then adds the
+  // message to the root's buffer, flushing to make room if it must
+  ERROR_T      BufferMessage(const int type, const KEY_T &key, const VALUE_T &value);
+
+  // Moves the messages in node's buffer for the child with the most of
+  // them down a level, or as many as fit in its buffer, making room
+  // there first if there is none
+  ERROR_T      FlushBuffer(const SIZE_T node);
+
+  // The messages under node for keys in [lo,hi] (either may be 0 for
+  // no bound), the highest one for each key
+  ERROR_T      CollectMessages(const SIZE_T node,
+				const KEY_T *lo,
+				const KEY_T *hi,
+				map<KEY_T, pair<int, VALUE_T> > &messages) const;
+
+  ERROR_T      CompactInternal(const SIZE_T budget);
+
+  ERROR_T      InsertFirst(const KEY_T &key, const VALUE_T &value);
+
+  // Splits b, keeping ratio percent of its keys, and writes both
+  // halves; newkey separates them and newnode is the right one
+  ERROR_T      SplitNode(const SIZE_T node,
+			    BTreeNode &b,
+			    const SIZE_T ratio,
+			    KEY_T &newkey,
+			    SIZE_T &newnode);
+
+  ERROR_T      GrowRoot(const KEY_T &key, const SIZE_T newnode);
+
+  ERROR_T      InsertTopDown(const KEY_T &key, const VALUE_T &value);
+
+  ERROR_T      AppendToRightLeaf(const KEY_T &key,
+				    const VALUE_T &value,
+				    bool &appended);
+
+  ERROR_T      RedistributeLeaf(BTreeNode &parent,
+				   SIZE_T &offset,
+				   KEY_T &newkey,
+				   SIZE_T &newnode);
+
+  ERROR_T      DeleteRecursion(const SIZE_T node,
+				  const KEY_T &key,
+				  const bool purge,
+				  bool &underflow);
+
+  ERROR_T      FixUnderflow(BTreeNode &parent,
+			       const SIZE_T parentnode,
+			       const SIZE_T child);
+
+  ERROR_T      WriteInteriorNodes(const SIZE_T node,
+				     const BTreeNode &proto,
+				     const vector<KEY_T> &keys,
+				     const vector<SIZE_T> &ptrs,
+				     vector<KEY_T> &newkeys,
+				     vector<SIZE_T> &newnodes);
+
+  ERROR_T      FillStatsInternal(const SIZE_T node,
+				    const SIZE_T depth,
+				    BTreeFillStats &stats) const;
+
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
+
+  // BTREE_SORTED_KEYVAL with the buffered messages applied
+  ERROR_T      DisplayMerged(ostream &o) const;
 public:
   //
   // keysize and valueszie should be stored in the 
@@ -73,10 +424,14 @@ public:
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is 
   // invoked
-  BTreeIndex(SIZE_T keysize, 
+  // nodeformat (BTREE_FORMAT_*) and keytype (BTREE_KEY_*) are treated
+  // the same way
+  BTreeIndex(SIZE_T keysize,
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,    // true if a  key maps to a single value
+	     int nodeformat=BTREE_FORMAT_ROW,
+	     int keytype=BTREE_KEY_BYTES);
 
 
   BTreeIndex();
@@ -93,46 +448,266 @@ public:
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
+  // return ERROR_SIZE, before anything is written, if create=true and
+  // a BTREE_KEY_INT key is not 4 or 8 bytes
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
+  // return ERROR_NONEXISTENT, and write nothing, if the index was never
+  // attached
   ERROR_T Detach(SIZE_T &initblock);
   
+  // Builds a key from its text form: the bytes themselves, or a
+  // decimal integer for a BTREE_KEY_INT index
+  // return ERROR_SIZE if the text is not a key of this index
+  ERROR_T MakeKey(const char *text, KEY_T &key) const;
+
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
 
-  // return zero on on success
-  // return ERROR_NOSPACE if you run out of disk space 
-  //ERROR_T InsertRecursion(const BTreeNode &node, const KEY_T &key, const VALUE_T &value, KEY_T *newkey, BTreeNode *newnode);  
-  ERROR_T InsertRecursion(const SIZE_T&, const KEY_T&, const VALUE_T&, KEY_T&, SIZE_T&);
+  // An insert of a key after every key in the index goes straight to
+  // the last leaf, without coming down from the root, unless the leaf
+  // has to split.  These count the inserts that did and did not.
+  SIZE_T GetNumAppendHits() const { return appendhits; }
+  SIZE_T GetNumAppendMisses() const { return appendmisses; }
+
+  // Blocks written by the operations that changed the index, each node
+  // at most once per operation, and the number of those operations
+  SIZE_T GetNumNodeWrites() const { return nodewrites; }
+  SIZE_T GetNumWriteOps() const { return writeops; }
+
+  // Descents find interior nodes already decoded (hits) or read them
+  // from the buffer cache (misses); changing a node drops its copy
+  SIZE_T GetNumDecodedHits() const { return decodedhits; }
+  SIZE_T GetNumDecodedMisses() const { return decodedmisses; }
+
+  // BTREE_SPLIT_MIDDLE, the default, splits a leaf in half once it is
+  // two thirds full.  BTREE_SPLIT_REDISTRIBUTE lets leaves fill up, and
+  // moves keys from a full leaf to a neighbour with room, splitting two
+  // full neighbours into three only when there is none.  This packs
+  // the leaves more tightly at the cost of reading the neighbours.
+  void SetSplitMode(const int mode);
+  int  GetSplitMode() const { return splitmode; }
+
+  // BTREE_INSERT_BOTTOMUP, the default, inserts into the leaf and then
+  // splits back up the path as far as it must.  BTREE_INSERT_TOPDOWN
+  // splits every node on the way down that is one key short of its
+  // split threshold, so the insert ends at the leaf, holding no more
+  // than a node and its parent.  It splits some nodes early, and full
+  // leaves always split, whatever the split mode.
+  void SetInsertMode(const int mode) { insertmode=mode; }
+  int  GetInsertMode() const { return insertmode; }
+
+  // BTREE_LATCH_NONE, the default, is for one thread at a time.  With
+  // BTREE_LATCH_CRABBING, Lookup, Insert, Update and Delete may be
+  // called from many threads at once (and nothing else while they
+  // run).  Each latches the nodes it uses, in the buffer cache, and
+  // lets go of a node's parent once the node is safe: it will not
+  // split or underflow, so nothing above it will change.  The decoded
+  // nodes, appends to the last leaf, compaction and redistribution are
+  // per index, so they are off, and inserts are bottom up.
+  // BTREE_LATCH_OPTIMISTIC writes the same way, but lookups take no
+  // latches at all.  The index keeps a copy of every node it has read,
+  // and a version for it that writers bump.  A lookup reads a node's
+  // version, then the copy, and checks that neither it nor the
+  // parent's version changed, starting over from the root if one did.
+  // Once the nodes it needs have been read once, a lookup writes no
+  // memory any other thread reads.  BulkLoad, which writes its nodes
+  // around those copies, returns ERROR_BADCONFIG in this mode.
+  // BTREE_LATCH_BLINK makes the tree a Lehman-Yao B-link tree: each
+  // node also keeps its high key and a link to its right sibling,
+  // which costs it a slot.  A descent holds one latch at a time, and
+  // follows the right link of a node that has split since it read the
+  // parent.  A split is written out and its node let go before the
+  // new separator goes into the parent, so no insert holds more than
+  // one node.  Nodes never merge: deletes leave them short, or empty.
+  // BulkLoad and Compact, which build or merge nodes without the
+  // links, return ERROR_BADCONFIG in this mode.
+  // Switching to the mode links the tree, and fails with ERROR_NOSPACE
+  // if a node is full (a bulk load or redistribution can fill them).
+  // Set the mode after Attach, and only when no operations are
+  // running; any changes made in another mode need it set again.
+  // return ERROR_BADCONFIG for a latched mode if the index is copy on
+  //   write (see SetWriteMode)
+  ERROR_T SetLatchMode(const int mode);
+  int  GetLatchMode() const { return latchmode; }
+  // Optimistic lookups this thread has had to start over
+  static SIZE_T GetNumRestarts() { return restarts; }
+
+  // BTREE_WRITE_INPLACE, the default, writes each node back to its own
+  // block.  BTREE_WRITE_COPY never changes a node another version of
+  // the tree can see: when an operation finishes, each node it changed
+  // goes to a new block, and so does its parent, up to the root, and
+  // then the new root is published, all at once.  An operation that
+  // fails changes nothing.  Leaves are not chained in this mode, and
+  // appends to the last leaf are off.  Needs BTREE_LATCH_NONE.
+  // return ERROR_BADCONFIG if the index is latched
+  // return ERROR_CONFLICT when leaving the mode with snapshots open
+  ERROR_T SetWriteMode(const int mode);
+  int  GetWriteMode() const { return writemode; }
+
+  // With BTREE_WRITE_COPY, pins the tree as it is now: the snapshot
+  // can look up and scan it, from any thread, without latches and
+  // while operations go on, until EndSnapshot.  The blocks the tree
+  // stops using are freed once no snapshot that can see them is open,
+  // by the next operation that writes.
+  // return ERROR_BADCONFIG if the index is not copy on write
+  // return ERROR_CONFLICT if snapshot is already open
+  ERROR_T BeginSnapshot(BTreeSnapshot &snapshot);
+  // return ERROR_NONEXISTENT if snapshot is not open on this index
+  ERROR_T EndSnapshot(BTreeSnapshot &snapshot);
+  // Blocks waiting for the snapshots that can see them to end
+  SIZE_T GetNumRetiredBlocks() const { return retired.size(); }
+
+  // Nodes split once they hold fill percent of their slots (0, the
+  // default, is two thirds; leaves in BTREE_SPLIT_REDISTRIBUTE mode
+  // always fill up), keeping ratio percent of their keys in the left
+  // node.  When the inserts that filled the last leaf all went on its
+  // end, as they do for increasing keys, it and the nodes above it
+  // split at appendratio instead, so the left node stays nearly full;
+  // 100 moves only the newest key, and 0 turns this off.  The policy
+  // is kept in the superblock: set before Attach(initblock,true) for a
+  // new index, or any time after Attach to change it.
+  // return ERROR_SIZE if fill is over 100, ratio is not in [1,99],
+  //   or appendratio is over 100
+  ERROR_T SetSplitPolicy(const SIZE_T fill,
+			 const SIZE_T ratio=BTREE_DEFAULT_SPLITRATIO,
+			 const SIZE_T appendratio=BTREE_DEFAULT_APPENDRATIO);
+  void    GetSplitPolicy(SIZE_T &fill, SIZE_T &ratio, SIZE_T &appendratio) const;
+
+  // Makes the tree write optimized (a B-epsilon tree): each interior
+  // node keeps percent of its block as a buffer of messages, changes
+  // to keys under it that have not been made yet, so it has fewer
+  // slots and the tree is a little taller.  Insert, Update and Delete
+  // look the key up to see whether they can go ahead, then just add a
+  // message to the root's buffer.  A full buffer sends the messages
+  // for the child with the most of them down a level, into the child's
+  // buffer or, at the bottom, into the leaf, which is written once for
+  // the whole batch.  Lookups, scans and the sorted display take a
+  // key's first message on the way down over the leaf.  Interior nodes
+  // never merge, and leaves do not merge away the last key of their
+  // parent.  The buffers are part of the tree's layout, so this is set
+  // before Attach(initblock,true) and kept in the superblock; 0, the
+  // default, is a plain B-tree.  It needs BTREE_LATCH_NONE and
+  // BTREE_WRITE_INPLACE.
+  // return ERROR_CONFLICT once the index is attached
+  // return ERROR_BADCONFIG if the index is latched or copy on write
+  // return ERROR_SIZE if percent leaves an interior node under three
+  //   slots, or a buffer with room for fewer than two messages
+  ERROR_T SetMessageBuffers(const SIZE_T percent);
+  SIZE_T  GetMessageBuffers() const { return superblock.info.bufferratio; }
+
+  // Sends every buffered message down to its leaf
+  ERROR_T FlushMessages();
+
+  // Messages added to the root's buffer, the ones that have reached
+  // their leaves, and the leaf writes that took them there
+  SIZE_T GetNumBufferedMessages() const { return bufferedmessages; }
+  SIZE_T GetNumAppliedMessages() const { return appliedmessages; }
+  SIZE_T GetNumLeafBatches() const { return leafbatches; }
+
+  // Sorts pairs by key (pairs of the wrong size go last) and inserts
+  // them, reading and writing each node on the way at most once.
+  // statuses[i] is what Insert would have returned for pairs[i] (after
+  // sorting), inserting in order; of several pairs with the same key,
+  // the first one given is inserted.
+  // return zero if statuses is valid
+  // In a latched mode (see SetLatchMode), the pairs are inserted one
+  // at a time, as Insert would, in key order.
+  // return ERROR_NOSPACE if you run out of disk space, or another error
+  //   that leaves the batch partly applied
+  ERROR_T InsertBatch(vector<KeyValuePair> &pairs, vector<ERROR_T> &statuses);
+
+  // Builds the tree from sorted input, bottom up, into an empty index.
+  // Leaves are filled to fillfactor of their capacity (but always leave
+  // room for one more key) and written in runs of consecutive blocks.
+  // return zero on success
+  // return ERROR_CONFLICT if the index is not empty, or if the keys
+  //   are not strictly increasing
+  // return ERROR_SIZE if a key or value is the wrong size for this index,
+  //   or fillfactor is not in (0,1]
+  // return ERROR_NOSPACE if you run out of disk space
+  // return ERROR_BADCONFIG in BTREE_LATCH_BLINK or BTREE_LATCH_OPTIMISTIC
+  //   mode
+  // On an error the index is left empty, with the blocks the load took
+  // back on the free list.
+  ERROR_T BulkLoad(BTreeLoadIterator &input, const double fillfactor=1.0);
 
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
+  // Nodes left under half full borrow from or merge with a sibling,
+  // and the tree loses a level when the root is left with one child
+  // (but see SetDeleteMode)
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Delete(const KEY_T &key);
+
+  // BTREE_DELETE_MERGE, the default, removes keys as above.
+  // BTREE_DELETE_TOMBSTONE only marks the key deleted in its leaf, one
+  // write with no siblings involved, and leaves the rest to Compact.
+  // Nothing but the fill statistics can see a tombstone.  The mark is a
+  // byte per leaf slot, which only a tree made for tombstones has, so
+  // the mode is set before Attach(initblock,true) and kept in the
+  // superblock.  Such a tree may be switched to merging and back.
+  // return ERROR_CONFLICT for BTREE_DELETE_TOMBSTONE on an attached
+  //   index that was not made for it
+  // return ERROR_BADCONFIG for an unknown mode
+  ERROR_T SetDeleteMode(const int mode);
+  int  GetDeleteMode() const { return deletemode; }
+
+  // Purges the tombstones from up to budget leaves, merging any left
+  // under half full, starting after the leaf the last call did and
+  // going around again after the last leaf.  Meant for idle time.
+  // return zero on success
+  // return ERROR_BADCONFIG in BTREE_LATCH_BLINK mode
+  ERROR_T Compact(const SIZE_T budget);
+
+  // Calls Compact(budget) every everyops Insert, Update, Delete and
+  // Lookup calls; everyops=0 turns this off, which is the default
+  void SetCompaction(const SIZE_T everyops, const SIZE_T budget);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Looks up all of keys, a level of the tree at a time: every node the
+  // keys need on a level is prefetched, in block order and each only
+  // once, before any of them is used.  statuses[i] and values[i] are
+  // what Lookup would have given for keys[i].
+  // return zero if statuses is valid
+  ERROR_T LookupBatch(const vector<KEY_T> &keys,
+		      vector<VALUE_T> &values,
+		      vector<ERROR_T> &statuses);
+
+  // Calls fn(key,value,arg) for every key with lo <= key <= hi
+  // return zero on success, including when nothing is in range
+  // return ERROR_SIZE if lo or hi are the wrong size for this index
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanFn fn, void *arg);
+
+  // Writes a key in its text form, the inverse of MakeKey
+  ostream & PrintKey(ostream &os, const KEY_T &key) const;
  
 
+  // Counts the nodes, keys and tombstones in the tree
+  // return ERROR_NONEXISTENT if the index is not attached
+  ERROR_T GetFillStats(BTreeFillStats &stats) const;
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
   ERROR_T SanityCheck() const;
 
   // looks for nodes in order
-  // also keeps track of keys in leaves
+  // also counts the live keys in the leaves under node
   //
   ERROR_T NodesInOrder(const SIZE_T&, SIZE_T&) const;
 
@@ -148,6 +723,9 @@ public:
   // sorted in order of keys.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
   
+  // true if searches and splits use compile-time specialized code
+  bool IsSpecialized() const { return nodeops.fixed; }
+
   ostream & Print(ostream &os) const;
   
 };
@@ -155,4 +733,82 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+//
+// A position in the leaf level of an index.  The cursor keeps the path
+// Seek came down, and Next and Prev move to the leaf either side
+// through the nearest node they share, which is usually the parent and
+// already decoded.  Next reads the leaf ahead on the leaf chain into
+// the buffer cache.
+//
+// The cursor holds a copy of its leaf and path: any Insert, Update or Delete on
+// the index invalidates it, and it must be Seek'd again.  The leaves of
+// an index with message buffers are not the whole story, so there Seek
+// first flushes every message down to them.
+//
+class BTreeCursor {
+  friend class BTreeIndex;
+ private:
+  BTreeIndex *index;
+  BTreePath   path;    // to leaf, or empty once Next has followed the leaf chain
+  BTreeNode   leaf;
+  SIZE_T      offset;
+  bool        valid;
+
+  void        ReadAhead();
+  ERROR_T     NextLeaf();
+  ERROR_T     SkipEmpty();
+  // Seek in the leaves alone, leaving any messages where they are
+  ERROR_T     SeekLeaf(const KEY_T &key);
+
+ public:
+  BTreeCursor(BTreeIndex *index);
+
+  // Position at the first key >= key
+  // return ERROR_NONEXISTENT if there is none
+  ERROR_T Seek(const KEY_T &key);
+  // Position at the last key <= key
+  // return ERROR_NONEXISTENT if there is none
+  ERROR_T SeekBack(const KEY_T &key);
+
+  // Move to the next or previous key
+  // return ERROR_NONEXISTENT if there is none; the cursor is then invalid
+  ERROR_T Next();
+  ERROR_T Prev();
+
+  bool    IsValid() const { return valid; }
+
+  // return ERROR_NONEXISTENT if the cursor is invalid
+  ERROR_T GetKey(KEY_T &key) const;
+  ERROR_T GetVal(VALUE_T &value) const;
+};
+
+
+//
+// The tree as it was when BTreeIndex::BeginSnapshot opened the
+// snapshot.  Copy on write leaves every node of that version where it
+// was until EndSnapshot, so reading it takes no latches, and any number
+// of threads may read it while another changes the index.  The index
+// must stay attached, in BTREE_WRITE_COPY, while the snapshot is open.
+//
+class BTreeSnapshot {
+  friend class BTreeIndex;
+ private:
+  const BTreeIndex *index;   // 0 unless open
+  SIZE_T      root;
+  SIZE_T      version;
+
+ public:
+  BTreeSnapshot() : index(0), root(0), version(0) {}
+
+  bool    IsOpen() const { return index!=0; }
+
+  // As BTreeIndex::Lookup, Scan and Display, on this version
+  // return ERROR_NONEXISTENT if the snapshot is not open, or for
+  //   Lookup, if the key doesn't exist
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value) const;
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanFn fn, void *arg) const;
+  ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+};
+
 #endif
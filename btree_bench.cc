@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <vector>
+#include "btree.h"
+#include "btree_fixed.h"
+
+//
+// Micro-benchmarks for the in-memory parts of the btree.  These do
+// not touch a disk or a buffer cache, so they measure CPU time only;
+// the whole-index one in "fixed" uses a scratch disk that fits in the
+// cache, so it does not go to the disk once loaded.
+//
+
+void usage()
+{
+  cerr << "usage: btree_bench layout keysize valuesize blocksize iterations\n";
+  cerr << "       btree_bench prefix valuesize blocksize iterations\n";
+  cerr << "       btree_bench fixed keysize valuesize blocksize iterations\n";
+}
+
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+static const char keybytes[]="abcdefghijklmnopqrstuvwxyz0123456789";
+
+// With shared, the first four bytes are those every small positive
+// 8 byte INT key starts with, so all the keys tie on their prefixes
+static void RandomKey(KEY_T &k, const SIZE_T keysize, const bool shared=false)
+{
+  k.Resize(keysize,false);
+  for (SIZE_T i=0;i<keysize;i++) {
+    k.data[i]=keybytes[rand()%(sizeof(keybytes)-1)];
+  }
+  if (shared && keysize>sizeof(PREFIX_T)) {
+    memset(k.data,0,sizeof(PREFIX_T));
+    k.data[0]=0x80;
+  }
+}
+
+
+// Fill a node to the split threshold with random distinct keys
+static ERROR_T FillNode(BTreeNode &node, vector<KEY_T> &keys, const bool shared)
+{
+  KEY_T key;
+  VALUE_T value(node.info.valuesize);
+  SIZE_T target=(SIZE_T)(node.GetNumSlots()*(2./3.));
+  ERROR_T rc;
+
+  memset(value.data,'v',value.length);
+
+  while (node.info.numkeys<target) {
+    RandomKey(key,node.info.keysize,shared);
+    SIZE_T offset=node.FindKey(key);
+    if (offset<node.info.numkeys &&
+	memcmp(node.ResolveKey(offset),key.data,node.info.keysize)==0) {
+      continue;
+    }
+    if (node.info.nodetype==BTREE_LEAF_NODE) {
+      rc=node.InsertSlot(offset,key,value);
+    } else {
+      rc=node.InsertSlot(offset,key,(SIZE_T)node.info.numkeys+1);
+    }
+    if (rc) { return rc; }
+    keys.push_back(key);
+  }
+  return ERROR_NOERROR;
+}
+
+
+static SIZE_T NodeFindKey(const BTreeNode &node, const KEY_T &key)
+{
+  return node.FindKey(key);
+}
+
+
+// Time a search function over a mix of present and absent keys
+static ERROR_T BenchSearch(const int nodetype, const int nodeformat,
+			   const SIZE_T keysize, const SIZE_T valuesize,
+			   const SIZE_T blocksize, const SIZE_T iterations,
+			   SIZE_T (*findkey)(const BTreeNode &, const KEY_T &)=NodeFindKey,
+			   const char *label="",
+			   const bool shared=false)
+{
+  BTreeNode node(nodetype,keysize,valuesize,blocksize,nodeformat);
+  vector<KEY_T> keys;
+  vector<KEY_T> probes;
+  ERROR_T rc;
+
+  srand(42);
+
+  rc=FillNode(node,keys,shared);
+  if (rc) { return rc; }
+
+  for (SIZE_T i=0;i<1024;i++) {
+    if (i%2) {
+      probes.push_back(keys[rand()%keys.size()]);
+    } else {
+      KEY_T k;
+      RandomKey(k,keysize,shared);
+      probes.push_back(k);
+    }
+  }
+
+  SIZE_T sum=0;
+  double start=now();
+  for (SIZE_T i=0;i<iterations;i++) {
+    sum+=findkey(node,probes[i%probes.size()]);
+  }
+  double elapsed=now()-start;
+
+  cout << (nodetype==BTREE_LEAF_NODE ? "leaf     " : "interior ")
+       << (nodeformat==BTREE_FORMAT_COLUMN ? "column " : 
+	   nodeformat==BTREE_FORMAT_PREFIX ? "prefix " : "row    ");
+  if (nodeformat==BTREE_FORMAT_PREFIX) { 
+    cout << PrefixSearchName(GetPrefixSearch()) << " ";
+  }
+  cout << label << "keysize="<<keysize
+       << " keys="<<node.info.numkeys
+       << " ns/search="<<(elapsed*1e9/iterations)
+       << " (checksum "<<sum<<")"<<endl;
+
+  return ERROR_NOERROR;
+}
+
+
+static int BenchLayout(int argc, char **argv)
+{
+  if (argc!=6) {
+    usage();
+    return -1;
+  }
+
+  SIZE_T keysize=atoi(argv[2]);
+  SIZE_T valuesize=atoi(argv[3]);
+  SIZE_T blocksize=atoi(argv[4]);
+  SIZE_T iterations=atoi(argv[5]);
+  ERROR_T rc;
+
+  int types[]={BTREE_LEAF_NODE, BTREE_INTERIOR_NODE};
+  int formats[]={BTREE_FORMAT_ROW, BTREE_FORMAT_COLUMN};
+
+  for (int t=0;t<2;t++) {
+    for (int f=0;f<2;f++) {
+      if ((rc=BenchSearch(types[t],formats[f],keysize,valuesize,blocksize,iterations))) {
+	cerr << "Benchmark failed due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Key sizes to try; sim's INIT takes any size, these are the usual ones
+static const SIZE_T prefix_keysizes[]={4, 8, 16, 32, 64};
+
+static int BenchPrefix(int argc, char **argv)
+{
+  if (argc!=5) {
+    usage();
+    return -1;
+  }
+
+  SIZE_T valuesize=atoi(argv[2]);
+  SIZE_T blocksize=atoi(argv[3]);
+  SIZE_T iterations=atoi(argv[4]);
+  ERROR_T rc;
+
+  int impls[]={PREFIX_SEARCH_SCALAR, PREFIX_SEARCH_SSE2, PREFIX_SEARCH_AVX2};
+
+  for (SIZE_T k=0;k<sizeof(prefix_keysizes)/sizeof(prefix_keysizes[0]);k++) {
+    // keys longer than a prefix are also tried with one prefix for all
+    for (int shared=0;shared<(prefix_keysizes[k]>sizeof(PREFIX_T) ? 2 : 1);shared++) {
+      const char *label = shared ? "shared " : "";
+      // baseline: binary search on the full keys
+      if ((rc=BenchSearch(BTREE_LEAF_NODE,BTREE_FORMAT_COLUMN,prefix_keysizes[k],valuesize,blocksize,iterations,NodeFindKey,label,shared))) {
+	cerr << "Benchmark failed due to error "<<rc<<endl;
+	return -1;
+      }
+      for (int i=0;i<3;i++) {
+	if (SetPrefixSearch(impls[i])) {
+	  cout << "(" << PrefixSearchName(impls[i]) << " is not supported here)"<<endl;
+	  continue;
+	}
+	if ((rc=BenchSearch(BTREE_LEAF_NODE,BTREE_FORMAT_PREFIX,prefix_keysizes[k],valuesize,blocksize,iterations,NodeFindKey,label,shared))) {
+	  cerr << "Benchmark failed due to error "<<rc<<endl;
+	  return -1;
+	}
+      }
+      SetPrefixSearch(PREFIX_SEARCH_AUTO);
+    }
+  }
+  return 0;
+}
+
+
+// A BTreeIndex that keeps to the runtime-sized code, as the baseline
+class RuntimeIndex : public BTreeIndex {
+ public:
+  RuntimeIndex(const SIZE_T keysize, const SIZE_T valuesize, BufferCache *cache) :
+    BTreeIndex(keysize,valuesize,cache) {}
+
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false)
+  {
+    ERROR_T rc=BTreeIndex::Attach(initblock,create);
+    if (rc) { return rc; }
+    UseRuntimeNodeOps();
+    return ERROR_NOERROR;
+  }
+};
+
+
+#define BENCH_INDEX_BLOCKS 4096
+#define BENCH_INDEX_KEYS   20000
+
+// Time inserts, then lookups of present and absent keys, on an index
+// over a fresh scratch disk
+template <class Index>
+static ERROR_T BenchIndex(Index &index, BufferCache &cache, const SIZE_T keysize,
+			  const SIZE_T valuesize, const SIZE_T iterations,
+			  const char *label)
+{
+  vector<KEY_T> keys;
+  vector<KEY_T> probes;
+  VALUE_T value(valuesize);
+  SIZE_T superblock;
+  ERROR_T rc;
+
+  srand(42);
+  memset(value.data,'v',value.length);
+
+  rc=cache.Attach();
+  if (rc) { return rc; }
+  rc=index.Attach(0,true);
+  if (rc) { return rc; }
+
+  double start=now();
+  while (keys.size()<BENCH_INDEX_KEYS) {
+    KEY_T k;
+    RandomKey(k,keysize);
+    rc=index.Insert(k,value);
+    if (rc==ERROR_CONFLICT) {
+      continue;
+    }
+    if (rc) { return rc; }
+    keys.push_back(k);
+  }
+  double inserting=now()-start;
+
+  for (SIZE_T i=0;i<1024;i++) {
+    if (i%2) {
+      probes.push_back(keys[rand()%keys.size()]);
+    } else {
+      KEY_T k;
+      RandomKey(k,keysize);
+      probes.push_back(k);
+    }
+  }
+
+  SIZE_T found=0;
+  start=now();
+  for (SIZE_T i=0;i<iterations;i++) {
+    if (index.Lookup(probes[i%probes.size()],value)==ERROR_NOERROR) {
+      found++;
+    }
+  }
+  double elapsed=now()-start;
+
+  cout << "index    row    " << label << (index.IsSpecialized() ? "(specialized) " : "")
+       << "keysize="<<keysize
+       << " keys="<<keys.size()
+       << " ns/insert="<<(inserting*1e9/keys.size())
+       << " ns/lookup="<<(elapsed*1e9/iterations)
+       << " (found "<<found<<")"<<endl;
+
+  rc=index.Detach(superblock);
+  if (rc) { return rc; }
+  return cache.Detach();
+}
+
+
+// BTreeIndexT against the runtime-sized code, for one compile-time shape
+template <SIZE_T KeySize, SIZE_T ValueSize, SIZE_T BlockSize>
+static ERROR_T BenchFixedIndex(const SIZE_T iterations)
+{
+  char stem[64];
+  ERROR_T rc;
+
+  snprintf(stem,sizeof(stem),"/tmp/btree_bench.%d",(int)getpid());
+  {
+    DiskSystem disk(stem,true,0,BENCH_INDEX_BLOCKS,BlockSize,1,BENCH_INDEX_BLOCKS,1,10,1,10);
+    BufferCache cache(&disk,BENCH_INDEX_BLOCKS);
+    RuntimeIndex runtime(KeySize,ValueSize,&cache);
+    BTreeIndexT<KeySize,ValueSize,BlockSize> fixed(&cache);
+
+    rc=BenchIndex(runtime,cache,KeySize,ValueSize,iterations,"runtime ");
+    if (!rc) {
+      rc=BenchIndex(fixed,cache,KeySize,ValueSize,iterations,"fixed   ");
+    }
+  }
+  remove((string(stem)+".data").c_str());
+  remove((string(stem)+".bitmap").c_str());
+  remove((string(stem)+".config").c_str());
+  return rc;
+}
+
+
+struct FixedIndexBench {
+  SIZE_T keysize;
+  SIZE_T valuesize;
+  SIZE_T blocksize;
+  ERROR_T (*run)(const SIZE_T iterations);
+};
+
+#define BENCH_ENTRY(k,v,b) { k, v, b, BenchFixedIndex<k,v,b> }
+
+#define BENCH_BLOCKS(k,v) \
+  BENCH_ENTRY(k,v,1024), \
+  BENCH_ENTRY(k,v,4096)
+
+#define BENCH_VALUES(k) \
+  BENCH_BLOCKS(k,4), \
+  BENCH_BLOCKS(k,8), \
+  BENCH_BLOCKS(k,16)
+
+// The row format shapes of the table in btree_fixed.cc
+static const FixedIndexBench fixed_index_benches[] = {
+  BENCH_VALUES(4),
+  BENCH_VALUES(8),
+  BENCH_VALUES(16)
+};
+
+
+static int BenchFixed(int argc, char **argv)
+{
+  if (argc!=6) {
+    usage();
+    return -1;
+  }
+
+  NodeMetadata info=NodeMetadata();
+  info.keysize=atoi(argv[2]);
+  info.valuesize=atoi(argv[3]);
+  info.blocksize=atoi(argv[4]);
+  SIZE_T iterations=atoi(argv[5]);
+  ERROR_T rc;
+
+  int types[]={BTREE_LEAF_NODE, BTREE_INTERIOR_NODE};
+  int formats[]={BTREE_FORMAT_ROW, BTREE_FORMAT_COLUMN, BTREE_FORMAT_PREFIX};
+
+  for (int f=0;f<3;f++) {
+    info.nodeformat=formats[f];
+    const BTreeNodeOps *ops=LookupFixedNodeOps(info);
+    if (!ops) {
+      cerr << "No specialization for these sizes; see btree_fixed.cc\n";
+      return -1;
+    }
+    for (int t=0;t<2;t++) {
+      if ((rc=BenchSearch(types[t],formats[f],info.keysize,info.valuesize,info.blocksize,iterations,NodeFindKey,"runtime ")) ||
+	  (rc=BenchSearch(types[t],formats[f],info.keysize,info.valuesize,info.blocksize,iterations,ops->findkey,"fixed   "))) {
+	cerr << "Benchmark failed due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  for (SIZE_T i=0;i<sizeof(fixed_index_benches)/sizeof(fixed_index_benches[0]);i++) {
+    const FixedIndexBench &b=fixed_index_benches[i];
+    if (b.keysize==info.keysize && b.valuesize==info.valuesize && b.blocksize==info.blocksize) {
+      if ((rc=b.run(iterations))) {
+	cerr << "Benchmark failed due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc<2) {
+    usage();
+    return -1;
+  }
+
+  if (!strcmp(argv[1],"layout")) {
+    return BenchLayout(argc,argv);
+  } else if (!strcmp(argv[1],"prefix")) {
+    return BenchPrefix(argc,argv);
+  } else if (!strcmp(argv[1],"fixed")) {
+    return BenchFixed(argc,argv);
+  } else {
+    usage();
+    return -1;
+  }
+}
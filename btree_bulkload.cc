@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fillfactor] < pairs\n";
+  cerr << "       pairs are \"key value\" lines in increasing key order\n";
+}
+
+
+// Reads "key value" lines from a stream
+class LineLoadIterator : public BTreeLoadIterator {
+ private:
+  BTreeIndex *btree;
+  FILE       *file;
+  SIZE_T      line;
+ public:
+  LineLoadIterator(BTreeIndex *b, FILE *f) : btree(b), file(f), line(0) {}
+
+  ERROR_T Next(KeyValuePair &pair) {
+    char key[1024], value[1024];
+    ERROR_T rc;
+    int n=fscanf(file,"%1023s %1023s",key,value);
+
+    if (n==EOF || n==0) { 
+      return ERROR_NONEXISTENT;
+    }
+    line++;
+    if (n!=2) { 
+      cerr << "Missing value on line "<<line<<": "<<key<<endl;
+      return ERROR_SIZE;
+    }
+    if ((rc=btree->MakeKey(key,pair.key))) { 
+      cerr << "Bad key on line "<<line<<": "<<key<<endl;
+      return rc;
+    }
+    pair.value=VALUE_T(value);
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T GetNumLines() const { return line; }
+};
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fillfactor=1.0;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc==4) { 
+    fillfactor=atof(argv[3]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+  int result=0;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    LineLoadIterator input(&btree,stdin);
+    if ((rc=btree.BulkLoad(input,fillfactor))!=ERROR_NOERROR) { 
+      cerr <<"Can't bulk load index due to error "<<rc<<" after "<<input.GetNumLines()<<" pairs"<<endl;
+      result=-1;
+    } else {
+      cerr <<"Bulk load of "<<input.GetNumLines()<<" pairs succeeded\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return result;
+  }
+}
+  
@@ -17,14 +17,36 @@ SIZE_T NodeMetadata::GetNumDataBytes() const
 }
 
 
+SIZE_T NodeMetadata::GetNumBufferBytes() const
+{
+  return GetNumDataBytes()*bufferratio/100;
+}
+
+
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  SIZE_T prefix = (nodeformat==BTREE_FORMAT_PREFIX) ? sizeof(PREFIX_T) : 0;
+  // the message buffer, if any, comes off the top
+  return (GetNumDataBytes()-GetNumBufferBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T)+prefix);  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  SIZE_T prefix = (nodeformat==BTREE_FORMAT_PREFIX) ? sizeof(PREFIX_T) : 0;
+  // with tombstones, each slot also has a tombstone byte
+  SIZE_T dead = tombstones ? 1 : 0;
+  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize+prefix+dead);  // floor intended
+}
+
+SIZE_T NodeMetadata::GetNumMessageSlots() const
+{
+  SIZE_T n=GetNumBufferBytes();
+
+  if (n<sizeof(SIZE_T)) { 
+    return 0;
+  }
+  // each message is a type byte, a key, and a value
+  return (n-sizeof(SIZE_T))/(1+keysize+valuesize);  // floor intended
 }
 
 
@@ -35,14 +57,78 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
 				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+     << ", nodeformat="<<(nodeformat==BTREE_FORMAT_ROW ? "ROW" :
+			  nodeformat==BTREE_FORMAT_COLUMN ? "COLUMN" :
+			  nodeformat==BTREE_FORMAT_PREFIX ? "PREFIX" : "UNKNOWN_FORMAT")
+     << ", keytype="<<(keytype==BTREE_KEY_BYTES ? "BYTES" :
+		       keytype==BTREE_KEY_INT ? "INT" : "UNKNOWN_KEYTYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys;
+  if (nodetype==BTREE_SUPERBLOCK) { 
+    os << ", freerun="<<freerun
+       << ", splitfill="<<(int)splitfill<<", splitratio="<<(int)splitratio<<", appendratio="<<(int)appendratio
+       << ", bufferratio="<<(int)bufferratio<<", tombstones="<<(int)tombstones;
+  }
+  os << ")";
   return os;
 }
 
+ERROR_T EncodeIntKey(const long long v, const SIZE_T keysize, KEY_T &k)
+{
+  unsigned long long u;
+
+  if (keysize==4) { 
+    if (v<-2147483648LL || v>2147483647LL) { 
+      return ERROR_SIZE;
+    }
+    u=((unsigned long long)v ^ 0x80000000ULL) & 0xffffffffULL;
+  } else if (keysize==8) { 
+    u=(unsigned long long)v ^ 0x8000000000000000ULL;
+  } else {
+    return ERROR_SIZE;
+  }
+
+  k.Resize(keysize,false);
+  for (SIZE_T i=0;i<keysize;i++) { 
+    k.data[keysize-1-i]=(BYTE_T)(u>>(8*i));
+  }
+  return ERROR_NOERROR;
+}
+
+
+long long DecodeIntKey(const BYTE_T *k, const SIZE_T keysize)
+{
+  unsigned long long u=0;
+
+  for (SIZE_T i=0;i<keysize;i++) { 
+    u=(u<<8)|k[i];
+  }
+  if (keysize==4) { 
+    return (long long)(int)(unsigned int)(u ^ 0x80000000ULL);
+  } else {
+    return (long long)(u ^ 0x8000000000000000ULL);
+  }
+}
+
+
+ERROR_T EncodeDecimalKey(const SIZE_T n, const SIZE_T keysize, KEY_T &k)
+{
+  SIZE_T left=n;
+
+  k.Resize(keysize,false);
+  for (SIZE_T i=0;i<keysize;i++) { 
+    k.data[keysize-1-i]='0'+left%10;
+    left/=10;
+  }
+  return left ? ERROR_SIZE : ERROR_NOERROR;
+}
+
+
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.nodeformat=BTREE_FORMAT_ROW;
+  info.keytype=BTREE_KEY_BYTES;
   data=0;
 }
 
@@ -56,15 +142,24 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     int node_format, int key_type)
 {
   info.nodetype=node_type;
+  info.nodeformat=node_format;
+  info.keytype=key_type;
   info.keysize=key_size;
   info.valuesize=value_size;
   info.blocksize=block_size;
   info.rootnode=0;
   info.freelist=0;
+  info.freerun=0;
   info.numkeys=0;				       
+  info.splitfill=0;
+  info.splitratio=0;
+  info.appendratio=0;
+  info.bufferratio=0;
+  info.tombstones=0;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -75,12 +170,20 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
 BTreeNode::BTreeNode(const BTreeNode &rhs) 
 {
   info.nodetype=rhs.info.nodetype;
+  info.nodeformat=rhs.info.nodeformat;
+  info.keytype=rhs.info.keytype;
   info.keysize=rhs.info.keysize;
   info.valuesize=rhs.info.valuesize;
   info.blocksize=rhs.info.blocksize;
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
+  info.freerun=rhs.info.freerun;
   info.numkeys=rhs.info.numkeys;				       
+  info.splitfill=rhs.info.splitfill;
+  info.splitratio=rhs.info.splitratio;
+  info.appendratio=rhs.info.appendratio;
+  info.bufferratio=rhs.info.bufferratio;
+  info.tombstones=rhs.info.tombstones;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -99,14 +202,32 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  Block block;
+  ERROR_T rc=Serialize(block);
+
+  if (rc) { 
+    return rc;
+  }
+
+  return b->WriteBlock(blocknum,block);
+}
+
+ERROR_T BTreeNode::Serialize(Block &block) const
+{
+  ERROR_T rc=block.Resize(sizeof(info)+info.GetNumDataBytes(),false);
+
+  if (rc) { 
+    return rc;
+  }
 
   memcpy(block.data,&info,sizeof(info));
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
     memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+  } else {
+    memset(block.data+sizeof(info),0,info.GetNumDataBytes());
   }
 
-  return b->WriteBlock(blocknum,block);
+  return ERROR_NOERROR;
 }
 
 
@@ -122,6 +243,13 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
+  assert(b->GetBlockSize()==block.length);
+
+  return Unserialize(block);
+}
+
+ERROR_T  BTreeNode::Unserialize(const Block &block)
+{
   memcpy(&info,block.data,sizeof(info));
   
   if (data) { 
@@ -129,7 +257,7 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     data=0;
   }
 
-  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+  assert(block.length==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -140,17 +268,117 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 }
 
 
+//
+// Raw addresses of the ith prefix, key, pointer, and value, without
+// checking i against numkeys.  These are what know about the layouts.
+//
+static char *PrefixAddr(const BTreeNode &n, const SIZE_T i)
+{
+  if (n.info.nodeformat!=BTREE_FORMAT_PREFIX) {
+    return 0;
+  }
+  switch (n.info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return n.data+i*sizeof(PREFIX_T);
+    break;
+  case BTREE_LEAF_NODE:
+    return n.data+sizeof(SIZE_T)+i*sizeof(PREFIX_T);
+    break;
+  default:
+    return 0;
+  }
+}
+
+// Where the key array starts in the column and prefix formats
+static char *KeyBase(const BTreeNode &n)
+{
+  char *base = n.data;
+  if (n.info.nodetype==BTREE_LEAF_NODE) {
+    base+=sizeof(SIZE_T);
+  }
+  if (n.info.nodeformat==BTREE_FORMAT_PREFIX) {
+    base+=n.GetNumSlots()*sizeof(PREFIX_T);
+  }
+  return base;
+}
+
+static char *KeyAddr(const BTreeNode &n, const SIZE_T i)
+{
+  switch (n.info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    if (n.info.nodeformat!=BTREE_FORMAT_ROW) { 
+      return KeyBase(n)+i*n.info.keysize;
+    } else {
+      return n.data+sizeof(SIZE_T)+i*(sizeof(SIZE_T)+n.info.keysize);
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (n.info.nodeformat!=BTREE_FORMAT_ROW) { 
+      return KeyBase(n)+i*n.info.keysize;
+    } else {
+      return n.data+sizeof(SIZE_T)+i*(n.info.keysize+n.info.valuesize);
+    }
+    break;
+  default:
+    return 0;
+  }
+}
+
+static char *PtrAddr(const BTreeNode &n, const SIZE_T i)
+{
+  switch (n.info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    if (n.info.nodeformat!=BTREE_FORMAT_ROW) { 
+      return KeyBase(n)+n.GetNumSlots()*n.info.keysize+i*sizeof(SIZE_T);
+    } else {
+      return n.data+i*(sizeof(SIZE_T)+n.info.keysize);
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    return n.data;
+    break;
+  default:
+    return 0;
+  }
+}
+
+// The tombstone bytes of a leaf are at the end of its data, in all
+// formats; 0 if the node has none
+static char *TombstoneAddr(const BTreeNode &n, const SIZE_T i)
+{
+  if (n.info.nodetype!=BTREE_LEAF_NODE || !n.info.tombstones) { 
+    return 0;
+  }
+  return n.data+n.info.GetNumDataBytes()-n.GetNumSlots()+i;
+}
+
+static char *ValAddr(const BTreeNode &n, const SIZE_T i)
+{
+  switch (n.info.nodetype) { 
+  case BTREE_LEAF_NODE:
+    if (n.info.nodeformat!=BTREE_FORMAT_ROW) { 
+      return KeyBase(n)+n.GetNumSlots()*n.info.keysize+i*n.info.valuesize;
+    } else {
+      return n.data+sizeof(SIZE_T)+i*(n.info.keysize+n.info.valuesize)+n.info.keysize;
+    }
+    break;
+  default:
+    return 0;
+  }
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    return KeyAddr(*this,offset);
     break;
   default:
     return 0;
@@ -164,11 +392,11 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    return PtrAddr(*this,offset);
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
-    return data;
+    return PtrAddr(*this,offset);
     break;
   default:
     return 0;
@@ -182,7 +410,7 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    return ValAddr(*this,offset);
     break;
   default:
     return 0;
@@ -191,8 +419,19 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
 
 
 
+PREFIX_T * BTreeNode::ResolvePrefix(const SIZE_T offset) const
+{
+  assert(offset<info.numkeys);
+  return (PREFIX_T *) PrefixAddr(*this,offset);
+}
+
+
 char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
 {
+  // key/value pairs are only contiguous in the row format
+  if (info.nodeformat!=BTREE_FORMAT_ROW) { 
+    return 0;
+  }
   return ResolveKey(offset);
 }
 
@@ -257,6 +496,10 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 
   memcpy(p,k.data,info.keysize);
 
+  if (info.nodeformat==BTREE_FORMAT_PREFIX) { 
+    *ResolvePrefix(offset)=MakeKeyPrefix(k.data,info.keysize);
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -275,6 +518,70 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 }
 
 
+ERROR_T BTreeNode::GetHighKey(KEY_T &k) const
+{
+  char *p=KeyAddr(*this,GetNumSlots()-1);
+
+  if (p==0 || data==0) { 
+    return ERROR_NOMEM;
+  }
+  if (info.numkeys>=GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+  k.Resize(info.keysize,false);
+  memcpy(k.data,p,info.keysize);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeNode::SetHighKey(const KEY_T &k)
+{
+  char *p=KeyAddr(*this,GetNumSlots()-1);
+
+  if (p==0 || data==0) { 
+    return ERROR_NOMEM;
+  }
+  if (info.numkeys>=GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+  memcpy(p,k.data,info.keysize);
+  return ERROR_NOERROR;
+}
+
+// The pointer a B-link node keeps its right sibling in
+static char *RightLinkAddr(const BTreeNode &n)
+{
+  if (n.info.nodetype==BTREE_LEAF_NODE) { 
+    return PtrAddr(n,0);
+  }
+  if (n.info.numkeys>=n.GetNumSlots()) { 
+    return 0;
+  }
+  return PtrAddr(n,n.GetNumSlots());
+}
+
+ERROR_T BTreeNode::GetRightLink(SIZE_T &ptr) const
+{
+  char *p = data ? RightLinkAddr(*this) : 0;
+
+  if (p==0) { 
+    return ERROR_NOSPACE;
+  }
+  memcpy(&ptr,p,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeNode::SetRightLink(const SIZE_T ptr)
+{
+  char *p = data ? RightLinkAddr(*this) : 0;
+
+  if (p==0) { 
+    return ERROR_NOSPACE;
+  }
+  memcpy(p,&ptr,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
+
 
 ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
@@ -302,6 +609,390 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 }
 
 
+bool BTreeNode::IsTombstone(const SIZE_T offset) const
+{
+  assert(offset<info.numkeys);
+  char *p=TombstoneAddr(*this,offset);
+
+  return p && *p;
+}
+
+
+ERROR_T BTreeNode::SetTombstone(const SIZE_T offset, const bool dead)
+{
+  if (offset>=info.numkeys) { 
+    return ERROR_SIZE;
+  }
+
+  char *p=TombstoneAddr(*this,offset);
+
+  if (p==0) { 
+    // a live key needs no mark
+    return dead ? ERROR_INSANE : ERROR_NOERROR;
+  }
+
+  *p=dead;
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetNumTombstones() const
+{
+  char *p=TombstoneAddr(*this,0);
+  SIZE_T n=0;
+
+  if (p==0) { 
+    return 0;
+  }
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    n+=(p[i]!=0);
+  }
+  return n;
+}
+
+
+
+SIZE_T BTreeNode::GetNumSlots() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info.GetNumSlotsAsInterior();
+    break;
+  case BTREE_LEAF_NODE:
+    return info.GetNumSlotsAsLeaf();
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetSlotSize() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info.keysize+sizeof(SIZE_T);
+    break;
+  case BTREE_LEAF_NODE:
+    return info.keysize+info.valuesize;
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+// memcmp(a,b,keysize)<0, but as a single word compare for the
+// 4 and 8 byte keys that integer keys and most byte keys use
+static inline bool KeyLess(const BYTE_T *a, const BYTE_T *b, const SIZE_T keysize)
+{
+  switch (keysize) { 
+  case 4: { 
+    unsigned int x, y;
+    memcpy(&x,a,4);
+    memcpy(&y,b,4);
+    return __builtin_bswap32(x)<__builtin_bswap32(y);
+  }
+  case 8: { 
+    unsigned long long x, y;
+    memcpy(&x,a,8);
+    memcpy(&y,b,8);
+    return __builtin_bswap64(x)<__builtin_bswap64(y);
+  }
+  default:
+    return memcmp(a,b,keysize)<0;
+  }
+}
+
+
+SIZE_T BTreeNode::FindKey(const KEY_T &k) const
+{
+  if (info.nodeformat==BTREE_FORMAT_PREFIX) { 
+    // vector search on prefixes, then resolve ties on the full keys
+    PREFIX_T q=MakeKeyPrefix(k.data,info.keysize);
+    PREFIX_T *p=(PREFIX_T *)PrefixAddr(*this,0);
+    SIZE_T i=0;
+    if (info.keysize<=sizeof(PREFIX_T)) { 
+      // the prefix is the whole key
+      return CountPrefixesBelow(p,info.numkeys,q);
+    }
+    if (info.numkeys && p[0]==p[info.numkeys-1]) { 
+      // every key has the same prefix (as small INT keys do), so only
+      // the full keys can tell them apart
+      if (q!=p[0]) { 
+	return q<p[0] ? 0 : info.numkeys;
+      }
+    } else {
+      i=CountPrefixesBelow(p,info.numkeys,q);
+    }
+    // binary search the keys from i on; a larger prefix settles it
+    // without a key compare, and a tie goes to the full keys, so a long
+    // run of tied prefixes is not scanned one by one
+    const BYTE_T *keys=(const BYTE_T *)KeyAddr(*this,0);
+    SIZE_T hi=info.numkeys;
+    while (i<hi) { 
+      SIZE_T mid=(i+hi)/2;
+      if (p[mid]==q && KeyLess(keys+mid*info.keysize,k.data,info.keysize)) { 
+	i=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return i;
+  }
+
+  // binary search for the first key that is >= k
+  SIZE_T lo=0;
+  SIZE_T hi=info.numkeys;
+
+  while (lo<hi) { 
+    SIZE_T mid=(lo+hi)/2;
+    if (KeyLess((const BYTE_T *)KeyAddr(*this,mid),k.data,info.keysize)) { 
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+ERROR_T BTreeNode::MoveRange(const SIZE_T dst, const SIZE_T src, const SIZE_T n)
+{
+  if (n==0) { 
+    return ERROR_NOERROR;
+  }
+  if (data==0) { 
+    return ERROR_NOMEM;
+  }
+  if (dst+n>GetNumSlots() || src+n>GetNumSlots()) { 
+    return ERROR_SIZE;
+  }
+
+  if (info.nodeformat==BTREE_FORMAT_PREFIX) { 
+    memmove(PrefixAddr(*this,dst),PrefixAddr(*this,src),n*sizeof(PREFIX_T));
+  }
+
+  if (info.nodeformat!=BTREE_FORMAT_ROW) { 
+    memmove(KeyAddr(*this,dst),KeyAddr(*this,src),n*info.keysize);
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      memmove(ValAddr(*this,dst),ValAddr(*this,src),n*info.valuesize);
+    } else {
+      memmove(PtrAddr(*this,dst+1),PtrAddr(*this,src+1),n*sizeof(SIZE_T));
+    }
+  } else {
+    memmove(KeyAddr(*this,dst),KeyAddr(*this,src),n*GetSlotSize());
+  }
+
+  if (info.nodetype==BTREE_LEAF_NODE && info.tombstones) { 
+    memmove(TombstoneAddr(*this,dst),TombstoneAddr(*this,src),n);
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertSlot(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  ERROR_T rc;
+
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (offset>info.numkeys) { 
+    return ERROR_SIZE;
+  }
+  if (info.numkeys>=GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+
+  rc=MoveRange(offset+1,offset,info.numkeys-offset);
+  if (rc) { return rc; }
+
+  info.numkeys++;
+
+  rc=SetTombstone(offset,false);
+  if (rc) { return rc; }
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::InsertSlot(const SIZE_T offset, const KEY_T &k, const SIZE_T &p)
+{
+  ERROR_T rc;
+
+  if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (offset>info.numkeys) { 
+    return ERROR_SIZE;
+  }
+  if (info.numkeys>=GetNumSlots()) { 
+    return ERROR_NOSPACE;
+  }
+
+  rc=MoveRange(offset+1,offset,info.numkeys-offset);
+  if (rc) { return rc; }
+
+  info.numkeys++;
+
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetPtr(offset+1,p);
+}
+
+
+ERROR_T BTreeNode::RemoveSlot(const SIZE_T offset)
+{
+  ERROR_T rc;
+
+  if (offset>=info.numkeys) { 
+    return ERROR_SIZE;
+  }
+
+  rc=MoveRange(offset,offset+1,info.numkeys-offset-1);
+  if (rc) { return rc; }
+
+  info.numkeys--;
+
+  return ERROR_NOERROR;
+}
+
+
+// The message buffer of an interior node is the end of its data, in
+// every format; 0 if it has none
+static char *BufferAddr(const BTreeNode &n)
+{
+  if ((n.info.nodetype!=BTREE_INTERIOR_NODE && n.info.nodetype!=BTREE_ROOT_NODE) ||
+      n.info.GetNumMessageSlots()==0) { 
+    return 0;
+  }
+  return n.data+n.info.GetNumDataBytes()-n.info.GetNumBufferBytes();
+}
+
+static char *MessageAddr(const BTreeNode &n, const SIZE_T i)
+{
+  return BufferAddr(n)+sizeof(SIZE_T)+i*(1+n.info.keysize+n.info.valuesize);
+}
+
+
+SIZE_T BTreeNode::GetNumMessages() const
+{
+  char *p=BufferAddr(*this);
+  SIZE_T n;
+
+  if (p==0) { 
+    return 0;
+  }
+  memcpy(&n,p,sizeof(SIZE_T));
+  return n;
+}
+
+
+SIZE_T BTreeNode::GetMaxMessages() const
+{
+  return BufferAddr(*this) ? info.GetNumMessageSlots() : 0;
+}
+
+
+SIZE_T BTreeNode::FindMessage(const KEY_T &k) const
+{
+  SIZE_T lo=0, hi=GetNumMessages();
+
+  while (lo<hi) { 
+    SIZE_T mid=(lo+hi)/2;
+    if (memcmp(MessageAddr(*this,mid)+1,k.data,info.keysize)<0) { 
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+ERROR_T BTreeNode::GetMessage(const SIZE_T offset, int &type, KEY_T &k, VALUE_T &v) const
+{
+  char *p;
+
+  if (offset>=GetNumMessages()) { 
+    return ERROR_SIZE;
+  }
+  p=MessageAddr(*this,offset);
+  type=(unsigned char)p[0];
+  k.Resize(info.keysize,false);
+  memcpy(k.data,p+1,info.keysize);
+  v.Resize(info.valuesize,false);
+  memcpy(v.data,p+1+info.keysize,info.valuesize);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetMessage(const SIZE_T offset, const int type, const VALUE_T &v)
+{
+  char *p;
+
+  if (offset>=GetNumMessages()) { 
+    return ERROR_SIZE;
+  }
+  p=MessageAddr(*this,offset);
+  p[0]=(char)type;
+  memcpy(p+1+info.keysize,v.data,info.valuesize);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertMessage(const SIZE_T offset, const int type, const KEY_T &k, const VALUE_T &v)
+{
+  SIZE_T n=GetNumMessages();
+  SIZE_T size=1+info.keysize+info.valuesize;
+  char *p;
+
+  if (BufferAddr(*this)==0) { 
+    return ERROR_INSANE;
+  }
+  if (offset>n) { 
+    return ERROR_SIZE;
+  }
+  if (n>=GetMaxMessages()) { 
+    return ERROR_NOSPACE;
+  }
+
+  p=MessageAddr(*this,offset);
+  memmove(p+size,p,(n-offset)*size);
+  n++;
+  memcpy(BufferAddr(*this),&n,sizeof(SIZE_T));
+
+  p[0]=(char)type;
+  memcpy(p+1,k.data,info.keysize);
+  memcpy(p+1+info.keysize,v.data,info.valuesize);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::RemoveMessages(const SIZE_T offset, const SIZE_T count)
+{
+  SIZE_T n=GetNumMessages();
+  SIZE_T size=1+info.keysize+info.valuesize;
+  char *p;
+
+  if (offset+count>n) { 
+    return ERROR_SIZE;
+  }
+  if (count==0) { 
+    return ERROR_NOERROR;
+  }
+
+  p=MessageAddr(*this,offset);
+  memmove(p,p+count*size,(n-offset-count)*size);
+  n-=count;
+  memcpy(BufferAddr(*this),&n,sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
 
 
 ostream & BTreeNode::Print(ostream &os) const 
@@ -338,6 +1029,9 @@ ostream & BTreeNode::Print(ostream &os) const
 	os<<key<<", ";
 	GetVal(i,val);
 	os<<val;
+	if (IsTombstone(i)) { 
+	  os<<" (deleted)";
+	}
       }
       os <<")";
     }
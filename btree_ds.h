@@ -4,6 +4,7 @@
 #include <iostream>
 #include "global.h"
 #include "block.h"
+#include "keyprefix.h"
 
 using namespace std;
 
@@ -14,6 +15,25 @@ using namespace std;
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
 
+// Node layouts (see below)
+#define BTREE_FORMAT_ROW 0
+#define BTREE_FORMAT_COLUMN 1
+#define BTREE_FORMAT_PREFIX 2
+
+// Key types
+//
+// BTREE_KEY_BYTES keys are arbitrary byte strings, ordered by memcmp.
+// BTREE_KEY_INT keys are signed 32 or 64 bit integers (keysize 4 or 8),
+// stored big-endian with the sign bit flipped, so that memcmp order is
+// numeric order and everything that compares bytes just works.
+#define BTREE_KEY_BYTES 0
+#define BTREE_KEY_INT 1
+
+// Kinds of messages buffered in interior nodes (see BTreeIndex::SetMessageBuffers)
+#define BTREE_MESSAGE_INSERT 1
+#define BTREE_MESSAGE_UPDATE 2
+#define BTREE_MESSAGE_DELETE 3
+
 
 typedef Block Buffer;
 typedef Buffer KeyOrValue;
@@ -26,16 +46,34 @@ struct KeyValuePair;
 
 struct NodeMetadata {
   int nodetype;
+  int nodeformat;
+  int keytype;
   SIZE_T keysize; 
   SIZE_T valuesize;
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
+  // meaningful only for superblock: the blocks from here to the end of
+  // the disk have never been allocated, and end the free list in
+  // order (0 if there are none), see BTreeIndex::AllocateNode
+  SIZE_T freerun;
   SIZE_T numkeys;
+  // percents, meaningful only for superblock, see BTreeIndex::SetSplitPolicy
+  unsigned char splitfill;
+  unsigned char splitratio;
+  unsigned char appendratio;
+  // percent of an interior node's data kept for its message buffer,
+  // the same in every node of a tree, see BTreeIndex::SetMessageBuffers
+  unsigned char bufferratio;
+  // nonzero if leaves keep a tombstone byte per slot, the same in
+  // every node of a tree, see BTreeIndex::SetDeleteMode
+  unsigned char tombstones;
 
   SIZE_T GetNumDataBytes() const;
+  SIZE_T GetNumBufferBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  SIZE_T GetNumMessageSlots() const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -45,7 +83,19 @@ struct NodeMetadata {
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
 
+// Conversions between integers and BTREE_KEY_INT keys.  Encoding
+// returns ERROR_SIZE if keysize is not 4 or 8 or v does not fit.
+ERROR_T EncodeIntKey(const long long v, const SIZE_T keysize, KEY_T &k);
+long long DecodeIntKey(const BYTE_T *k, const SIZE_T keysize);
+
+// Key number n as keysize zero padded decimal digits, so that keys sort
+// as their numbers do.  Returns ERROR_SIZE if n has more digits.
+ERROR_T EncodeDecimalKey(const SIZE_T n, const SIZE_T keysize, KEY_T &k);
 
+
+
+//
+// BTREE_FORMAT_ROW
 //
 // Interior node:
 //
@@ -53,9 +103,51 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // Leaf:
 //
-// PTR* KEY VALUE KEY VALUE KEY VALUE
+// PTR* KEY VALUE KEY VALUE KEY VALUE ... DEAD DEAD DEAD ...
+//
+// *Here this pointer is the next leaf to the right, or 0 for the
+//  last leaf, so the leaves form a chain in key order
+//
+// DEAD is a byte per slot, at the end of the block in every format,
+// that is nonzero if the slot's key has been deleted but not yet
+// removed (a tombstone).  Only a tree with tombstones has these bytes.
+//
+// BTREE_FORMAT_COLUMN
+//
+// Keys are contiguous so that a search touches only key bytes.
+// Each array is sized for the node's full slot capacity.
+//
+// Interior node:
+//
+// KEY KEY KEY ... PTR PTR PTR PTR ...
+//
+// Leaf:
+//
+// PTR* KEY KEY KEY ... VALUE VALUE VALUE ... DEAD DEAD DEAD ...
+//
+// BTREE_FORMAT_PREFIX
+//
+// The column format, preceded by an array holding the normalized
+// prefix (see keyprefix.h) of each key.  Searches scan the prefixes
+// with vector compares and only look at the keys on prefix ties.
+//
+// Interior node:
+//
+// PREFIX PREFIX ... KEY KEY KEY ... PTR PTR PTR PTR ...
+//
+// Leaf:
+//
+// PTR* PREFIX PREFIX ... KEY KEY KEY ... VALUE VALUE VALUE ... DEAD DEAD ...
+//
+// Message buffer
+//
+// With a nonzero bufferratio, the end of an interior node's data, in
+// every format, is its message buffer instead of more slots:
+//
+// COUNT TYPE KEY VALUE TYPE KEY VALUE ...
+//
+// The messages are in key order, with at most one per key.
 //
-// *Here this pointer is not used
 
 
 struct BTreeNode {
@@ -74,29 +166,87 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+	    int node_format=BTREE_FORMAT_ROW, int key_type=BTREE_KEY_BYTES);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
+  ERROR_T Serialize(Block &block) const;  // the block image, without writing it
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  ERROR_T Unserialize(const Block &block);  // from a block image
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
-  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
+  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior, or 0th = next leaf)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
-  char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf, row format only)
+  PREFIX_T *ResolvePrefix(const SIZE_T offset) const; // Gives a pointer to the ith key prefix (prefix format only)
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
-  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
+  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior, or 0th = next leaf)
   ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
-  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
+  ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior, or 0th = next leaf)
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // A B-link node's high key, the largest key that belongs under it,
+  // and its right sibling at the same depth, or 0 for the last one
+  // (see BTreeIndex::SetLatchMode).  The high key is kept in the last
+  // key slot and an interior node's right sibling in the pointer after
+  // it, so these need a slot to spare; a leaf's right sibling is its
+  // next leaf.
+  ERROR_T GetHighKey(KEY_T &k) const;
+  ERROR_T SetHighKey(const KEY_T &k);
+  ERROR_T GetRightLink(SIZE_T &p) const;
+  ERROR_T SetRightLink(const SIZE_T p);
+
+  // Offset of the first key >= k, or numkeys if there is none (interior or leaf)
+  // Tombstones are found like any other key.
+  SIZE_T FindKey(const KEY_T &k) const;
+
+  bool    IsTombstone(const SIZE_T offset) const;  // true if the ith key is deleted (leaf)
+  ERROR_T SetTombstone(const SIZE_T offset, const bool dead);  // Marks the ith key deleted or live (leaf)
+  SIZE_T  GetNumTombstones() const;  // (leaf; 0 for any other node)
+
+  //
+  // Bulk slot operations.  A slot is the ith key together with the
+  // value that follows it (leaf) or the pointer that follows it
+  // (interior, ie, pointer i+1).  The tail is shifted with a single
+  // memmove (one per array in column format) instead of walking it
+  // through Get/Set temporaries.
+  //
+  SIZE_T GetNumSlots() const;  // capacity of this node in slots
+  SIZE_T GetSlotSize() const;  // bytes per slot
+
+  // Opens slot offset, shifting offset..numkeys-1 right, numkeys++
+  // A new leaf slot is live.
+  ERROR_T InsertSlot(const SIZE_T offset, const KEY_T &k, const VALUE_T &v); // leaf
+  ERROR_T InsertSlot(const SIZE_T offset, const KEY_T &k, const SIZE_T &p);  // interior
+  // Closes slot offset, shifting offset+1..numkeys-1 left, numkeys--
+  ERROR_T RemoveSlot(const SIZE_T offset);
+  // Moves slots src..src+n-1 to dst..dst+n-1 (may overlap), numkeys untouched
+  ERROR_T MoveRange(const SIZE_T dst, const SIZE_T src, const SIZE_T n);
+
+  //
+  // Message buffer operations (interior).  A message is a change to a
+  // key somewhere under the node that has not yet been made there.
+  //
+  SIZE_T  GetNumMessages() const;
+  SIZE_T  GetMaxMessages() const;  // capacity of the buffer, 0 for none
+  // Offset of the first message for a key >= k, or GetNumMessages()
+  SIZE_T  FindMessage(const KEY_T &k) const;
+  ERROR_T GetMessage(const SIZE_T offset, int &type, KEY_T &k, VALUE_T &v) const;
+  // Replaces the ith message's type and value; its key stays
+  ERROR_T SetMessage(const SIZE_T offset, const int type, const VALUE_T &v);
+  // Opens message offset, shifting the ones after it right
+  ERROR_T InsertMessage(const SIZE_T offset, const int type, const KEY_T &k, const VALUE_T &v);
+  // Closes messages offset..offset+n-1, shifting the ones after them left
+  ERROR_T RemoveMessages(const SIZE_T offset, const SIZE_T n);
+
   ostream &Print(ostream &rhs) const;
 };
 
@@ -0,0 +1,56 @@
+#include "btree_fixed.h"
+
+//
+// The instantiations that a plain BTreeIndex picks up at Attach.  Any
+// other shape runs on the runtime-sized code.
+//
+
+struct FixedNodeOpsEntry {
+  SIZE_T       keysize;
+  SIZE_T       valuesize;
+  SIZE_T       blocksize;
+  int          nodeformat;
+  BTreeNodeOps ops;
+};
+
+#define FIXED_ENTRY(k,v,b,f) { k, v, b, f, MakeFixedNodeOps<k,v,b,f>() }
+
+#define FIXED_FORMATS(k,v,b) \
+  FIXED_ENTRY(k,v,b,BTREE_FORMAT_ROW), \
+  FIXED_ENTRY(k,v,b,BTREE_FORMAT_COLUMN), \
+  FIXED_ENTRY(k,v,b,BTREE_FORMAT_PREFIX)
+
+#define FIXED_BLOCKS(k,v) \
+  FIXED_FORMATS(k,v,1024), \
+  FIXED_FORMATS(k,v,4096)
+
+#define FIXED_VALUES(k) \
+  FIXED_BLOCKS(k,4), \
+  FIXED_BLOCKS(k,8), \
+  FIXED_BLOCKS(k,16)
+
+static const FixedNodeOpsEntry fixed_node_ops[] = {
+  FIXED_VALUES(4),
+  FIXED_VALUES(8),
+  FIXED_VALUES(16)
+};
+
+
+const BTreeNodeOps *LookupFixedNodeOps(const NodeMetadata &info)
+{
+  // the layouts above give interior nodes all of their data for
+  // slots, and leaves no tombstone bytes
+  if (info.bufferratio || info.tombstones) {
+    return 0;
+  }
+  for (SIZE_T i=0;i<sizeof(fixed_node_ops)/sizeof(fixed_node_ops[0]);i++) {
+    const FixedNodeOpsEntry &e=fixed_node_ops[i];
+    if (e.keysize==info.keysize &&
+	e.valuesize==info.valuesize &&
+	e.blocksize==info.blocksize &&
+	e.nodeformat==info.nodeformat) {
+      return &e.ops;
+    }
+  }
+  return 0;
+}
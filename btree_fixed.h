@@ -0,0 +1,247 @@
+#ifndef _btree_fixed
+#define _btree_fixed
+
+#include <string.h>
+
+#include "global.h"
+#include "btree_ds.h"
+#include "keyprefix.h"
+#include "btree.h"
+
+//
+// Compile-time specialized node access
+//
+// The generic BTreeNode accessors work from the sizes in NodeMetadata,
+// so every offset is a runtime multiply, every slot count a divide,
+// and every key compare a memcmp of unknown length.  FixedNodeLayout
+// does the same arithmetic on template parameters.  The on-disk layout
+// is exactly the one in btree_ds.h; only the code that reads it
+// changes.
+//
+
+
+// Key order is memcmp order.  Keys of 4 and 8 bytes are compared as
+// big-endian words, which is a load, a byte swap, and a compare.
+template <SIZE_T KeySize>
+inline bool FixedKeyLess(const BYTE_T *a, const BYTE_T *b)
+{
+  return memcmp(a,b,KeySize)<0;
+}
+
+template <>
+inline bool FixedKeyLess<4>(const BYTE_T *a, const BYTE_T *b)
+{
+  unsigned int x, y;
+  memcpy(&x,a,4);
+  memcpy(&y,b,4);
+  return __builtin_bswap32(x)<__builtin_bswap32(y);
+}
+
+template <>
+inline bool FixedKeyLess<8>(const BYTE_T *a, const BYTE_T *b)
+{
+  unsigned long long x, y;
+  memcpy(&x,a,8);
+  memcpy(&y,b,8);
+  return __builtin_bswap64(x)<__builtin_bswap64(y);
+}
+
+
+template <SIZE_T KeySize, SIZE_T ValueSize, SIZE_T BlockSize, int Format>
+struct FixedNodeLayout {
+  static constexpr SIZE_T DataBytes = BlockSize-sizeof(NodeMetadata);
+  static constexpr SIZE_T PrefixBytes = (Format==BTREE_FORMAT_PREFIX) ? sizeof(PREFIX_T) : 0;
+  // leaves without tombstones (see LookupFixedNodeOps)
+  static constexpr SIZE_T LeafSlots = (DataBytes-sizeof(SIZE_T))/(KeySize+ValueSize+PrefixBytes);
+  static constexpr SIZE_T InteriorSlots = (DataBytes-sizeof(SIZE_T))/(KeySize+sizeof(SIZE_T)+PrefixBytes);
+
+  static inline PREFIX_T *PrefixAddr(const BTreeNode &n, const bool leaf)
+  {
+    return (PREFIX_T *)(n.data+(leaf ? sizeof(SIZE_T) : 0));
+  }
+
+  static inline BYTE_T *KeyAddr(const BTreeNode &n, const bool leaf, const SIZE_T i)
+  {
+    BYTE_T *d=(BYTE_T *)n.data;
+    if (Format==BTREE_FORMAT_ROW) {
+      return leaf ? d+sizeof(SIZE_T)+i*(KeySize+ValueSize) : d+sizeof(SIZE_T)+i*(KeySize+sizeof(SIZE_T));
+    } else {
+      return leaf ? d+sizeof(SIZE_T)+LeafSlots*PrefixBytes+i*KeySize : d+InteriorSlots*PrefixBytes+i*KeySize;
+    }
+  }
+
+  // The ith value of a leaf
+  static inline BYTE_T *ValAddr(const BTreeNode &n, const SIZE_T i)
+  {
+    BYTE_T *d=(BYTE_T *)n.data;
+    if (Format==BTREE_FORMAT_ROW) {
+      return d+sizeof(SIZE_T)+i*(KeySize+ValueSize)+KeySize;
+    } else {
+      return d+sizeof(SIZE_T)+LeafSlots*(PrefixBytes+KeySize)+i*ValueSize;
+    }
+  }
+
+  // The ith pointer of an interior node
+  static inline BYTE_T *PtrAddr(const BTreeNode &n, const SIZE_T i)
+  {
+    BYTE_T *d=(BYTE_T *)n.data;
+    if (Format==BTREE_FORMAT_ROW) {
+      return d+i*(KeySize+sizeof(SIZE_T));
+    } else {
+      return d+InteriorSlots*(PrefixBytes+KeySize)+i*sizeof(SIZE_T);
+    }
+  }
+
+  // Same contract as BTreeNode::FindKey
+  static SIZE_T FindKey(const BTreeNode &n, const KEY_T &k)
+  {
+    const bool leaf = n.info.nodetype==BTREE_LEAF_NODE;
+    const BYTE_T *key=k.data;
+
+    if (Format==BTREE_FORMAT_PREFIX) {
+      PREFIX_T q=MakeKeyPrefix(key,KeySize);
+      const PREFIX_T *p=PrefixAddr(n,leaf);
+      SIZE_T i=0;
+      if (KeySize<=sizeof(PREFIX_T)) {
+	return CountPrefixesBelow(p,n.info.numkeys,q);
+      }
+      // as in BTreeNode::FindKey, skip prefixes that are all the same,
+      // and binary search the tied ones
+      if (n.info.numkeys && p[0]==p[n.info.numkeys-1]) {
+	if (q!=p[0]) {
+	  return q<p[0] ? 0 : n.info.numkeys;
+	}
+      } else {
+	i=CountPrefixesBelow(p,n.info.numkeys,q);
+      }
+      SIZE_T hi=n.info.numkeys;
+      while (i<hi) {
+	SIZE_T mid=(i+hi)/2;
+	if (p[mid]==q && FixedKeyLess<KeySize>(KeyAddr(n,leaf,mid),key)) {
+	  i=mid+1;
+	} else {
+	  hi=mid;
+	}
+      }
+      return i;
+    }
+
+    SIZE_T lo=0;
+    SIZE_T hi=n.info.numkeys;
+    while (lo<hi) {
+      SIZE_T mid=(lo+hi)/2;
+      if (FixedKeyLess<KeySize>(KeyAddr(n,leaf,mid),key)) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+
+  // The accessors below have the same contracts as BTreeNode's, but
+  // leave the node type checks to the caller, who knows it already
+
+  static ERROR_T GetPtr(const BTreeNode &n, const SIZE_T i, SIZE_T &ptr)
+  {
+    memcpy(&ptr,PtrAddr(n,i),sizeof(SIZE_T));
+    return ERROR_NOERROR;
+  }
+
+  static bool MatchKey(const BTreeNode &n, const SIZE_T i, const KEY_T &k)
+  {
+    return memcmp(KeyAddr(n,true,i),k.data,KeySize)==0;
+  }
+
+  static ERROR_T GetVal(const BTreeNode &n, const SIZE_T i, VALUE_T &v)
+  {
+    v.Resize(ValueSize,false);
+    memcpy(v.data,ValAddr(n,i),ValueSize);
+    return ERROR_NOERROR;
+  }
+
+  static ERROR_T SetVal(BTreeNode &n, const SIZE_T i, const VALUE_T &v)
+  {
+    memcpy(ValAddr(n,i),v.data,ValueSize);
+    return ERROR_NOERROR;
+  }
+
+  static ERROR_T InsertLeaf(BTreeNode &n, const SIZE_T i, const KEY_T &k, const VALUE_T &v)
+  {
+    const SIZE_T moving=n.info.numkeys-i;
+
+    if (n.info.nodetype!=BTREE_LEAF_NODE) {
+      return ERROR_INSANE;
+    }
+    if (i>n.info.numkeys) {
+      return ERROR_SIZE;
+    }
+    if (n.info.numkeys>=LeafSlots) {
+      return ERROR_NOSPACE;
+    }
+    if (Format==BTREE_FORMAT_ROW) {
+      memmove(KeyAddr(n,true,i+1),KeyAddr(n,true,i),moving*(KeySize+ValueSize));
+    } else {
+      if (Format==BTREE_FORMAT_PREFIX) {
+	PREFIX_T *p=PrefixAddr(n,true);
+	memmove(p+i+1,p+i,moving*sizeof(PREFIX_T));
+	p[i]=MakeKeyPrefix(k.data,KeySize);
+      }
+      memmove(KeyAddr(n,true,i+1),KeyAddr(n,true,i),moving*KeySize);
+      memmove(ValAddr(n,i+1),ValAddr(n,i),moving*ValueSize);
+    }
+    memcpy(KeyAddr(n,true,i),k.data,KeySize);
+    memcpy(ValAddr(n,i),v.data,ValueSize);
+    n.info.numkeys++;
+    return ERROR_NOERROR;
+  }
+};
+
+
+// The common sizes are instantiated in btree_fixed.cc.  Returns the
+// matching specialization, or 0 if the runtime path must be used.
+const BTreeNodeOps *LookupFixedNodeOps(const NodeMetadata &info);
+
+
+template <SIZE_T KeySize, SIZE_T ValueSize, SIZE_T BlockSize, int Format>
+inline BTreeNodeOps MakeFixedNodeOps()
+{
+  typedef FixedNodeLayout<KeySize,ValueSize,BlockSize,Format> L;
+  BTreeNodeOps o;
+  o.findkey=L::FindKey;
+  o.getptr=L::GetPtr;
+  o.matchkey=L::MatchKey;
+  o.getval=L::GetVal;
+  o.setval=L::SetVal;
+  o.insertleaf=L::InsertLeaf;
+  // the thresholds depend on the split policy, so SetupSplits works
+  // them out once the ops are installed
+  o.leafsplit=0;
+  o.interiorsplit=0;
+  o.fixed=true;
+  return o;
+}
+
+
+//
+// An index whose sizes are fixed at compile time.  It always uses the
+// specialized node code, whether or not the size is one of the common
+// ones, and Attach fails with ERROR_SIZE on an index or disk with
+// different sizes.
+//
+template <SIZE_T KeySize, SIZE_T ValueSize, SIZE_T BlockSize=1024, int Format=BTREE_FORMAT_ROW>
+class BTreeIndexT : public BTreeIndex {
+ public:
+  BTreeIndexT(BufferCache *cache, bool unique=true) :
+    BTreeIndex(KeySize,ValueSize,cache,unique,Format) {}
+
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false)
+  {
+    ERROR_T rc=BTreeIndex::Attach(initblock,create);
+    if (rc) { return rc; }
+    return SetNodeOps(KeySize,ValueSize,BlockSize,Format,
+		      MakeFixedNodeOps<KeySize,ValueSize,BlockSize,Format>());
+  }
+};
+
+#endif
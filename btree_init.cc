@@ -1,10 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "btree.h"
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [INT]\n";
 }
 
 
@@ -13,8 +14,11 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  int keytype=BTREE_KEY_BYTES;
 
-  if (argc!=5) { 
+  if (argc==6 && !strcmp(argv[5],"INT")) { 
+    keytype=BTREE_KEY_INT;
+  } else if (argc!=5) { 
     usage();
     return -1;
   }
@@ -26,7 +30,7 @@ int main(int argc, char **argv)
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,BTREE_FORMAT_ROW,keytype);
   
   ERROR_T rc;
 
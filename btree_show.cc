@@ -40,6 +40,12 @@ int main(int argc, char **argv)
     cerr << "Index attached!"<<endl;
     // Your Implementation should do the right thing here
     cout << btree;
+    BTreeFillStats fill;
+    if ((rc=btree.GetFillStats(fill))!=ERROR_NOERROR) { 
+      cerr << "Can't walk the index due to error "<<rc<<endl;
+    } else {
+      cerr << "Fill statistics:\n" << fill << endl;
+    }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
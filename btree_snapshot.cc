@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+//
+// Check of copy on write snapshots.  The tool builds a new copy on
+// write index on the disk and loads it, and then in each round opens a
+// snapshot, has reader threads scan the snapshot over and over while
+// the main thread inserts, updates and deletes, and checks that the
+// snapshot still holds the pairs it was opened with and that the index
+// holds the new ones.  The snapshot is then closed, and the next write
+// must free the blocks it kept.  At the end every block of the disk
+// must be in the tree or on the free list.
+//
+
+void usage()
+{
+  cerr << "usage: btree_snapshot filestem cachesize keysize numkeys rounds [readers]\n";
+  cerr << "       the disk is overwritten; there are 2 readers by default\n";
+}
+
+
+typedef map<string,string> Pairs;
+
+
+
+static void MakeSnapshotValue(VALUE_T &value, const SIZE_T n)
+{
+  char buf[16];
+
+  snprintf(buf,sizeof(buf),"%08u",n);
+  value.Resize(8,false);
+  memcpy(value.data,buf,8);
+}
+
+
+static string BlockString(const Block &b)
+{
+  return string((const char *)b.data,b.length);
+}
+
+
+static bool CollectPair(const KEY_T &key, const VALUE_T &value, void *arg)
+{
+  (*(Pairs *)arg)[BlockString(key)]=BlockString(value);
+  return true;
+}
+
+
+struct SnapshotReader {
+  const BTreeSnapshot *snapshot;
+  const Pairs         *expected;
+  SIZE_T               keysize;
+  SIZE_T               scans;
+  SIZE_T               errors;
+  pthread_t            thread;
+};
+
+
+static void *RunSnapshotReader(void *arg)
+{
+  SnapshotReader *r=(SnapshotReader *)arg;
+  KEY_T lo, hi;
+
+  EncodeDecimalKey(0,r->keysize,lo);
+  hi.Resize(r->keysize,false);
+  memset(hi.data,'9',r->keysize);
+  for (SIZE_T i=0;i<r->scans;i++) {
+    Pairs found;
+    if (r->snapshot->Scan(lo,hi,CollectPair,&found) || found!=*r->expected) {
+      r->errors++;
+    }
+  }
+  return 0;
+}
+
+
+// Each pair of expected should be in the snapshot or the index, and
+// nothing else
+template <class Reader>
+static SIZE_T CheckPairs(Reader &reader, const Pairs &expected,
+			 const SIZE_T keysize, const SIZE_T numkeys)
+{
+  SIZE_T errors=0;
+  KEY_T key;
+  VALUE_T value;
+
+  for (SIZE_T n=0;n<numkeys;n++) {
+    EncodeDecimalKey(n,keysize,key);
+    Pairs::const_iterator i=expected.find(BlockString(key));
+    ERROR_T rc=reader.Lookup(key,value);
+    if (i==expected.end() ? rc!=ERROR_NONEXISTENT : rc || BlockString(value)!=i->second) {
+      errors++;
+    }
+  }
+  return errors;
+}
+
+
+// Blocks on the free list of the index whose superblock is superblocknum
+static SIZE_T CountFreeBlocks(BufferCache &cache, const SIZE_T superblocknum)
+{
+  BTreeNode node;
+  SIZE_T n=0;
+
+  node.Unserialize(&cache,superblocknum);
+  for (SIZE_T block=node.info.freelist;block;block=node.info.freelist) {
+    node.Unserialize(&cache,block);
+    n++;
+  }
+  return n;
+}
+
+
+static int RunRound(BTreeIndex &btree, Pairs &current, const SIZE_T keysize,
+		    const SIZE_T numkeys, const SIZE_T nreaders, const SIZE_T round)
+{
+  BTreeSnapshot snapshot;
+  vector<SnapshotReader> readers(nreaders);
+  unsigned seed=round+1;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T errors=0;
+  SIZE_T writes=0;
+  SIZE_T scans=0;
+  ERROR_T rc;
+
+  if ((rc=btree.BeginSnapshot(snapshot))!=ERROR_NOERROR) {
+    cerr << "Can't open snapshot due to error "<<rc<<endl;
+    return -1;
+  }
+  const Pairs expected=current;
+
+  for (SIZE_T i=0;i<nreaders;i++) {
+    readers[i].snapshot=&snapshot;
+    readers[i].expected=&expected;
+    readers[i].keysize=keysize;
+    readers[i].scans=4;
+    readers[i].errors=0;
+    pthread_create(&readers[i].thread,0,RunSnapshotReader,&readers[i]);
+  }
+  // change about half the keys while the readers go
+  for (SIZE_T i=0;i<numkeys;i++) {
+    SIZE_T n=rand_r(&seed)%numkeys;
+    EncodeDecimalKey(n,keysize,key);
+    MakeSnapshotValue(value,round*numkeys+i);
+    string k=BlockString(key);
+    bool live=current.find(k)!=current.end();
+    switch (rand_r(&seed)%3) {
+    case 0:
+      rc=btree.Insert(key,value);
+      if (live ? rc!=ERROR_CONFLICT : rc) {
+	errors++;
+      } else if (!live) {
+	current[k]=BlockString(value);
+	writes++;
+      }
+      break;
+    case 1:
+      rc=btree.Update(key,value);
+      if (live ? rc : rc!=ERROR_NONEXISTENT) {
+	errors++;
+      } else if (live) {
+	current[k]=BlockString(value);
+	writes++;
+      }
+      break;
+    case 2:
+      rc=btree.Delete(key);
+      if (live ? rc : rc!=ERROR_NONEXISTENT) {
+	errors++;
+      } else if (live) {
+	current.erase(k);
+	writes++;
+      }
+      break;
+    }
+  }
+  for (SIZE_T i=0;i<nreaders;i++) {
+    pthread_join(readers[i].thread,0);
+    errors+=readers[i].errors;
+    scans+=readers[i].scans;
+  }
+
+  errors+=CheckPairs(snapshot,expected,keysize,numkeys);
+  errors+=CheckPairs(btree,current,keysize,numkeys);
+  SIZE_T retired=btree.GetNumRetiredBlocks();
+  if ((rc=btree.EndSnapshot(snapshot))!=ERROR_NOERROR) {
+    cerr << "Can't close snapshot due to error "<<rc<<endl;
+    return -1;
+  }
+  if (snapshot.IsOpen() || snapshot.Lookup(key,value)!=ERROR_NONEXISTENT) {
+    errors++;
+  }
+
+  // with no snapshot open, the next write frees what the last one kept
+  EncodeDecimalKey(numkeys,keysize,key);
+  MakeSnapshotValue(value,round);
+  if (btree.Insert(key,value) || btree.Delete(key) || btree.GetNumRetiredBlocks()) {
+    errors++;
+  }
+  if ((rc=btree.SanityCheck())!=ERROR_NOERROR) {
+    cerr << "Sanity check failed with error "<<rc<<endl;
+    errors++;
+  }
+
+  cout << "round="<<round
+       << " snapshotkeys="<<expected.size()
+       << " keys="<<current.size()
+       << " writes="<<writes
+       << " scans="<<scans
+       << " retired="<<retired
+       << " errors="<<errors<<endl;
+  return errors ? -1 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc<6 || argc>7) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[1];
+  SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T keysize=atoi(argv[3]);
+  SIZE_T numkeys=atoi(argv[4]);
+  SIZE_T rounds=atoi(argv[5]);
+  SIZE_T nreaders = argc==7 ? atoi(argv[6]) : 2;
+  int result=0;
+
+  if (keysize<8 || keysize>32 || numkeys<1 || rounds<1) {
+    usage();
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,8,&cache);
+  Pairs current;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T superblocknum;
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.SetWriteMode(BTREE_WRITE_COPY))!=ERROR_NOERROR) {
+    cerr << "Can't set write mode due to error "<<rc<<endl;
+    return -1;
+  }
+
+  // every other key to start with
+  for (SIZE_T n=0;n<numkeys;n+=2) {
+    EncodeDecimalKey(n,keysize,key);
+    MakeSnapshotValue(value,n);
+    if ((rc=btree.Insert(key,value))!=ERROR_NOERROR) {
+      cerr << "Can't preload due to error "<<rc<<endl;
+      return -1;
+    }
+    current[BlockString(key)]=BlockString(value);
+  }
+
+  for (SIZE_T r=0;r<rounds;r++) {
+    if (RunRound(btree,current,keysize,numkeys,nreaders,r)) {
+      result=-1;
+    }
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr << "Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  // the superblock, the nodes of the tree and the free list should
+  // account for the whole disk
+  BTreeFillStats stats;
+  if ((rc=btree.Attach(0,false))!=ERROR_NOERROR ||
+      (rc=btree.GetFillStats(stats))!=ERROR_NOERROR ||
+      (rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr << "Can't count nodes due to error "<<rc<<endl;
+    return -1;
+  }
+  SIZE_T nodes=stats.interiornodes+stats.leaves;
+  SIZE_T nfree=CountFreeBlocks(cache,0);
+  SIZE_T lost=cache.GetNumBlocks()-1-nodes-nfree;
+  cout << "blocks="<<cache.GetNumBlocks()
+       << " nodes="<<nodes
+       << " free="<<nfree
+       << " lost="<<lost<<endl;
+  if (lost) {
+    result=-1;
+  }
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr << "Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return result;
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <vector>
+#include "btree.h"
+
+//
+// Multithreaded stress test for an index with latching.  Each round
+// builds a new index on the disk, loads it, and then has 1, 2, 4, ...
+// threads each run a mix of lookups, inserts, updates and deletes on
+// keys of their own, all through the one index and buffer cache.  At
+// the end of a round every thread's keys are looked up again and the
+// tree is checked.  Each thread count is run with latch crabbing, with
+// optimistic lookups, with B-link descents, or with all three.
+//
+
+void usage()
+{
+  cerr << "usage: btree_stress filestem cachesize keysize maxthreads opsperthread [lookuppercent [crabbing|optimistic|blink|all]]\n";
+  cerr << "       the disk is overwritten; lookuppercent is 50 by default, and all modes are run\n";
+}
+
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+
+struct StressThread {
+  BTreeIndex    *btree;
+  SIZE_T         id;
+  SIZE_T         nthreads;
+  SIZE_T         ops;
+  SIZE_T         keysize;
+  SIZE_T         lookuppercent;
+  vector<SIZE_T> live;      // key numbers this thread has in the index
+  SIZE_T         errors;
+  SIZE_T         restarts;  // optimistic lookups that started over
+  pthread_t      thread;
+};
+
+
+// Thread id owns the key numbers k*nthreads+id
+static void *RunStressThread(void *arg)
+{
+  StressThread *t=(StressThread *)arg;
+  unsigned seed=t->id+1;
+  SIZE_T next=0;
+  KEY_T key;
+  VALUE_T value("valuexxx");
+  VALUE_T found;
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<t->ops;i++) {
+    SIZE_T r=rand_r(&seed)%100;
+    if (r<t->lookuppercent && !t->live.empty()) {
+      EncodeDecimalKey(t->live[rand_r(&seed)%t->live.size()],t->keysize,key);
+      if (t->btree->Lookup(key,found)) {
+	t->errors++;
+      }
+      continue;
+    }
+    // otherwise two inserts for each update and each delete
+    switch (t->live.empty() ? 0 : rand_r(&seed)%4) {
+    case 0:
+    case 1: {
+      // scatter the thread's keys over its key numbers
+      SIZE_T n=((next++)*7919)%t->ops;
+      EncodeDecimalKey(n*t->nthreads+t->id,t->keysize,key);
+      rc=t->btree->Insert(key,value);
+      if (rc==ERROR_NOERROR) {
+	t->live.push_back(n*t->nthreads+t->id);
+      } else if (rc!=ERROR_CONFLICT) {
+	t->errors++;
+      }
+      break;
+    }
+    case 2:
+      EncodeDecimalKey(t->live[rand_r(&seed)%t->live.size()],t->keysize,key);
+      if (t->btree->Update(key,VALUE_T("updatedx"))) {
+	t->errors++;
+      }
+      break;
+    case 3: {
+      SIZE_T j=rand_r(&seed)%t->live.size();
+      EncodeDecimalKey(t->live[j],t->keysize,key);
+      if (t->btree->Delete(key)) {
+	t->errors++;
+      }
+      t->live[j]=t->live.back();
+      t->live.pop_back();
+      break;
+    }
+    }
+  }
+  t->restarts=BTreeIndex::GetNumRestarts();
+  return 0;
+}
+
+
+static int RunRound(char *filestem, const SIZE_T cachesize, const SIZE_T keysize,
+		    const int mode, const SIZE_T nthreads, const SIZE_T ops,
+		    const SIZE_T lookuppercent, double &rate)
+{
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,8,&cache);
+  vector<StressThread> threads(nthreads);
+  KEY_T key;
+  SIZE_T superblocknum;
+  SIZE_T errors=0;
+  SIZE_T restarts=0;
+  SIZE_T keys=0;
+  ERROR_T rc;
+
+  rate=0;
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.SetLatchMode(mode))!=ERROR_NOERROR) {
+    cerr << "Can't set latch mode due to error "<<rc<<endl;
+    return -1;
+  }
+
+  // a tree a few levels deep to start with, from key numbers no
+  // thread uses
+  for (SIZE_T i=0;i<ops;i++) {
+    EncodeDecimalKey(nthreads*ops+(i*7919)%ops,keysize,key);
+    if ((rc=btree.Insert(key,VALUE_T("preloadx")))!=ERROR_NOERROR) {
+      cerr << "Can't preload due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  SIZE_T latches=cache.GetNumLatches();
+  SIZE_T waits=cache.GetNumLatchWaits();
+  double start=now();
+  for (SIZE_T i=0;i<nthreads;i++) {
+    threads[i].btree=&btree;
+    threads[i].id=i;
+    threads[i].nthreads=nthreads;
+    threads[i].ops=ops;
+    threads[i].keysize=keysize;
+    threads[i].lookuppercent=lookuppercent;
+    threads[i].errors=0;
+    pthread_create(&threads[i].thread,0,RunStressThread,&threads[i]);
+  }
+  for (SIZE_T i=0;i<nthreads;i++) {
+    pthread_join(threads[i].thread,0);
+  }
+  double elapsed=now()-start;
+  latches=cache.GetNumLatches()-latches;
+  waits=cache.GetNumLatchWaits()-waits;
+
+  // everything each thread left should be there; a B-link tree stays
+  // one so that its links are checked too
+  if (mode!=BTREE_LATCH_BLINK) {
+    btree.SetLatchMode(BTREE_LATCH_NONE);
+  }
+  for (SIZE_T i=0;i<nthreads;i++) {
+    errors+=threads[i].errors;
+    restarts+=threads[i].restarts;
+    for (SIZE_T j=0;j<threads[i].live.size();j++) {
+      VALUE_T value;
+      EncodeDecimalKey(threads[i].live[j],keysize,key);
+      if (btree.Lookup(key,value)) {
+	errors++;
+      }
+    }
+    keys+=threads[i].live.size();
+  }
+  if ((rc=btree.SanityCheck())!=ERROR_NOERROR) {
+    cerr << "Sanity check failed with error "<<rc<<endl;
+    errors++;
+  }
+
+  rate=nthreads*ops/elapsed;
+  cout << (mode==BTREE_LATCH_OPTIMISTIC ? "optimistic " :
+	   mode==BTREE_LATCH_BLINK ? "blink      " : "crabbing   ")
+       << "threads="<<nthreads
+       << " ops/s="<<(SIZE_T)rate
+       << " keys="<<keys+ops
+       << " latches/op="<<(double)latches/(nthreads*ops)
+       << " latchwaits="<<waits
+       << " ("<<(latches ? 100.0*waits/latches : 0)<<"%)"
+       << " restarts="<<restarts
+       << " errors="<<errors;
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr << "Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr << "Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return errors ? -1 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc<6 || argc>8) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[1];
+  SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T keysize=atoi(argv[3]);
+  SIZE_T maxthreads=atoi(argv[4]);
+  SIZE_T ops=atoi(argv[5]);
+  SIZE_T lookuppercent = argc>=7 ? atoi(argv[6]) : 50;
+  const char *which = argc==8 ? argv[7] : "all";
+  vector<int> modes;
+  int result=0;
+
+  if (!strcmp(which,"crabbing") || !strcmp(which,"all")) {
+    modes.push_back(BTREE_LATCH_CRABBING);
+  }
+  if (!strcmp(which,"optimistic") || !strcmp(which,"all")) {
+    modes.push_back(BTREE_LATCH_OPTIMISTIC);
+  }
+  if (!strcmp(which,"blink") || !strcmp(which,"all")) {
+    modes.push_back(BTREE_LATCH_BLINK);
+  }
+  if (keysize<8 || keysize>32 || maxthreads<1 || ops<1 || lookuppercent>100 || modes.empty()) {
+    usage();
+    return -1;
+  }
+
+  vector<double> base(modes.size());
+  for (SIZE_T n=1;;n*=2) {
+    if (n>maxthreads) {
+      n=maxthreads;
+    }
+    for (SIZE_T m=0;m<modes.size();m++) {
+      double rate;
+      if (RunRound(filestem,cachesize,keysize,modes[m],n,ops,lookuppercent,rate)) {
+	// no speedup from a failed round; end its line if it printed one
+	result=-1;
+	if (rate) {
+	  cout << endl;
+	}
+	continue;
+      }
+      if (n==1) {
+	base[m]=rate;
+      }
+      if (base[m]) {
+	cout << " speedup="<<rate/base[m];
+      }
+      cout << endl;
+    }
+    if (n==maxthreads) {
+      break;
+    }
+  }
+  return result;
+}
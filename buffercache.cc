@@ -1,43 +1,193 @@
+#include <string.h>
+#include <algorithm>
+
 #include "buffercache.h"
 
+// Holds the cache's lock for the rest of the scope
+class CacheLock {
+ private:
+  pthread_mutex_t &m;
+ public:
+  CacheLock(pthread_mutex_t &mutex) : m(mutex) { pthread_mutex_lock(&m); }
+  ~CacheLock() { pthread_mutex_unlock(&m); }
+};
+
+
+thread_local string BufferCache::logrecord;
+thread_local vector<SIZE_T> BufferCache::logblocks;
+
+
+bool BufferCache::IsPinned(const SIZE_T blocknum) const
+{
+  return (!latches.empty() && latches.find(blocknum)!=latches.end()) ||
+    (!uncommitted.empty() && uncommitted.find(blocknum)!=uncommitted.end());
+}
+
+// Write a dirty block to disk, once the log has its last change
+ERROR_T BufferCache::WriteBack(const SIZE_T blocknum, const Block &block)
+{
+  if (logging) {
+    map<SIZE_T, LSN_T>::iterator l=blocklsns.find(blocknum);
+    if (l!=blocklsns.end()) {
+      int rc=log->Force(l->second);
+      if (rc!=ERROR_NOERROR) {
+	return rc;
+      }
+      blocklsns.erase(l);
+    }
+  }
+
+  double reqtime;
+  int rc=disk->Write(blocknum,
+		     block,
+		     reqtime);
+  curtime+=reqtime;
+  diskwrites++;
+  return rc;
+}
+
+// Add the bytes that changed to the thread's log record; a block that
+// was not in the cache is logged whole
+void BufferCache::LogWrite(const SIZE_T blocknum, const Block *oldblock, const Block &newblock)
+{
+  SIZE_T first=0;
+  SIZE_T last=newblock.length;
+
+  if (oldblock && oldblock->length==newblock.length) {
+    while (first<last && oldblock->data[first]==newblock.data[first]) {
+      first++;
+    }
+    while (last>first && oldblock->data[last-1]==newblock.data[last-1]) {
+      last--;
+    }
+    if (first==last) {
+      return;
+    }
+  }
+
+  SIZE_T entry[3] = { blocknum, first, last-first };
+  logrecord.append((const char *)entry,sizeof(entry));
+  logrecord.append((const char *)newblock.data+first,last-first);
+  if (find(logblocks.begin(),logblocks.end(),blocknum)==logblocks.end()) {
+    logblocks.push_back(blocknum);
+    uncommitted[blocknum]++;
+  }
+}
+
+// Redo every whole record in the log, oldest first.  Each change is
+// the block's new bytes, so a change that already reached the disk
+// does no harm done again.
+ERROR_T BufferCache::Recover()
+{
+  RedoLog old(disk->GetLogName());
+  vector<string> records;
+  map<SIZE_T, Block> blocks;
+  const SIZE_T header=3*sizeof(SIZE_T);
+  double reqtime;
+  int rc;
+
+  rc=old.ReadRecords(records);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  for (SIZE_T r=0;r<records.size();r++) {
+    const string &rec=records[r];
+    for (size_t off=0; off<rec.size(); ) {
+      SIZE_T entry[3];
+      if (off+header>rec.size()) {
+	return ERROR_INSANE;
+      }
+      memcpy(entry,rec.data()+off,header);
+      if (entry[0]>=GetNumBlocks() || entry[1]>GetBlockSize() ||
+	  entry[2]>GetBlockSize()-entry[1] || entry[2]>rec.size()-off-header) {
+	return ERROR_INSANE;
+      }
+      map<SIZE_T, Block>::iterator b=blocks.find(entry[0]);
+      if (b==blocks.end()) {
+	Block block;
+	rc=disk->Read(entry[0],block,reqtime);
+	curtime+=reqtime;
+	diskreads++;
+	if (rc!=ERROR_NOERROR) {
+	  return rc;
+	}
+	b=blocks.insert(make_pair(entry[0],block)).first;
+      }
+      memcpy(b->second.data+entry[1],rec.data()+off+header,entry[2]);
+      off+=header+entry[2];
+    }
+  }
+  for (map<SIZE_T, Block>::iterator b=blocks.begin(); b!=blocks.end(); ++b) {
+    rc=disk->Write(b->first,b->second,reqtime);
+    curtime+=reqtime;
+    diskwrites++;
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+  replayed+=records.size();
+  // the log can go once the disk has what it said
+  if (!blocks.empty() && (rc=disk->Sync())!=ERROR_NOERROR) {
+    return rc;
+  }
+  return old.Remove();
+}
+
+// Forcing the log for a dirty block is done without the lock, so the
+// cache may change meanwhile, and the oldest block is then looked for
+// again
 ERROR_T BufferCache::CheckDeleteOldest()
 {
   // In a real buffer cache, we would use a priority queue to make this O(1)
 
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
-  double oldest = curtime+1;
-
   // Only delete if the cache is full
-  if (blockmap.size() < cachesize) {
-    return ERROR_NOERROR;
-  }
+  while (blockmap.size() >= cachesize) {
+    map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
+    double oldest = curtime+1;
 
-  // Find oldest
+    // Find oldest
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+    for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
-	 oldestptr=i;
-	 oldest=(*i).second.lastaccessed;
-       }
-  }
-  
-  // write and delete it if it exists
- 
-  if (oldestptr!=blockmap.end()) { 
+      if ((*i).second.lastaccessed<oldest && !IsPinned((*i).first)) { 
+	oldestptr=i;
+	oldest=(*i).second.lastaccessed;
+      }
+    }
+    if (oldestptr==blockmap.end()) { 
+      return ERROR_NOERROR;
+    }
+
+    if ((*oldestptr).second.dirty && logging) { 
+      SIZE_T blocknum=(*oldestptr).first;
+      map<SIZE_T, LSN_T>::iterator l=blocklsns.find(blocknum);
+      if (l!=blocklsns.end()) { 
+	LSN_T lsn=l->second;
+	pthread_mutex_unlock(&lock);
+	int rc=log->Force(lsn);
+	pthread_mutex_lock(&lock);
+	if (rc!=ERROR_NOERROR) { 
+	  return rc;
+	}
+	// unless the block changed again, it can now go straight out
+	l=blocklsns.find(blocknum);
+	if (l!=blocklsns.end() && l->second==lsn) { 
+	  blocklsns.erase(l);
+	}
+	continue;
+      }
+    }
+
+    // write and delete it
     if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      int rc=WriteBack((*oldestptr).first,(*oldestptr).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
     blockmap.erase(oldestptr);
+    return ERROR_NOERROR;
   }
   return ERROR_NOERROR;
 }
@@ -46,8 +196,12 @@ BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
    disk(d), cachesize(cs), curtime(0),
    allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
-{}
+   diskreads(0), diskwrites(0), prefetches(0),
+   latchcount(0), latchwaits(0),
+   log(0), logging(false), replayed(0)
+{
+  pthread_mutex_init(&lock,0);
+}
 
 
 BufferCache::~BufferCache()
@@ -55,39 +209,131 @@ BufferCache::~BufferCache()
   if (disk) { 
     Detach();
   }
+  delete log;
   disk=0; cachesize=0; curtime=0;
+  pthread_mutex_destroy(&lock);
 }
 
 ERROR_T BufferCache::Attach()
 {
+  CacheLock l(lock);
+
   blockmap.clear();
-  return ERROR_NOERROR;
+  return Recover();
 }
 
 ERROR_T BufferCache::Detach()
 {
+  CacheLock l(lock);
+
   // write out all of our data and then throw it away
 
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
     if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      int rc=WriteBack((*i).first,(*i).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
   }
   blockmap.clear();
+
+  if (logging) { 
+    // everything is on the disk, so there is nothing left to redo
+    int rc=disk->Sync();
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    logging=false;
+    blocklsns.clear();
+    uncommitted.clear();
+    logrecord.clear();
+    logblocks.clear();
+    return log->Remove();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::StartLog(const SIZE_T groupsize, const SIZE_T groupwait)
+{
+  CacheLock l(lock);
+
+  if (!log) { 
+    log=new RedoLog(disk->GetLogName());
+  }
+  log->SetGroupCommit(groupsize,groupwait);
+  if (logging) { 
+    return ERROR_NOERROR;
+  }
+
+  // the log starts from what is on the disk
+  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+	 i!=blockmap.end();
+	 ++i) {
+    if ((*i).second.dirty) { 
+      int rc=WriteBack((*i).first,(*i).second);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+      (*i).second.dirty=false;
+    }
+  }
+  int rc=disk->Sync();
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  rc=log->Create();
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  logrecord.clear();
+  logblocks.clear();
+  logging=true;
   return ERROR_NOERROR;
 }
 
 
+ERROR_T BufferCache::Commit(LSN_T &lsn)
+{
+  CacheLock l(lock);
+  int rc=ERROR_NOERROR;
+
+  lsn=0;
+  if (logging && !logrecord.empty()) { 
+    rc=log->Append(logrecord,lsn);
+  }
+  for (SIZE_T i=0;i<logblocks.size();i++) { 
+    if (lsn) { 
+      blocklsns[logblocks[i]]=lsn;
+    }
+    map<SIZE_T, SIZE_T>::iterator u=uncommitted.find(logblocks[i]);
+    if (u!=uncommitted.end() && --u->second==0) { 
+      uncommitted.erase(u);
+    }
+  }
+  logrecord.clear();
+  logblocks.clear();
+  return rc;
+}
+
+
+ERROR_T BufferCache::WaitForCommit(const LSN_T lsn)
+{
+  if (!lsn) { 
+    return ERROR_NOERROR;
+  }
+  return log->Force(lsn,true);
+}
+
+
+bool BufferCache::IsLogging() const
+{
+  return logging;
+}
+
 SIZE_T BufferCache::GetCacheSize() const
 {
   return cachesize;
@@ -111,12 +357,16 @@ double BufferCache::GetCurrentTime() const
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  CacheLock l(lock);
+
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  CacheLock l(lock);
+
   deallocs++;
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
@@ -124,16 +374,26 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  CacheLock l(lock);
+
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
+  CacheLock l(lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
   b = blockmap.find(inblocknum);
 
+  if (b==blockmap.end()) { 
+    // It's not in cache, so time to allocate it.  Making room may let
+    // another thread bring it in.
+    CheckDeleteOldest();
+    b = blockmap.find(inblocknum);
+  }
+
   if (b!=blockmap.end()) {
     // It's in  cache, just update its lastaccessed and return it
     outblock=(*b).second;
@@ -141,8 +401,6 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
     reads++;
     return ERROR_NOERROR;
   } else {
-    // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
     // read it from disk
     if (!(disk->IsBlockAllocated(inblocknum))) { 
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
@@ -169,25 +427,34 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
  
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
+  CacheLock l(lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(inblocknum);
 
   if (b!=blockmap.end()) {
     // It's in  cache, so just replace the block
+    if (logging) { 
+      LogWrite(inblocknum,&(*b).second,inblock);
+    }
     (*b).second=inblock;
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
     writes++;
     return ERROR_NOERROR;
   } else {
-    // It's not in cache, so time to allocate it
+    // It's not in cache, so time to allocate it.  A copy another
+    // thread brings in while room is made is replaced, and the write
+    // logged whole.
     CheckDeleteOldest();
     if (!(disk->IsBlockAllocated(inblocknum))) { 
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
 	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
+    if (logging) { 
+      LogWrite(inblocknum,0,inblock);
+    }
     Block myblock=inblock;
     myblock.lastaccessed=curtime;
     myblock.dirty=true;
@@ -197,29 +464,109 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
   }
 }
   
+ERROR_T BufferCache::WriteBlocks(const SIZE_T first, const vector<Block> &blocks)
+{
+  CacheLock l(lock);
+  for (SIZE_T i=0;i<blocks.size();i++) { 
+    if (blocks[i].length!=GetBlockSize()) { 
+      return ERROR_WRONGSIZEBLOCK;
+    }
+    // the disk copy is about to be newer than any cached one
+    blockmap.erase(first+i);
+  }
+  if (logging) { 
+    // logged whole, ahead of the disk, as a record of their own
+    string record;
+    LSN_T lsn;
+    for (SIZE_T i=0;i<blocks.size();i++) { 
+      SIZE_T entry[3] = { first+i, 0, blocks[i].length };
+      record.append((const char *)entry,sizeof(entry));
+      record.append((const char *)blocks[i].data,blocks[i].length);
+      blocklsns.erase(first+i);
+    }
+    int rc=log->Append(record,lsn);
+    if (rc==ERROR_NOERROR) { 
+      rc=log->Force(lsn);
+    }
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  double reqtime;
+  int rc=disk->Write(first,
+		     blocks.size(),
+		     blocks,
+		     reqtime);
+  curtime+=reqtime;
+  writes+=blocks.size();
+  diskwrites+=blocks.size();
+  return rc;
+}
+
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  CacheLock l(lock);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b!=blockmap.end()) {
+    // Already here; a prefetch is not an access, so leave it alone
+    return ERROR_NOERROR;
+  }
+
+  // Make room only by dropping a clean block, since a speculative
+  // read should never cost a write
+  if (blockmap.size() >= cachesize) {
+    map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
+    double oldest = curtime+1;
+    for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+	 i!=blockmap.end();
+	 ++i) {
+      if ((*i).second.lastaccessed<oldest && !IsPinned((*i).first)) { 
+	oldestptr=i;
+	oldest=(*i).second.lastaccessed;
+      }
+    }
+    if (oldestptr==blockmap.end() || (*oldestptr).second.dirty) { 
+      return ERROR_NOFETCH;
+    }
+    blockmap.erase(oldestptr);
+  }
+
+  Block block;
+  double reqtime;
+  int rc = disk->Read(blocknum,
+		      block,
+		      reqtime);
+  curtime+=reqtime;
+  diskreads++;
+  prefetches++;
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  block.lastaccessed=curtime;
+  block.dirty=false;
+  blockmap[blocknum]=block;
+  return ERROR_NOERROR;
 }
   
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
+  CacheLock l(lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(blocknum);
 
   if (b==blockmap.end()) { 
     return ERROR_NOERROR;
+  } else if (uncommitted.find(blocknum)!=uncommitted.end()) { 
+    // its writes are not in the log yet
+    return ERROR_CONFLICT;
   } else {
     if ((*b).second.dirty) { 
-      double reqtime;
-      int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+      int rc=WriteBack((*b).first,(*b).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
@@ -229,6 +576,54 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
   }
 }
   
+ERROR_T BufferCache::LatchBlock(const SIZE_T blocknum, const bool exclusive)
+{
+  Latch *latch;
+  int rc;
+
+  {
+    CacheLock l(lock);
+    map<SIZE_T, Latch *>::iterator i=latches.find(blocknum);
+    if (i==latches.end()) { 
+      latch=new Latch;
+      pthread_rwlock_init(&latch->rw,0);
+      latch->pins=0;
+      latches[blocknum]=latch;
+    } else {
+      latch=i->second;
+    }
+    latch->pins++;
+    latchcount++;
+  }
+
+  rc = exclusive ? pthread_rwlock_trywrlock(&latch->rw) : pthread_rwlock_tryrdlock(&latch->rw);
+  if (rc) { 
+    {
+      CacheLock l(lock);
+      latchwaits++;
+    }
+    rc = exclusive ? pthread_rwlock_wrlock(&latch->rw) : pthread_rwlock_rdlock(&latch->rw);
+  }
+  return rc ? ERROR_GENERAL : ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UnlatchBlock(const SIZE_T blocknum)
+{
+  CacheLock l(lock);
+  map<SIZE_T, Latch *>::iterator i=latches.find(blocknum);
+
+  if (i==latches.end()) { 
+    return ERROR_NONEXISTENT;
+  }
+  pthread_rwlock_unlock(&i->second->rw);
+  if (--i->second->pins==0) { 
+    pthread_rwlock_destroy(&i->second->rw);
+    delete i->second;
+    latches.erase(i);
+  }
+  return ERROR_NOERROR;
+}
+  
 ostream & BufferCache::Print(ostream &os) const
 {
   os << "BufferCache(cachesize="<<cachesize
@@ -240,6 +635,7 @@ ostream & BufferCache::Print(ostream &os) const
      << ", writes="<<writes
      << ", diskreads="<<diskreads
      << ", diskwrites="<<diskwrites
+     << ", prefetches="<<prefetches
      << ", blocks = {";
 
   
@@ -3,10 +3,14 @@
 
 #include <iostream>
 #include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "redolog.h"
 
 using namespace std;
 
@@ -22,15 +26,46 @@ struct cache_compare_lessthan {
 //
 // Write Back
 // Write Allocate
+//
+// All of the calls may be made from many threads at once.  Each block
+// also has a reader/writer latch for the index to take while it works
+// on the block; a latched block is pinned in the cache.
+//
+// With a redo log, each write is logged as the bytes of the block that
+// it changed, and a thread's writes become one record when it commits.
+// Until then its blocks are pinned too (no steal), and a block is only
+// written back once the log is on disk up to its last change (write
+// ahead logging), so that after a crash the log brings the disk up to
+// the last commit.
+//
 class BufferCache {
  private:
+  struct Latch { 
+    pthread_rwlock_t rw;
+    SIZE_T pins;    // holders and waiters
+  };
+
   DiskSystem *disk;
   SIZE_T cachesize;
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
+  map<SIZE_T, Latch *> latches;
+  pthread_mutex_t lock;
   double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites, prefetches;
+  SIZE_T latchcount, latchwaits;
+  RedoLog *log;
+  bool logging;
+  map<SIZE_T, LSN_T> blocklsns;      // dirty blocks, and the record that last changed each
+  map<SIZE_T, SIZE_T> uncommitted;   // blocks with writes not yet logged, and by how many threads
+  SIZE_T replayed;
+  static thread_local string logrecord;        // this thread's writes since it last committed
+  static thread_local vector<SIZE_T> logblocks;  // and the blocks they were to
  protected:
   ERROR_T CheckDeleteOldest();
+  bool IsPinned(const SIZE_T blocknum) const;
+  ERROR_T WriteBack(const SIZE_T blocknum, const Block &block);
+  void LogWrite(const SIZE_T blocknum, const Block *oldblock, const Block &newblock);
+  ERROR_T Recover();
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -42,9 +77,23 @@ class BufferCache {
 
   // Call Attach before your first read or write
   // Call Detach after your last read or write
+  // Attach first replays any redo log left by a crash
   ERROR_T Attach();
   ERROR_T Detach();
 
+  // Keep a redo log from now on, in the disk's "filestem.log".  The
+  // dirty blocks are written back first.  A commit waits up to
+  // groupwait microseconds for groupsize commits to share its flush.
+  ERROR_T StartLog(const SIZE_T groupsize=1, const SIZE_T groupwait=1000);
+  // Make the calling thread's writes since it last committed one log
+  // record, which ends at lsn (0 if there was nothing to log).  The
+  // order of the commits is the order the records are redone in.
+  ERROR_T Commit(LSN_T &lsn);
+  // Wait until the record is on disk
+  ERROR_T WaitForCommit(const LSN_T lsn);
+  // True once StartLog has been called
+  bool IsLogging() const;
+
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
   // Number of bytes per block
@@ -71,6 +120,10 @@ class BufferCache {
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
   
+  // Write consecutive blocks first, first+1, ... to disk as a single
+  // request, bypassing the cache (any cached copies are dropped)
+  ERROR_T WriteBlocks(const SIZE_T first, const vector<Block> &blocks);
+
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
@@ -80,6 +133,13 @@ class BufferCache {
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+
+  // Latch a block, shared or exclusive, waiting for it if need be.
+  // The block is not evicted until the last latch on it is released
+  // (if every block is latched, the cache grows past its size).
+  // Latches are not recursive: a thread must not latch a block twice.
+  ERROR_T LatchBlock(const SIZE_T blocknum, const bool exclusive);
+  ERROR_T UnlatchBlock(const SIZE_T blocknum);
   
  
   SIZE_T GetNumAllocs() const { return allocs; }
@@ -88,6 +148,20 @@ class BufferCache {
   SIZE_T GetNumWrites() const { return writes;}
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  SIZE_T GetNumPrefetches() const { return prefetches;}
+  // Latches taken, and how many of those had to wait for another thread
+  SIZE_T GetNumLatches() const { return latchcount;}
+  SIZE_T GetNumLatchWaits() const { return latchwaits;}
+  // Log records and bytes, the flushes they took, and the commits
+  // and the seconds they waited (in all, and at most)
+  SIZE_T GetNumLogRecords() const { return log ? log->GetNumRecords() : 0; }
+  LSN_T  GetNumLogBytes() const { return log ? log->GetNumBytes() : 0; }
+  SIZE_T GetNumLogFlushes() const { return log ? log->GetNumFlushes() : 0; }
+  SIZE_T GetNumCommits() const { return log ? log->GetNumCommits() : 0; }
+  double GetCommitTime() const { return log ? log->GetCommitTime() : 0; }
+  double GetMaxCommitTime() const { return log ? log->GetMaxCommitTime() : 0; }
+  // Log records redone by Attach
+  SIZE_T GetNumReplayed() const { return replayed; }
 
   ostream & Print(ostream &os) const;
   
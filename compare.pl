@@ -15,25 +15,29 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
   $ref=<REF>; chomp($ref);
   $test=<TEST>; chomp($test);
   
-  if ($cmd =~ /DISPLAY/) { 
-    # DISPLAY is a special case since it
-    # spans multiple output lines, each of which needs to be checked.
+  if ($cmd =~ /^(DISPLAY|SCAN|RSCAN)/) { 
+    # DISPLAY, SCAN and RSCAN are special cases since they
+    # span multiple output lines, each of which needs to be checked.
     # it must be the case that both implementations found this was OK.
 
-    undef %refcontent if defined(%refcontent);
+    %refcontent=();
+    @reforder=();
     while (1) {
       $disp=<REF>; chomp($disp);
-      last if $disp=~/END DISPLAY/;
+      last if $disp=~/END (DISPLAY|SCAN|RSCAN)/;
       $disp=~/\((\S+)\s*,\s*(\S+)\)/;
       $refcontent{$1}=$2;
+      push @reforder, $1;
     }
       
-    undef %testcontent if defined(%testcontent);
+    %testcontent=();
+    @testorder=();
     while (1) {
       $disp=<TEST>; chomp($disp);
-      last if $disp=~/END DISPLAY/;
+      last if $disp=~/END (DISPLAY|SCAN|RSCAN)/;
       $disp=~/\((\S+)\s*,\s*(\S+)\)/;
       $testcontent{$1}=$2;
+      push @testorder, $1;
     }
     
     @refkeys = sort keys %refcontent;
@@ -72,6 +76,16 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
 	}
       }
     }
+    if (!$sawerror && $cmd =~ /^RSCAN/ && "@reforder" ne "@testorder") { 
+      # the pairs of a reverse scan must also come in the same order
+      print "----------------------------------------------------------------------------\n";
+      print "ERROR $numerr found on operation $i\n\n";
+      print "Operation is \"$cmd\"\n\n";
+      print "Reference implementation has keys in order @reforder\n";
+      print "Test implementation has keys in order      @testorder\n";
+      print "----------------------------------------------------------------------------\n";
+      $sawerror=1;
+    }
     $numerr++ if $sawerror;
   } else {
     if ($ref ne $test) { 
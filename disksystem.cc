@@ -238,6 +238,8 @@ ERROR_T DiskSystem::InitFromConfigFile()
   string configname = diskfilestem + ".config";
   string dataname = diskfilestem + ".data";
   string bitmapname = diskfilestem + ".bitmap";
+
+  logname = diskfilestem + ".log";
   
   if (configfilefd) { fclose(configfilefd); }
   
@@ -286,6 +288,8 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   string dataname = diskfilestem + ".data";
   string bitmapname = diskfilestem + ".bitmap";
 
+  logname = diskfilestem + ".log";
+
   int rc=SanityCheckConfig();
 
   if (rc) { 
@@ -515,6 +519,25 @@ SIZE_T DiskSystem::GetNumBlocks() const
   return numblocks;
 }
 
+string DiskSystem::GetLogName() const
+{
+  return logname;
+}
+
+ERROR_T DiskSystem::Sync()
+{
+  ERROR_T rc=WriteBitMap();
+
+  if (rc) {
+    return rc;
+  }
+  if (fflush(datafilefd) || fsync(fileno(datafilefd)) ||
+      fflush(bitmapfilefd) || fsync(fileno(bitmapfilefd))) {
+    return ERROR_GENERAL;
+  }
+  return ERROR_NOERROR;
+}
+
 
 
 #define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
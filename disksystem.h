@@ -27,6 +27,7 @@ class DiskSystem {
   //
 
   string diskfilestem;
+  string logname;
   SIZE_T offset;
   SIZE_T numblocks;
   SIZE_T blocksize;
@@ -56,6 +57,7 @@ class DiskSystem {
  public:
   // The data is stored in file "filestem.data"
   // The config is stored in file "filestem.config"
+  // A redo log, if one is kept, is in file "filestem.log"
 
   DiskSystem(const string &filestem,
 	     const bool create=false,
@@ -96,6 +98,10 @@ class DiskSystem {
 
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
+  string GetLogName() const;
+
+  // Wait until everything written so far, and the bitmap, is on disk
+  ERROR_T Sync();
 
   //
   // These are notification functions that should be called when
@@ -13,14 +13,15 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 INSERT_EXISTS => \&gen_insert_exists,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
-#
-# No deletes required this quarter
-# 
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
+	 DELETE_NEW => \&gen_delete_new,
+	 DELETE_EXISTS => \&gen_delete_exists,
 	 LOOKUP_NEW => \&gen_lookup_new,
 	 LOOKUP_EXISTS => \&gen_lookup_exists,
-	 DISPLAY => \&gen_display
+	 MLOOKUP => \&gen_mlookup,
+	 MINSERT => \&gen_minsert,
+	 DISPLAY => \&gen_display,
+	 SCAN => \&gen_scan,
+	 RSCAN => \&gen_rscan
        );
 
 @opnames=keys %ops;
@@ -103,6 +104,34 @@ sub gen_lookup_exists {
   return "LOOKUP $key  # should succeed and return $content{$key}";
 }
 
+sub gen_mlookup {
+  my @keys = map { (keys %content) && rand(1)<0.5 ? MakeExistentKey() : MakeNonExistentKey() } (1..(2+int(rand(7))));
+  return "MLOOKUP @keys  # should succeed, with a value or FAIL for each key";
+}
+
+sub gen_minsert {
+  my @pairs;
+  for (1..(2+int(rand(7)))) {
+    my $key = (keys %content) && rand(1)<0.5 ? MakeExistentKey() : MakeNonExistentKey();
+    my $value = MakeValue();
+    $content{$key}=$value if !defined $content{$key};
+    push @pairs, "$key $value";
+  }
+  return "MINSERT @pairs  # should succeed, with OK or FAIL for each pair";
+}
+
 sub gen_display {
   return "DISPLAY  # should always succeed";
 }
+
+sub gen_scan {
+  my ($lo, $hi) = (MakeKey(), MakeKey());
+  ($lo, $hi) = ($hi, $lo) if $lo gt $hi;
+  return "SCAN $lo $hi  # should always succeed";
+}
+
+sub gen_rscan {
+  my ($lo, $hi) = (MakeKey(), MakeKey());
+  ($lo, $hi) = ($hi, $lo) if $lo gt $hi;
+  return "RSCAN $lo $hi  # should always succeed";
+}
@@ -0,0 +1,170 @@
+#include "keyprefix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+
+PREFIX_T MakeKeyPrefix(const BYTE_T *key, const SIZE_T keysize)
+{
+  PREFIX_T p=0;
+
+  for (SIZE_T i=0;i<sizeof(PREFIX_T);i++) {
+    p<<=8;
+    if (i<keysize) {
+      p|=key[i];
+    }
+  }
+  return p;
+}
+
+
+//
+// The search narrows [lo,hi) by binary search until the window is
+// small, and then counts the window, 4 (SSE2) or 8 (AVX2) prefixes per
+// compare.  The vector compares are signed, so both sides are biased
+// by flipping the sign bit.  Because the array is sorted, the first
+// group with a lane that is not below q ends the count.
+//
+#define PREFIX_WINDOW 32
+
+typedef SIZE_T (*COUNT_FN)(const PREFIX_T *p, const SIZE_T n, const PREFIX_T q);
+
+static SIZE_T CountScalar(const PREFIX_T *p, const SIZE_T n, const PREFIX_T q)
+{
+  SIZE_T i;
+  for (i=0;i<n && p[i]<q;i++) {
+  }
+  return i;
+}
+
+#if HAVE_X86_SIMD
+
+static SIZE_T CountSSE2(const PREFIX_T *p, const SIZE_T n, const PREFIX_T q)
+{
+  const __m128i bias=_mm_set1_epi32((int)0x80000000);
+  const __m128i qv=_mm_xor_si128(_mm_set1_epi32((int)q),bias);
+  SIZE_T i;
+
+  for (i=0;i+4<=n;i+=4) {
+    __m128i v=_mm_xor_si128(_mm_loadu_si128((const __m128i *)(p+i)),bias);
+    int m=_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(qv,v)));
+    if (m!=0xf) {
+      return i+__builtin_popcount(m);
+    }
+  }
+  return i+CountScalar(p+i,n-i,q);
+}
+
+__attribute__((target("avx2")))
+static SIZE_T CountAVX2(const PREFIX_T *p, const SIZE_T n, const PREFIX_T q)
+{
+  const __m256i bias=_mm256_set1_epi32((int)0x80000000);
+  const __m256i qv=_mm256_xor_si256(_mm256_set1_epi32((int)q),bias);
+  SIZE_T i;
+
+  for (i=0;i+8<=n;i+=8) {
+    __m256i v=_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p+i)),bias);
+    int m=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(qv,v)));
+    if (m!=0xff) {
+      return i+__builtin_popcount(m);
+    }
+  }
+  return i+CountScalar(p+i,n-i,q);
+}
+
+#endif
+
+
+static bool Supported(const int impl)
+{
+  switch (impl) {
+  case PREFIX_SEARCH_SCALAR:
+    return true;
+#if HAVE_X86_SIMD
+  case PREFIX_SEARCH_SSE2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+  case PREFIX_SEARCH_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+static int BestSupported()
+{
+  if (Supported(PREFIX_SEARCH_AVX2)) {
+    return PREFIX_SEARCH_AVX2;
+  } else if (Supported(PREFIX_SEARCH_SSE2)) {
+    return PREFIX_SEARCH_SSE2;
+  } else {
+    return PREFIX_SEARCH_SCALAR;
+  }
+}
+
+static COUNT_FN CountFor(const int impl)
+{
+  switch (impl) {
+#if HAVE_X86_SIMD
+  case PREFIX_SEARCH_SSE2:
+    return CountSSE2;
+  case PREFIX_SEARCH_AVX2:
+    return CountAVX2;
+#endif
+  default:
+    return CountScalar;
+  }
+}
+
+// Chosen once at startup, so searches never test the CPU
+static int current_impl=BestSupported();
+static COUNT_FN current_count=CountFor(current_impl);
+
+
+ERROR_T SetPrefixSearch(const int impl)
+{
+  int i = (impl==PREFIX_SEARCH_AUTO) ? BestSupported() : impl;
+
+  if (!Supported(i)) {
+    return ERROR_UNIMPL;
+  }
+  current_impl=i;
+  current_count=CountFor(i);
+  return ERROR_NOERROR;
+}
+
+int GetPrefixSearch()
+{
+  return current_impl;
+}
+
+const char *PrefixSearchName(const int impl)
+{
+  return impl==PREFIX_SEARCH_AUTO ? "auto" :
+         impl==PREFIX_SEARCH_SCALAR ? "scalar" :
+         impl==PREFIX_SEARCH_SSE2 ? "sse2" :
+         impl==PREFIX_SEARCH_AVX2 ? "avx2" : "unknown";
+}
+
+
+SIZE_T CountPrefixesBelow(const PREFIX_T *p, const SIZE_T n, const PREFIX_T q)
+{
+  SIZE_T lo=0;
+  SIZE_T hi=n;
+
+  while (hi-lo>PREFIX_WINDOW) {
+    SIZE_T mid=(lo+hi)/2;
+    if (p[mid]<q) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo+current_count(p+lo,hi-lo,q);
+}
@@ -0,0 +1,34 @@
+#ifndef _keyprefix
+#define _keyprefix
+
+#include "global.h"
+
+//
+// Normalized key prefixes
+//
+// A prefix is the first four bytes of a key read as a big-endian
+// unsigned integer (zero padded for shorter keys), so comparing two
+// prefixes as integers gives the same order as memcmp on those bytes.
+// Equal prefixes say nothing about the rest of the key.
+//
+typedef unsigned int PREFIX_T;
+
+PREFIX_T MakeKeyPrefix(const BYTE_T *key, const SIZE_T keysize);
+
+// Implementations of the prefix search
+#define PREFIX_SEARCH_AUTO 0    // pick the best one this CPU supports
+#define PREFIX_SEARCH_SCALAR 1
+#define PREFIX_SEARCH_SSE2 2
+#define PREFIX_SEARCH_AVX2 3
+
+// Select an implementation; returns ERROR_UNIMPL if the CPU or the
+// build does not support it, in which case nothing changes
+ERROR_T SetPrefixSearch(const int impl);
+int GetPrefixSearch();
+const char *PrefixSearchName(const int impl);
+
+// Number of prefixes in the sorted array p[0..n-1] that are < q,
+// ie, the lower bound of q
+SIZE_T CountPrefixesBelow(const PREFIX_T *p, const SIZE_T n, const PREFIX_T q);
+
+#endif
@@ -0,0 +1,233 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "redolog.h"
+
+
+// Each record starts with its length and the checksum of its bytes
+#define REDOLOG_HEADER (2*sizeof(SIZE_T))
+
+static SIZE_T Checksum(const char *data, const SIZE_T len)
+{
+  // FNV-1a
+  SIZE_T h=2166136261u;
+
+  for (SIZE_T i=0;i<len;i++) {
+    h=(h^(BYTE_T)data[i])*16777619u;
+  }
+  return h;
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+RedoLog::RedoLog(const string &name) :
+  filename(name), fd(-1), end(0), durable(0), flushing(false), failed(false),
+  unflushed(0), groupsize(1), groupwait(0),
+  records(0), flushes(0), commits(0), bytes(0),
+  committime(0), maxcommittime(0)
+{
+  pthread_mutex_init(&lock,0);
+  pthread_cond_init(&changed,0);
+}
+
+RedoLog::~RedoLog()
+{
+  Close();
+  pthread_cond_destroy(&changed);
+  pthread_mutex_destroy(&lock);
+}
+
+ERROR_T RedoLog::Create()
+{
+  Close();
+
+  pthread_mutex_lock(&lock);
+  fd=open(filename.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644);
+  buffer.clear();
+  end=durable=0;
+  unflushed=0;
+  failed=false;
+  pthread_mutex_unlock(&lock);
+  return fd<0 ? ERROR_NOFILE : ERROR_NOERROR;
+}
+
+ERROR_T RedoLog::Close()
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (fd<0) {
+    return ERROR_NOERROR;
+  }
+  rc=Force(end);
+  pthread_mutex_lock(&lock);
+  close(fd);
+  fd=-1;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+ERROR_T RedoLog::Remove()
+{
+  ERROR_T rc=Close();
+
+  if (unlink(filename.c_str()) && errno!=ENOENT) {
+    return ERROR_NOFILE;
+  }
+  return rc;
+}
+
+ERROR_T RedoLog::ReadRecords(vector<string> &out) const
+{
+  int in=open(filename.c_str(),O_RDONLY);
+  string data;
+  char buf[65536];
+  ssize_t n;
+
+  out.clear();
+  if (in<0) {
+    return errno==ENOENT ? ERROR_NOERROR : ERROR_NOFILE;
+  }
+  while ((n=read(in,buf,sizeof(buf)))>0) {
+    data.append(buf,n);
+  }
+  close(in);
+  if (n<0) {
+    return ERROR_NOFILE;
+  }
+
+  // up to the first record that was not all written
+  for (size_t off=0; off+REDOLOG_HEADER<=data.size(); ) {
+    SIZE_T len, sum;
+    memcpy(&len,data.data()+off,sizeof(SIZE_T));
+    memcpy(&sum,data.data()+off+sizeof(SIZE_T),sizeof(SIZE_T));
+    if (len>data.size()-off-REDOLOG_HEADER ||
+	Checksum(data.data()+off+REDOLOG_HEADER,len)!=sum) {
+      break;
+    }
+    out.push_back(data.substr(off+REDOLOG_HEADER,len));
+    off+=REDOLOG_HEADER+len;
+  }
+  return ERROR_NOERROR;
+}
+
+void RedoLog::SetGroupCommit(const SIZE_T size, const SIZE_T wait)
+{
+  pthread_mutex_lock(&lock);
+  groupsize=size ? size : 1;
+  groupwait=wait;
+  pthread_mutex_unlock(&lock);
+}
+
+ERROR_T RedoLog::Append(const string &record, LSN_T &lsn)
+{
+  SIZE_T header[2];
+
+  header[0]=record.size();
+  header[1]=Checksum(record.data(),record.size());
+
+  pthread_mutex_lock(&lock);
+  if (fd<0) {
+    pthread_mutex_unlock(&lock);
+    return ERROR_NOFILE;
+  }
+  buffer.append((const char *)header,REDOLOG_HEADER);
+  buffer.append(record);
+  end+=REDOLOG_HEADER+record.size();
+  lsn=end;
+  records++;
+  bytes+=REDOLOG_HEADER+record.size();
+  if (++unflushed>=groupsize) {
+    // a commit may be waiting for its group to fill
+    pthread_cond_broadcast(&changed);
+  }
+  pthread_mutex_unlock(&lock);
+  return ERROR_NOERROR;
+}
+
+// Called with the lock held; drops it while the buffer is written
+ERROR_T RedoLog::Flush()
+{
+  string out;
+  LSN_T upto=end;
+  bool ok=true;
+
+  out.swap(buffer);
+  unflushed=0;
+  flushing=true;
+  pthread_mutex_unlock(&lock);
+
+  for (size_t off=0; off<out.size() && ok; ) {
+    ssize_t n=write(fd,out.data()+off,out.size()-off);
+    if (n<=0) {
+      ok=false;
+    } else {
+      off+=n;
+    }
+  }
+  if (ok && fdatasync(fd)) {
+    ok=false;
+  }
+
+  pthread_mutex_lock(&lock);
+  flushing=false;
+  flushes++;
+  if (ok) {
+    durable=upto;
+  } else {
+    // the records are lost, so nothing after them can be trusted
+    failed=true;
+  }
+  pthread_cond_broadcast(&changed);
+  return ok ? ERROR_NOERROR : ERROR_GENERAL;
+}
+
+ERROR_T RedoLog::Force(const LSN_T lsn, const bool commit)
+{
+  double start=now();
+  bool grouped=false;
+  ERROR_T rc=ERROR_NOERROR;
+
+  pthread_mutex_lock(&lock);
+  while (durable<lsn && !failed) {
+    if (flushing) {
+      // its records may or may not include ours
+      pthread_cond_wait(&changed,&lock);
+    } else if (commit && !grouped && unflushed<groupsize && groupwait) {
+      // give other commits a chance to share the flush
+      struct timespec deadline;
+      double t=start+groupwait/1e6;
+      deadline.tv_sec=(time_t)t;
+      deadline.tv_nsec=(long)((t-deadline.tv_sec)*1e9);
+      grouped=true;
+      while (!flushing && durable<lsn && unflushed<groupsize &&
+	     pthread_cond_timedwait(&changed,&lock,&deadline)!=ETIMEDOUT) {
+      }
+    } else {
+      Flush();
+    }
+  }
+  if (durable<lsn) {
+    rc=ERROR_GENERAL;
+  }
+  if (commit) {
+    double t=now()-start;
+    commits++;
+    committime+=t;
+    if (t>maxcommittime) {
+      maxcommittime=t;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
@@ -0,0 +1,81 @@
+#ifndef _redolog
+#define _redolog
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "global.h"
+
+using namespace std;
+
+// Position in the log: the offset just past a record
+typedef unsigned long long LSN_T;
+
+
+//
+// Redo log in the file "filestem.log", next to a disk's data
+//
+// Records are appended to a buffer in memory and go to the file, and
+// are synced, a group at a time.  Each record is its length and a
+// checksum followed by its bytes, so recovery can stop at a record a
+// crash left half written.  What a record says is up to the caller.
+//
+// All of the calls may be made from many threads at once.
+//
+class RedoLog {
+ private:
+  string filename;
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;     // a flush finished, or a record came in
+  string buffer;              // records appended but not yet written
+  LSN_T end;                  // just past the last record appended
+  LSN_T durable;              // just past the last record synced
+  bool flushing;              // a thread is writing the buffer out
+  bool failed;                // a write failed, so later records are lost
+  SIZE_T unflushed;           // records in the buffer
+  SIZE_T groupsize;
+  SIZE_T groupwait;           // microseconds
+  SIZE_T records, flushes, commits;
+  LSN_T bytes;
+  double committime, maxcommittime;
+
+  ERROR_T Flush();
+ public:
+  RedoLog(const string &filename);
+  RedoLog() { throw GenericException(); }
+  RedoLog(const RedoLog &rhs) { throw GenericException(); }
+  RedoLog & operator=(const RedoLog &rhs) { throw GenericException(); return *this; }
+  ~RedoLog();
+
+  // Start a new, empty log, or stop using it
+  ERROR_T Create();
+  ERROR_T Close();
+  // Throw away the log file; there is nothing left in it to redo
+  ERROR_T Remove();
+
+  // The whole records in the log file, oldest first, if there is one
+  ERROR_T ReadRecords(vector<string> &out) const;
+
+  // A commit waits for up to groupwait microseconds for groupsize
+  // records to be ready to go to the file together
+  void SetGroupCommit(const SIZE_T groupsize, const SIZE_T groupwait);
+
+  // Add a record to the buffer; lsn says where it ends
+  ERROR_T Append(const string &record, LSN_T &lsn);
+
+  // Wait until everything up to lsn is on disk.  A commit may wait
+  // for others to join its group; otherwise the log is written now.
+  ERROR_T Force(const LSN_T lsn, const bool commit=false);
+
+  SIZE_T GetNumRecords() const { return records; }
+  LSN_T  GetNumBytes() const { return bytes; }
+  SIZE_T GetNumFlushes() const { return flushes; }
+  SIZE_T GetNumCommits() const { return commits; }
+  // Seconds that commits waited for the log, in all and at most
+  double GetCommitTime() const { return committime; }
+  double GetMaxCommitTime() const { return maxcommittime; }
+};
+
+#endif
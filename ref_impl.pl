@@ -63,6 +63,25 @@ while ($line=<STDIN>) {
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
+  } elsif ($op eq "MLOOKUP") { 
+    $rest=~s/#.*//;
+    @keys=split(/\s+/,$rest);
+    print STDERR "Looking up @keys\n" if $debug;
+    print join(" ", "OK", map { defined $content{$_} ? $content{$_} : "FAIL" } @keys), "\n";
+  } elsif ($op eq "MINSERT") { 
+    $rest=~s/#.*//;
+    @words=split(/\s+/,$rest);
+    print STDERR "Inserting @words\n" if $debug;
+    @replies=("OK");
+    while (($key, $value) = splice(@words,0,2)) {
+      if (defined $content{$key} || Bug()) { 
+        push @replies, "FAIL";
+      } else {
+        $content{$key}=$value;
+        push @replies, "OK";
+      }
+    }
+    print join(" ", @replies), "\n";
   } elsif ($op eq "DISPLAY") { 
     print STDERR "Displaying content in sorted order\n" if $debug;
     print "OK BEGIN DISPLAY\n";
@@ -70,6 +89,22 @@ while ($line=<STDIN>) {
       print "($key, $content{$key})\n";
     }
     print "OK END DISPLAY\n";
+  } elsif ($op eq "SCAN") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    print STDERR "Scanning content from $lo to $hi\n" if $debug;
+    print "OK BEGIN SCAN\n";
+    foreach $key (sort keys %content) {
+      print "($key, $content{$key})\n" if $key ge $lo && $key le $hi;
+    }
+    print "OK END SCAN\n";
+  } elsif ($op eq "RSCAN") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    print STDERR "Scanning content from $hi down to $lo\n" if $debug;
+    print "OK BEGIN RSCAN\n";
+    foreach $key (reverse sort keys %content) {
+      print "($key, $content{$key})\n" if $key ge $lo && $key le $hi;
+    }
+    print "OK END RSCAN\n";
   } elsif ($op eq "DEINIT") {
     print STDERR "Got a deinit.  Finishing up now\n" if $debug;
     print "OK\n";
@@ -1,9 +1,14 @@
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <strstream>
+#include <sstream>
 #include <fstream>
+#include <pthread.h>
+#include <sys/time.h>
+#include <map>
 #include "btree.h"
 
 
@@ -11,7 +16,217 @@ using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim [--threads N [--concurrent]] [--log groupsize] filestem cachesize < specfile \n";
+}
+
+// With INIT ... TOMBSTONE, compact this many leaves every so many operations
+#define SIM_COMPACT_EVERY 16
+#define SIM_COMPACT_BUDGET 1
+
+// With --threads, the INSERT, UPDATE, DELETE and LOOKUP operations
+// between two others are run up to this many at a time by the worker
+// threads, and their replies printed in the order they came in
+#define SIM_THREAD_BATCH 4096
+
+struct SimOp {
+  string action, key, value;
+  string out;   // the reply
+  string err;   // and anything said on cerr
+};
+
+struct SimWorker {
+  BTreeIndex       *btree;
+  vector<SimOp *>   ops;        // this batch's
+  SIZE_T            numops;     // over the whole run
+  double            totaltime;
+  double            maxtime;
+  SIZE_T            restarts;
+  pthread_t         thread;
+};
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+// Operations on just one key, which the workers can run
+static bool IsKeyOp(const string &action)
+{
+  return action=="INSERT" || action=="UPDATE" || action=="DELETE" || action=="LOOKUP";
+}
+
+static void RunKeyOp(BTreeIndex *btree, SimOp &op)
+{
+  ostringstream out, err;
+  KEY_T k;
+  VALUE_T lookup_value;
+  ERROR_T rc;
+
+  if (!btree) { 
+    // INIT failed
+    out <<"FAIL"<<endl;
+    err <<"No index\n";
+  } else if (op.action == "INSERT") {
+    if ((rc=btree->MakeKey(op.key.c_str(),k)) ||
+	(rc=btree->Insert(k,VALUE_T(op.value.c_str())))!=ERROR_NOERROR) { 
+      out <<"FAIL"<<endl;
+      err <<"Can't insert due to error "<<rc<<"\n";
+    } else {
+      out <<"OK\n";
+    }
+  } else if (op.action == "UPDATE") {
+    if ((rc=btree->MakeKey(op.key.c_str(),k)) ||
+	(rc=btree->Update(k,VALUE_T(op.value.c_str())))!=ERROR_NOERROR) { 
+      out <<"FAIL" <<endl;
+      err <<"Can't update due to error "<<rc<<"\n";
+    } else {
+      out <<"OK\n";
+    }
+  } else if (op.action == "DELETE") {
+    if ((rc=btree->MakeKey(op.key.c_str(),k)) ||
+	(rc=btree->Delete(k))!=ERROR_NOERROR) { 
+      out <<"FAIL"<<endl;
+      err <<"Can't delete due to error "<<rc<<endl;
+    } else {
+      out <<"OK\n";
+    }
+  } else {
+    if ((rc=btree->MakeKey(op.key.c_str(),k)) ||
+	(rc=btree->Lookup(k,lookup_value))!=ERROR_NOERROR) { 
+      out <<"FAIL"<< endl;
+      err <<"Can't lookup due to error "<<rc<<endl;
+    } else {
+      out <<"OK ";
+      for (unsigned int i=0; i<lookup_value.length; i++) {
+	out << lookup_value.data[i];
+      }
+      out << endl;
+    }
+  }
+  op.out=out.str();
+  op.err=err.str();
+}
+
+static void *RunSimWorker(void *arg)
+{
+  SimWorker *w=(SimWorker *)arg;
+
+  for (SIZE_T i=0; i<w->ops.size(); i++) {
+    double start=now();
+    RunKeyOp(w->btree,*w->ops[i]);
+    double t=now()-start;
+    w->numops++;
+    w->totaltime+=t;
+    if (t>w->maxtime) {
+      w->maxtime=t;
+    }
+  }
+  // this thread's, as each batch has new threads
+  w->restarts+=BTreeIndex::GetNumRestarts();
+  return 0;
+}
+
+// FNV-1a of the key as stored, so that keys that are written
+// differently but are the same key go to the same worker
+static SIZE_T HashKey(const KEY_T &key)
+{
+  SIZE_T h=2166136261U;
+
+  for (SIZE_T i=0; i<key.length; i++) {
+    h=(h^(unsigned char)key.data[i])*16777619U;
+  }
+  return h;
+}
+
+// Run the batch on the workers and print its replies.  Partitioned,
+// each key's operations all go to one worker, in order, so the replies
+// are those of running the batch serially.  Concurrent, they are
+// dealt out in turn, and operations on the same key may run in any
+// order.
+static void RunBatch(BTreeIndex *btree, vector<SimOp> &batch, vector<SimWorker> &workers,
+		     const bool concurrent, double &elapsed)
+{
+  const SIZE_T n=workers.size();
+  KEY_T k;
+
+  if (batch.empty()) {
+    return;
+  }
+  if (!btree) { 
+    // they all fail, and no worker may run without an index set up for them
+    for (SIZE_T i=0; i<batch.size(); i++) {
+      RunKeyOp(btree,batch[i]);
+      cout << batch[i].out;
+      cerr << batch[i].err;
+    }
+    batch.clear();
+    return;
+  }
+  for (SIZE_T w=0; w<n; w++) {
+    workers[w].btree=btree;
+    workers[w].ops.clear();
+  }
+  for (SIZE_T i=0; i<batch.size(); i++) {
+    SIZE_T w=i%n;
+    if (!concurrent) {
+      // a bad key fails the same wherever it goes
+      w=btree->MakeKey(batch[i].key.c_str(),k) ? 0 : HashKey(k)%n;
+    }
+    workers[w].ops.push_back(&batch[i]);
+  }
+  double start=now();
+  for (SIZE_T w=0; w<n; w++) {
+    pthread_create(&workers[w].thread,0,RunSimWorker,&workers[w]);
+  }
+  for (SIZE_T w=0; w<n; w++) {
+    pthread_join(workers[w].thread,0);
+  }
+  elapsed+=now()-start;
+  for (SIZE_T i=0; i<batch.size(); i++) {
+    cout << batch[i].out;
+    cerr << batch[i].err;
+  }
+  batch.clear();
+}
+
+// After a failed INIT there is no index, so that what follows fails
+// rather than running on one that is half set up
+static void DropIndex(BTreeIndex *&btree, BufferCache &cache)
+{
+  SIZE_T superblocknum;
+  LSN_T lsn;
+
+  // ERROR_NONEXISTENT if it never attached; otherwise the redo log,
+  // if it was started, gets the superblock write like any other
+  if (btree->Detach(superblocknum)==ERROR_NOERROR) { 
+    cache.Commit(lsn);
+    cache.WaitForCommit(lsn);
+  }
+  delete btree;
+  btree=0;
+}
+
+// SCAN output, in the same form as DISPLAY
+static bool PrintPair(const KEY_T &key, const VALUE_T &value, void *arg)
+{
+  BTreeIndex *btree=(BTreeIndex *)arg;
+
+  cout << "(";
+  btree->PrintKey(cout,key);
+  cout << ",";
+  for (unsigned int k=0; k<value.length; k++) {
+    cout << value.data[k];
+  }
+  cout << ")\n";
+  return true;
+}
+
+// A MINSERT pair's bytes, to find where it was given after sorting
+static string PairBytes(const KeyValuePair &p)
+{
+  return string((const char *)p.key.data,p.key.length)+string((const char *)p.value.data,p.value.length);
 }
 
 
@@ -20,18 +235,38 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  SIZE_T nthreads=0;
+  bool concurrent=false;
+  SIZE_T groupsize=0;
+  int arg=1;
+
+  while (arg<argc && argv[arg][0]=='-') {
+    if (!strcmp(argv[arg],"--threads") && arg+1<argc && atoi(argv[arg+1])>0) {
+      nthreads=atoi(argv[arg+1]);
+      arg+=2;
+    } else if (!strcmp(argv[arg],"--concurrent")) {
+      concurrent=true;
+      arg++;
+    } else if (!strcmp(argv[arg],"--log") && arg+1<argc && atoi(argv[arg+1])>0) {
+      groupsize=atoi(argv[arg+1]);
+      arg+=2;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (argc-arg != 2 || (concurrent && !nthreads)){
     usage();
     return 1;
   }
 
-  char *filestem=argv[1];
-  SIZE_T cachesize=atoi(argv[2]);
+  char *filestem=argv[arg];
+  SIZE_T cachesize=atoi(argv[arg+1]);
   SIZE_T superblocknum;
 
   FILE *file; 
-  char line[1024];
   int max = 8192;
+  char line[8192];
   ERROR_T rc;
   
   // We'll connect to the btree only once and then
@@ -40,7 +275,11 @@ int main(int argc, char *argv[])
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
   // will be set on init
-  BTreeIndex *btree;
+  BTreeIndex *btree=0;
+  // with --threads
+  vector<SimWorker> workers(nthreads);
+  vector<SimOp> batch;
+  double elapsed=0;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
@@ -58,46 +297,242 @@ int main(int argc, char *argv[])
     istrstream is(line2.c_str(),line2.size());
     is >> action >> key >> value;
 
+    if (nthreads && IsKeyOp(action)) {
+      batch.push_back(SimOp());
+      batch.back().action=action;
+      batch.back().key=key;
+      batch.back().value=value;
+      if (batch.size()>=SIM_THREAD_BATCH) {
+	RunBatch(btree,batch,workers,concurrent,elapsed);
+      }
+      continue;
+    }
+    // everything else waits for the operations before it
+    RunBatch(btree,batch,workers,concurrent,elapsed);
+
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
-      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
+      // Anything after the sizes (up to a comment) is an index option
+      int nodeformat=BTREE_FORMAT_ROW;
+      int keytype=BTREE_KEY_BYTES;
+      string opt;
+      bool tombstones=false;
+      bool redistribute=false;
+      bool topdown=false;
+      bool copy=false;
+      SIZE_T fill=BTREE_DEFAULT_SPLITFILL;
+      SIZE_T ratio=BTREE_DEFAULT_SPLITRATIO;
+      SIZE_T appendratio=BTREE_DEFAULT_APPENDRATIO;
+      SIZE_T buffer=0;
+      bool badopt=false;
+      while (is >> opt && opt[0]!='#') { 
+	if (opt == "COLUMN") { 
+	  nodeformat=BTREE_FORMAT_COLUMN;
+	} else if (opt == "PREFIX") { 
+	  nodeformat=BTREE_FORMAT_PREFIX;
+	} else if (opt == "INT") { 
+	  keytype=BTREE_KEY_INT;
+	} else if (opt == "TOMBSTONE") { 
+	  tombstones=true;
+	} else if (opt == "REDISTRIBUTE") { 
+	  redistribute=true;
+	} else if (opt == "TOPDOWN") { 
+	  topdown=true;
+	} else if (opt == "COPY") { 
+	  copy=true;
+	} else if (opt.compare(0,5,"FILL=")==0) { 
+	  fill=atoi(opt.c_str()+5);
+	} else if (opt.compare(0,6,"RATIO=")==0) { 
+	  ratio=atoi(opt.c_str()+6);
+	} else if (opt.compare(0,7,"APPEND=")==0) { 
+	  appendratio=atoi(opt.c_str()+7);
+	} else if (opt.compare(0,7,"BUFFER=")==0) { 
+	  buffer=atoi(opt.c_str()+7);
+	} else {
+	  cerr << "Unknown INIT option "<<opt<<"\n";
+	  badopt=true;
+	}
+      }
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,nodeformat,keytype);
+      if (badopt) { 
+	cout << "FAIL\n";
+	DropIndex(btree,cache);
+      } else if ((rc=btree->SetSplitPolicy(fill,ratio,appendratio))!=ERROR_NOERROR) {
+	cerr << "Bad split policy\n";
+	cout << "FAIL\n";
+	DropIndex(btree,cache);
+      } else if (buffer && (rc=btree->SetMessageBuffers(buffer))!=ERROR_NOERROR) {
+	cerr << "Bad message buffer size\n";
+	cout << "FAIL\n";
+	DropIndex(btree,cache);
+      } else if (tombstones && (rc=btree->SetDeleteMode(BTREE_DELETE_TOMBSTONE))!=ERROR_NOERROR) {
+	cerr << "Can't keep tombstones due to error "<<rc<<"\n";
+	cout << "FAIL\n";
+	DropIndex(btree,cache);
+      } else if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
+	DropIndex(btree,cache);
+      } else if (groupsize && (rc=cache.StartLog(groupsize))!=ERROR_NOERROR) {
+	// the new btree is on the disk; from here on, writes are logged
+	cerr << "Can't start the redo log due to error "<<rc<<"\n";
+	cout << "FAIL\n";
+	DropIndex(btree,cache);
       } else {
+	if (tombstones) { 
+	  // the leaves were made with room for them
+	  btree->SetCompaction(SIM_COMPACT_EVERY,SIM_COMPACT_BUDGET);
+	}
+	if (redistribute) { 
+	  btree->SetSplitMode(BTREE_SPLIT_REDISTRIBUTE);
+	}
+	if (topdown) { 
+	  btree->SetInsertMode(BTREE_INSERT_TOPDOWN);
+	}
+	if (copy && (rc=btree->SetWriteMode(BTREE_WRITE_COPY))!=ERROR_NOERROR) { 
+	  // message buffers change nodes in place
+	  cerr << "Can't copy on write due to error "<<rc<<"\n";
+	  cout << "FAIL\n";
+	  DropIndex(btree,cache);
+	  continue;
+	}
+	if (nthreads && (rc=btree->SetLatchMode(BTREE_LATCH_OPTIMISTIC))!=ERROR_NOERROR) { 
+	  // copy on write has one writer at a time
+	  cerr << "Can't run threads due to error "<<rc<<"\n";
+	  cout << "FAIL\n";
+	  DropIndex(btree,cache);
+	  continue;
+	}
+	if (nthreads) { 
+	  // writes crab down the tree, lookups take no latches
+	  for (SIZE_T w=0; w<nthreads; w++) {
+	    workers[w].numops=0;
+	    workers[w].totaltime=0;
+	    workers[w].maxtime=0;
+	    workers[w].restarts=0;
+	  }
+	  elapsed=0;
+	}
 	cout << "OK\n";
       }
-    } else if (action == "INSERT"){
-      if ((rc=btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't insert due to error "<<rc<<"\n";
+    } else if (!btree && !action.empty() && action[0]!='#') {
+      cout << "FAIL\n";
+      cerr << "No index\n";
+    } else if (IsKeyOp(action)) {
+      SimOp op;
+      op.action=action;
+      op.key=key;
+      op.value=value;
+      RunKeyOp(btree,op);
+      cout << op.out;
+      cerr << op.err;
+    } else if (action == "MLOOKUP"){
+      // any number of keys, up to a comment
+      vector<string> words;
+      vector<KEY_T> keys;
+      vector<VALUE_T> values;
+      vector<ERROR_T> statuses;
+      string word;
+      words.push_back(key);
+      words.push_back(value);
+      while (is >> word) { 
+	words.push_back(word);
+      }
+      rc=ERROR_NOERROR;
+      for (unsigned int i=0; i<words.size() && !words[i].empty() && words[i][0]!='#' && !rc; i++) { 
+	keys.push_back(KEY_T());
+	rc=btree->MakeKey(words[i].c_str(),keys.back());
+      }
+      if (rc || (rc=btree->LookupBatch(keys,values,statuses))!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't multi-lookup due to error "<<rc<<endl;
       } else {
-        cout <<"OK\n";
+	cout <<"OK";
+	for (unsigned int i=0; i<keys.size(); i++) { 
+	  cout <<" ";
+	  if (statuses[i]) { 
+	    cout <<"FAIL";
+	  } else {
+	    for (unsigned int k=0; k<values[i].length; k++) {
+	      cout << values[i].data[k];
+	    }
+	  }
+	}
+	cout << endl;
+      }
+    } else if (action == "MINSERT"){
+      // key value pairs, up to a comment; the replies go in this order
+      vector<string> words;
+      vector<KeyValuePair> pairs;
+      vector<ERROR_T> statuses;
+      vector<ERROR_T> replies;
+      map<string, vector<unsigned int> > given;
+      string word;
+      words.push_back(key);
+      words.push_back(value);
+      while (is >> word) { 
+	words.push_back(word);
+      }
+      rc=ERROR_NOERROR;
+      for (unsigned int i=0; i<words.size() && !words[i].empty() && words[i][0]!='#' && !rc; i+=2) { 
+	KEY_T k;
+	if (i+1>=words.size() || words[i+1].empty() || words[i+1][0]=='#') { 
+	  rc=ERROR_SIZE;
+	} else if (!(rc=btree->MakeKey(words[i].c_str(),k))) { 
+	  pairs.push_back(KeyValuePair(k,VALUE_T(words[i+1].c_str())));
+	  given[PairBytes(pairs.back())].push_back(pairs.size()-1);
+	}
       }
-    } else if (action == "UPDATE"){
-      if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL" <<endl;
-	cerr <<"Can't update due to error "<<rc<<"\n";
+      if (rc || (rc=btree->InsertBatch(pairs,statuses))!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't multi-insert due to error "<<rc<<endl;
       } else {
-        cout <<"OK\n";
+	// InsertBatch sorted the pairs, keeping equal ones in order
+	replies.resize(pairs.size());
+	for (unsigned int i=0; i<pairs.size(); i++) { 
+	  vector<unsigned int> &at=given[PairBytes(pairs[i])];
+	  replies[at.front()]=statuses[i];
+	  at.erase(at.begin());
+	}
+	cout <<"OK";
+	for (unsigned int i=0; i<replies.size(); i++) { 
+	  cout << (replies[i] ? " FAIL" : " OK");
+	}
+	cout << endl;
       }
-    } else if (action == "DELETE"){
-      if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't delete due to error "<<rc<<endl;
+    } else if (action == "SCAN") {
+      KEY_T lo, hi;
+      if ((rc=btree->MakeKey(key.c_str(),lo)) ||
+	  (rc=btree->MakeKey(value.c_str(),hi))) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't scan due to error "<<rc<<endl;
       } else {
-        cout <<"OK\n";
+	cout <<"OK BEGIN SCAN\n";
+	if ((rc=btree->Scan(lo,hi,PrintPair,btree))!=ERROR_NOERROR) { 
+	  cerr <<"Scan stopped due to error "<<rc<<endl;
+	}
+	cout <<"OK END SCAN\n";
       }
-    } else if (action == "LOOKUP"){
-      VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<< endl;
-	cerr <<"Can't lookup due to error "<<rc<<endl;
+    } else if (action == "RSCAN") {
+      // as SCAN, from hi down to lo, through a cursor
+      BTreeCursor cursor(btree);
+      KEY_T lo, hi, k;
+      VALUE_T v;
+      if ((rc=btree->MakeKey(key.c_str(),lo)) ||
+	  (rc=btree->MakeKey(value.c_str(),hi))) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't scan due to error "<<rc<<endl;
       } else {
-        cout <<"OK ";
- 	for (unsigned int k=0; k<lookup_value.length; k++) {
- 	    cout << lookup_value.data[k];
+	cout <<"OK BEGIN RSCAN\n";
+	for (rc=cursor.SeekBack(hi); rc==ERROR_NOERROR; rc=cursor.Prev()) { 
+	  if ((rc=cursor.GetKey(k)) || (rc=cursor.GetVal(v)) || k<lo) { 
+	    break;
+	  }
+	  PrintPair(k,v,btree);
 	}
- 	cout << endl;
+	if (rc && rc!=ERROR_NONEXISTENT) { 
+	  cerr <<"Reverse scan stopped due to error "<<rc<<endl;
+	}
+	cout <<"OK END RSCAN\n";
       }
     } else if (action == "DISPLAY") {
       // This should always be OK
@@ -105,6 +540,20 @@ int main(int argc, char *argv[])
       btree->Display(cout,BTREE_SORTED_KEYVAL);
       cout <<"OK END DISPLAY\n";
     } else if (action == "DEINIT"){
+      BTreeFillStats fill;
+      btree->GetFillStats(fill);
+      SIZE_T appendhits=btree->GetNumAppendHits();
+      SIZE_T appendmisses=btree->GetNumAppendMisses();
+      SIZE_T nodewrites=btree->GetNumNodeWrites();
+      SIZE_T writeops=btree->GetNumWriteOps();
+      SIZE_T decodedhits=btree->GetNumDecodedHits();
+      SIZE_T decodedmisses=btree->GetNumDecodedMisses();
+      SIZE_T buffered=btree->GetMessageBuffers();
+      SIZE_T bufferedmessages=btree->GetNumBufferedMessages();
+      SIZE_T appliedmessages=btree->GetNumAppliedMessages();
+      SIZE_T leafbatches=btree->GetNumLeafBatches();
+      SIZE_T latches=cache.GetNumLatches();
+      SIZE_T latchwaits=cache.GetNumLatchWaits();
       if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
 	cout << "FAIL"<<endl;
 	cerr << "Can't detach btree due to error "<<rc<<endl;
@@ -115,10 +564,65 @@ int main(int argc, char *argv[])
 	} else {
 	  delete btree;
 	  cout << "OK\n";
+
+	  cerr << "Performance statistics:\n";
+	  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+	  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+	  cerr << "numprefetches   = "<<cache.GetNumPrefetches()<<endl;
+	  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+	  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+	  cerr << "decodedhits     = "<<decodedhits<<endl;
+	  cerr << "decodedmisses   = "<<decodedmisses<<endl;
+	  cerr << "decodedhitrate  = "<<(decodedhits+decodedmisses ? (double)decodedhits/(decodedhits+decodedmisses) : 0.0)<<endl;
+	  cerr << "nodewrites      = "<<nodewrites<<endl;
+	  cerr << "nodewrites/op   = "<<(writeops ? (double)nodewrites/writeops : 0.0)<<endl;
+	  cerr << "appendhits      = "<<appendhits<<endl;
+	  cerr << "appendmisses    = "<<appendmisses<<endl;
+	  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+	  cerr << "Fill statistics:\n" << fill;
+	  if (buffered) {
+	    cerr << "Buffer statistics:\n";
+	    cerr << "bufferratio     = "<<buffered<<"%\n";
+	    cerr << "buffered        = "<<bufferedmessages<<endl;
+	    cerr << "applied         = "<<appliedmessages<<endl;
+	    cerr << "leafbatches     = "<<leafbatches<<endl;
+	    cerr << "applied/batch   = "<<(leafbatches ? (double)appliedmessages/leafbatches : 0.0)<<endl;
+	  }
+	  if (nthreads) {
+	    SIZE_T ops=0;
+	    SIZE_T restarts=0;
+	    cerr << "Thread statistics:\n";
+	    cerr << "threads         = "<<nthreads<<(concurrent ? " (concurrent)" : " (partitioned by key)")<<endl;
+	    for (SIZE_T w=0; w<nthreads; w++) {
+	      cerr << "thread "<<w<<"        = "<<workers[w].numops<<" ops, latency "
+		   <<(workers[w].numops ? 1e6*workers[w].totaltime/workers[w].numops : 0.0)
+		   <<" us mean, "<<1e6*workers[w].maxtime<<" us max\n";
+	      ops+=workers[w].numops;
+	      restarts+=workers[w].restarts;
+	    }
+	    cerr << "throughput      = "<<(elapsed>0 ? ops/elapsed : 0.0)<<" ops/s\n";
+	    cerr << "latches         = "<<latches<<endl;
+	    cerr << "latchwaits      = "<<latchwaits<<" ("<<(latches ? 100.0*latchwaits/latches : 0.0)<<"%)\n";
+	    cerr << "restarts        = "<<restarts<<endl;
+	  }
+	  if (groupsize) {
+	    SIZE_T commits=cache.GetNumCommits();
+	    SIZE_T flushes=cache.GetNumLogFlushes();
+	    cerr << "Log statistics:\n";
+	    cerr << "groupsize       = "<<groupsize<<endl;
+	    cerr << "logrecords      = "<<cache.GetNumLogRecords()<<endl;
+	    cerr << "logbytes        = "<<cache.GetNumLogBytes()<<endl;
+	    cerr << "logbytes/op     = "<<(writeops ? (double)cache.GetNumLogBytes()/writeops : 0.0)<<endl;
+	    cerr << "logflushes      = "<<flushes<<endl;
+	    cerr << "commits/flush   = "<<(flushes ? (double)commits/flushes : 0.0)<<endl;
+	    cerr << "commit latency  = "<<(commits ? 1e6*cache.GetCommitTime()/commits : 0.0)
+		 <<" us mean, "<<1e6*cache.GetMaxCommitTime()<<" us max\n";
+	  }
 	}
       }
     }
   }
+  RunBatch(btree,batch,workers,concurrent,elapsed);
     
   fclose(file);
 
@@ -0,0 +1,84 @@
+#!/usr/bin/perl -w
+
+# Checks that a bulk load that fails gives back every block it took:
+# loads that end in an out of order key, or that run out of space, are
+# repeated on one disk, and then the whole load still fits and an
+# insert still works.  The index is first filled and emptied by sim so
+# that the load takes blocks from the free list as well as from the
+# run of blocks never used.
+
+$diskstem="__bulkload";
+$numblocks=1024;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=1024;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+# about a third of the disk at full leaves
+$numkeys=20000;
+$numfailed=4;
+
+$#ARGV==-1 or die "usage: test_bulkload.pl\n";
+
+$ENV{PATH}.=":.";
+
+open(SPEC,">$diskstem.spec") or die "can't write $diskstem.spec\n";
+print SPEC "INIT 8 8\n";
+for ($i=0;$i<2000;$i++) {
+  printf SPEC "INSERT k%07d v%07d\n",$i*7,$i;
+}
+for ($i=0;$i<2000;$i++) {
+  printf SPEC "DELETE k%07d\n",$i*7;
+}
+print SPEC "DEINIT\n";
+close(SPEC);
+
+open(GOOD,">$diskstem.good") or die "can't write $diskstem.good\n";
+open(BAD,">$diskstem.bad") or die "can't write $diskstem.bad\n";
+for ($i=0;$i<$numkeys;$i++) {
+  printf GOOD "k%07d v%07d\n",$i,$i;
+  printf BAD "k%07d v%07d\n",$i,$i;
+}
+# out of order
+printf BAD "k%07d v%07d\n",0,0;
+close(GOOD);
+close(BAD);
+
+$numerr=0;
+
+# The tools say whether they worked; btree_sane and btree_insert exit
+# with zero either way
+sub check {
+  my ($what,$cmd,$worked,$shouldwork)=@_;
+  my $out=`$cmd 2>&1`;
+  my $works = $? == 0 && $out =~ /$worked/;
+  if ($works != $shouldwork) {
+    print "$what should ".($shouldwork ? "work" : "fail")." but ".($works ? "works" : "fails")."\n";
+    $numerr++;
+  }
+}
+
+system "deletedisk $diskstem >/dev/null 2>&1";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat >/dev/null 2>&1";
+check("filling and emptying the index","sim $diskstem $cachesize < $diskstem.spec","OK",1);
+for ($i=0;$i<$numfailed;$i++) {
+  check("load $i with an out of order key","btree_bulkload $diskstem $cachesize < $diskstem.bad","Bulk load of",0);
+  check("sanity check after load $i","btree_sane $diskstem $cachesize","Sanity check succeded",1);
+}
+# one key per leaf does not fit
+check("load with fill factor 0.01","btree_bulkload $diskstem $cachesize 0.01 < $diskstem.good","Bulk load of",0);
+check("sanity check after the load that ran out of space","btree_sane $diskstem $cachesize","Sanity check succeded",1);
+check("load after the failed ones","btree_bulkload $diskstem $cachesize < $diskstem.good","Bulk load of",1);
+check("sanity check after the load","btree_sane $diskstem $cachesize","Sanity check succeded",1);
+check("insert after the load","btree_insert $diskstem $cachesize z0000000 v0000000","Insert succeeded",1);
+check("sanity check after the insert","btree_sane $diskstem $cachesize","Sanity check succeded",1);
+
+system "deletedisk $diskstem >/dev/null 2>&1";
+unlink "$diskstem.spec", "$diskstem.good", "$diskstem.bad";
+
+print "Summary:  $numerr errors found\n";
+exit($numerr ? 1 : 0);
@@ -0,0 +1,78 @@
+#!/usr/bin/perl -w
+
+# Checks that sim --threads never runs its workers on an index that
+# INIT could not set up for them: an INIT that fails is followed by
+# operations that all fail, and a later INIT works as usual.  Copy on
+# write can't be latched, and message buffers can't copy on write.
+
+$diskstem="__threads";
+$numblocks=1024;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=1024;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+$numkeys=100;
+
+$#ARGV==-1 or die "usage: test_threads.pl\n";
+
+$ENV{PATH}.=":.";
+
+@badinits=("INIT 8 8 COPY", "INIT 8 8 BUFFER=30 COPY");
+@simflags=("--threads 4", "--threads 4 --log 4");
+
+# each failed INIT, with operations that should fail after it, and
+# then one that works, with the same operations
+@spec=();
+@expect=();
+foreach $init (@badinits) {
+  push @spec, $init;
+  push @expect, "FAIL";
+  for ($i=0;$i<$numkeys;$i++) {
+    push @spec, sprintf("INSERT k%07d v%07d",$i,$i), sprintf("LOOKUP k%07d",$i);
+    push @expect, "FAIL", "FAIL";
+  }
+  push @spec, "MLOOKUP k0000000 k0000001", "SCAN k0000000 k9999999", "DISPLAY";
+  push @expect, "FAIL", "FAIL", "FAIL";
+}
+push @spec, "INIT 8 8";
+push @expect, "OK";
+for ($i=0;$i<$numkeys;$i++) {
+  push @spec, sprintf("INSERT k%07d v%07d",$i,$i), sprintf("LOOKUP k%07d",$i);
+  push @expect, "OK", sprintf("OK v%07d",$i);
+}
+push @spec, "DEINIT";
+push @expect, "OK";
+
+open(SPEC,">$diskstem.spec") or die "can't write $diskstem.spec\n";
+print SPEC map { "$_\n" } @spec;
+close(SPEC);
+
+$numerr=0;
+foreach $flags (@simflags) {
+  system "deletedisk $diskstem >/dev/null 2>&1";
+  system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat >/dev/null 2>&1";
+  @out=`sim $flags $diskstem $cachesize < $diskstem.spec 2>/dev/null`;
+  chomp(@out);
+  if ($?) {
+    print "sim $flags exited with status $?\n";
+    $numerr++;
+  }
+  for ($i=0;$i<=$#expect;$i++) {
+    $got = $i<=$#out ? $out[$i] : "(nothing)";
+    if ($got ne $expect[$i]) {
+      print "sim $flags: \"$spec[$i]\" should say \"$expect[$i]\" but says \"$got\"\n";
+      $numerr++;
+      last;
+    }
+  }
+}
+system "deletedisk $diskstem >/dev/null 2>&1";
+unlink "$diskstem.spec";
+
+print "Summary:  $numerr errors found\n";
+exit($numerr ? 1 : 0);